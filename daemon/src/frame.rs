@@ -0,0 +1,416 @@
+//! Length-prefixed binary framing (IPC v2).
+//!
+//! Every frame starts with a fixed 16-byte little-endian header:
+//! `u32 body_len | u8 kind | u8 flags | u16 reserved | u64 id`.
+//! Bodies are a fixed-layout struct followed by raw UTF-8 slices, so neither
+//! side escapes text or scans for delimiters. See `docs/IPC.md`.
+
+use crate::protocol::{
+    CancelRequest, ContextEdit, DaemonRequest, DaemonResponse, ErrorCode, Language, PingRequest,
+    PredictMode, PredictRequest, PredictionSource, RequestBody, ResponseBody,
+};
+
+pub const HEADER_LEN: usize = 16;
+pub const MAX_BODY_LEN: usize = 1 << 20;
+
+const KIND_PREDICT: u8 = 0x01;
+const KIND_PING: u8 = 0x02;
+const KIND_CANCEL: u8 = 0x03;
+const KIND_PREDICT_DELTA: u8 = 0x04;
+const KIND_PREDICT_REPLY: u8 = 0x81;
+const KIND_PONG: u8 = 0x82;
+const KIND_GHOST_DELTA: u8 = 0x83;
+const KIND_ERROR: u8 = 0x8f;
+
+/// Header flag on a predict frame asking for ghost-delta frames.
+const FLAG_STREAM: u8 = 0x01;
+/// Header flag on a predict frame whose body carries a session id.
+const FLAG_SESSION: u8 = 0x02;
+
+const PREDICT_FIXED_LEN: usize = 16;
+const PREDICT_DELTA_FIXED_LEN: usize = 24;
+const EDIT_FIXED_LEN: usize = 12;
+const PREDICT_REPLY_FIXED_LEN: usize = 16;
+const ERROR_FIXED_LEN: usize = 8;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FrameHeader {
+    pub body_len: usize,
+    pub kind: u8,
+    pub flags: u8,
+    pub id: u64,
+}
+
+pub fn decode_header(bytes: &[u8; HEADER_LEN]) -> FrameHeader {
+    FrameHeader {
+        body_len: u32::from_le_bytes(bytes[0..4].try_into().unwrap()) as usize,
+        kind: bytes[4],
+        flags: bytes[5],
+        id: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+    }
+}
+
+fn read_u32(body: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(body[offset..offset + 4].try_into().unwrap())
+}
+
+fn read_u16(body: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes(body[offset..offset + 2].try_into().unwrap())
+}
+
+fn read_u64(body: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(body[offset..offset + 8].try_into().unwrap())
+}
+
+/// Reads the `u16 max_tokens | u8 language | u8 mode | u32 latency_budget_ms`
+/// block both predict layouts share.
+fn read_predict_options(body: &[u8], offset: usize) -> Result<PredictRequest, String> {
+    let language = match body[offset + 2] {
+        0 => Language::Zh,
+        1 => Language::En,
+        other => return Err(format!("unknown language {other}")),
+    };
+    let mode = match body[offset + 3] {
+        0 => PredictMode::Next,
+        1 => PredictMode::Fim,
+        other => return Err(format!("unknown mode {other}")),
+    };
+    Ok(PredictRequest {
+        prefix: String::new(),
+        suffix: String::new(),
+        language,
+        mode,
+        max_tokens: read_u16(body, offset) as u32,
+        latency_budget_ms: read_u32(body, offset + 4) as u64,
+        stream: false,
+        session: None,
+        edits: None,
+        cursor: 0,
+    })
+}
+
+fn take_str<'a>(body: &'a [u8], offset: &mut usize, len: usize) -> Result<&'a str, String> {
+    let end = offset
+        .checked_add(len)
+        .filter(|end| *end <= body.len())
+        .ok_or_else(|| "frame payload truncated".to_string())?;
+    let text = std::str::from_utf8(&body[*offset..end])
+        .map_err(|error| format!("payload is not UTF-8: {error}"))?;
+    *offset = end;
+    Ok(text)
+}
+
+pub fn decode_request(header: &FrameHeader, body: &[u8]) -> Result<DaemonRequest, String> {
+    let id = header.id.to_string();
+    match header.kind {
+        KIND_PING => Ok(DaemonRequest {
+            id,
+            body: RequestBody::Ping(PingRequest::default()),
+        }),
+        KIND_CANCEL => {
+            if body.len() % 8 != 0 {
+                return Err("cancel frame is not a list of ids".to_string());
+            }
+            Ok(DaemonRequest {
+                id,
+                body: RequestBody::Cancel(CancelRequest {
+                    ids: body
+                        .chunks_exact(8)
+                        .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap()).to_string())
+                        .collect(),
+                }),
+            })
+        }
+        KIND_PREDICT => {
+            let session = header.flags & FLAG_SESSION != 0;
+            let fixed_len = PREDICT_FIXED_LEN + if session { 8 } else { 0 };
+            if body.len() < fixed_len {
+                return Err("predict frame too short".to_string());
+            }
+            let prefix_len = read_u32(body, 0) as usize;
+            let suffix_len = read_u32(body, 4) as usize;
+            let mut request = read_predict_options(body, 8)?;
+            request.stream = header.flags & FLAG_STREAM != 0;
+            request.session = session.then(|| read_u64(body, PREDICT_FIXED_LEN));
+
+            let mut offset = fixed_len;
+            request.prefix = take_str(body, &mut offset, prefix_len)?.to_string();
+            request.suffix = take_str(body, &mut offset, suffix_len)?.to_string();
+            Ok(DaemonRequest {
+                id,
+                body: RequestBody::Predict(request),
+            })
+        }
+        KIND_PREDICT_DELTA => {
+            if body.len() < PREDICT_DELTA_FIXED_LEN {
+                return Err("predict delta frame too short".to_string());
+            }
+            let mut request = read_predict_options(body, 12)?;
+            request.stream = header.flags & FLAG_STREAM != 0;
+            request.session = Some(read_u64(body, 0));
+            request.cursor = read_u32(body, 8) as usize;
+            let edit_count = read_u32(body, 20) as usize;
+
+            let mut edits = Vec::with_capacity(edit_count.min(body.len() / EDIT_FIXED_LEN));
+            let mut offset = PREDICT_DELTA_FIXED_LEN;
+            for _ in 0..edit_count {
+                if body.len() - offset < EDIT_FIXED_LEN {
+                    return Err("frame payload truncated".to_string());
+                }
+                let at = read_u32(body, offset) as usize;
+                let delete = read_u32(body, offset + 4) as usize;
+                let insert_len = read_u32(body, offset + 8) as usize;
+                offset += EDIT_FIXED_LEN;
+                let insert = take_str(body, &mut offset, insert_len)?.to_string();
+                edits.push(ContextEdit { at, delete, insert });
+            }
+            request.edits = Some(edits);
+            Ok(DaemonRequest {
+                id,
+                body: RequestBody::Predict(request),
+            })
+        }
+        other => Err(format!("unknown request frame kind {other:#04x}")),
+    }
+}
+
+fn push_header(out: &mut Vec<u8>, kind: u8, id: u64) {
+    out.extend_from_slice(&0u32.to_le_bytes());
+    out.push(kind);
+    out.push(0);
+    out.extend_from_slice(&0u16.to_le_bytes());
+    out.extend_from_slice(&id.to_le_bytes());
+}
+
+fn finish_frame(mut out: Vec<u8>) -> Vec<u8> {
+    let body_len = (out.len() - HEADER_LEN) as u32;
+    out[0..4].copy_from_slice(&body_len.to_le_bytes());
+    out
+}
+
+fn push_slice(out: &mut Vec<u8>, text: &str) {
+    out.extend_from_slice(&(text.len() as u32).to_le_bytes());
+    out.extend_from_slice(text.as_bytes());
+}
+
+pub fn encode_response(response: &DaemonResponse) -> Vec<u8> {
+    let id = response.id.parse::<u64>().unwrap_or(0);
+    match &response.body {
+        ResponseBody::Pong(_) => {
+            let mut out = Vec::with_capacity(HEADER_LEN);
+            push_header(&mut out, KIND_PONG, id);
+            finish_frame(out)
+        }
+        ResponseBody::Predict(prediction) => {
+            let text_len: usize = prediction.ghost_text.len()
+                + prediction
+                    .candidates
+                    .iter()
+                    .map(|candidate| candidate.len() + 4)
+                    .sum::<usize>();
+            let mut out = Vec::with_capacity(HEADER_LEN + PREDICT_REPLY_FIXED_LEN + text_len);
+            push_header(&mut out, KIND_PREDICT_REPLY, id);
+            out.extend_from_slice(&prediction.confidence.to_le_bytes());
+            out.extend_from_slice(&(prediction.elapsed_ms.min(u32::MAX as u64) as u32).to_le_bytes());
+            out.push(match prediction.source {
+                PredictionSource::LocalFim => 0,
+                PredictionSource::LocalNext => 1,
+                PredictionSource::Cloud => 2,
+            });
+            out.push(0);
+            out.extend_from_slice(&(prediction.candidates.len() as u16).to_le_bytes());
+            out.extend_from_slice(&(prediction.ghost_text.len() as u32).to_le_bytes());
+            out.extend_from_slice(prediction.ghost_text.as_bytes());
+            for candidate in prediction.candidates.iter().take(u16::MAX as usize) {
+                push_slice(&mut out, candidate);
+            }
+            finish_frame(out)
+        }
+        ResponseBody::GhostDelta(delta) => {
+            let mut out = Vec::with_capacity(HEADER_LEN + delta.text.len());
+            push_header(&mut out, KIND_GHOST_DELTA, id);
+            out.extend_from_slice(delta.text.as_bytes());
+            finish_frame(out)
+        }
+        ResponseBody::Error(error) => {
+            let mut out =
+                Vec::with_capacity(HEADER_LEN + ERROR_FIXED_LEN + error.message.len());
+            push_header(&mut out, KIND_ERROR, id);
+            out.push(match error.code {
+                ErrorCode::InvalidRequest => 0,
+                ErrorCode::Timeout => 1,
+                ErrorCode::Internal => 2,
+            });
+            out.extend_from_slice(&[0; 3]);
+            push_slice(&mut out, &error.message);
+            finish_frame(out)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::protocol::{GhostDeltaResponse, PredictResponse};
+
+    fn predict_frame(id: u64, prefix: &str, suffix: &str) -> Vec<u8> {
+        let mut out = Vec::new();
+        push_header(&mut out, KIND_PREDICT, id);
+        out.extend_from_slice(&(prefix.len() as u32).to_le_bytes());
+        out.extend_from_slice(&(suffix.len() as u32).to_le_bytes());
+        out.extend_from_slice(&8u16.to_le_bytes());
+        out.push(0);
+        out.push(1);
+        out.extend_from_slice(&90u32.to_le_bytes());
+        out.extend_from_slice(prefix.as_bytes());
+        out.extend_from_slice(suffix.as_bytes());
+        finish_frame(out)
+    }
+
+    #[test]
+    fn decodes_predict_frame() {
+        let frame = predict_frame(42, "我们\"继续", "讨论\n");
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        assert_eq!(header.body_len, frame.len() - HEADER_LEN);
+        let request = decode_request(&header, &frame[HEADER_LEN..]).unwrap();
+        assert_eq!(request.id, "42");
+        match request.body {
+            RequestBody::Predict(payload) => {
+                assert_eq!(payload.prefix, "我们\"继续");
+                assert_eq!(payload.suffix, "讨论\n");
+                assert_eq!(payload.mode, PredictMode::Fim);
+                assert_eq!(payload.max_tokens, 8);
+                assert_eq!(payload.latency_budget_ms, 90);
+                assert!(!payload.stream);
+            }
+            _ => panic!("expected predict request"),
+        }
+    }
+
+    #[test]
+    fn decodes_cancel_frame() {
+        let mut frame = Vec::new();
+        push_header(&mut frame, KIND_CANCEL, 0);
+        frame.extend_from_slice(&5u64.to_le_bytes());
+        frame.extend_from_slice(&6u64.to_le_bytes());
+        let frame = finish_frame(frame);
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        match decode_request(&header, &frame[HEADER_LEN..]).unwrap().body {
+            RequestBody::Cancel(cancel) => assert_eq!(cancel.ids, vec!["5", "6"]),
+            _ => panic!("expected cancel request"),
+        }
+    }
+
+    #[test]
+    fn stream_flag_and_ghost_delta_frame() {
+        let mut frame = predict_frame(3, "你好", "");
+        frame[5] = FLAG_STREAM;
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        match decode_request(&header, &frame[HEADER_LEN..]).unwrap().body {
+            RequestBody::Predict(payload) => assert!(payload.stream),
+            _ => panic!("expected predict request"),
+        }
+
+        let delta = encode_response(&DaemonResponse {
+            id: "3".to_string(),
+            body: ResponseBody::GhostDelta(GhostDeltaResponse {
+                text: "，很".to_string(),
+            }),
+        });
+        let header = decode_header(delta[..HEADER_LEN].try_into().unwrap());
+        assert_eq!(header.kind, KIND_GHOST_DELTA);
+        assert_eq!(header.id, 3);
+        assert_eq!(&delta[HEADER_LEN..], "，很".as_bytes());
+    }
+
+    #[test]
+    fn decodes_session_predict_and_delta_frames() {
+        let mut frame = predict_frame(4, "", "");
+        frame[5] = FLAG_SESSION;
+        frame.extend_from_slice(&9u64.to_le_bytes());
+        frame.extend_from_slice("你好".as_bytes());
+        let body_len = (frame.len() - HEADER_LEN) as u32;
+        frame[0..4].copy_from_slice(&body_len.to_le_bytes());
+        frame[HEADER_LEN..HEADER_LEN + 4].copy_from_slice(&6u32.to_le_bytes());
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        match decode_request(&header, &frame[HEADER_LEN..]).unwrap().body {
+            RequestBody::Predict(payload) => {
+                assert_eq!(payload.session, Some(9));
+                assert_eq!(payload.prefix, "你好");
+                assert!(payload.edits.is_none());
+            }
+            _ => panic!("expected predict request"),
+        }
+
+        let mut frame = Vec::new();
+        push_header(&mut frame, KIND_PREDICT_DELTA, 5);
+        frame.extend_from_slice(&9u64.to_le_bytes());
+        frame.extend_from_slice(&9u32.to_le_bytes());
+        frame.extend_from_slice(&8u16.to_le_bytes());
+        frame.push(0);
+        frame.push(1);
+        frame.extend_from_slice(&90u32.to_le_bytes());
+        frame.extend_from_slice(&1u32.to_le_bytes());
+        frame.extend_from_slice(&6u32.to_le_bytes());
+        frame.extend_from_slice(&0u32.to_le_bytes());
+        frame.extend_from_slice(&3u32.to_le_bytes());
+        frame.extend_from_slice("们".as_bytes());
+        let frame = finish_frame(frame);
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        match decode_request(&header, &frame[HEADER_LEN..]).unwrap().body {
+            RequestBody::Predict(payload) => {
+                assert_eq!(payload.session, Some(9));
+                assert_eq!(payload.cursor, 9);
+                assert_eq!(payload.mode, PredictMode::Fim);
+                assert_eq!(
+                    payload.edits.unwrap(),
+                    vec![ContextEdit {
+                        at: 6,
+                        delete: 0,
+                        insert: "们".to_string(),
+                    }]
+                );
+            }
+            _ => panic!("expected predict request"),
+        }
+    }
+
+    #[test]
+    fn rejects_truncated_payload() {
+        let mut frame = predict_frame(1, "hello", "");
+        frame.truncate(frame.len() - 2);
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        assert!(decode_request(&header, &frame[HEADER_LEN..]).is_err());
+    }
+
+    #[test]
+    fn encodes_predict_reply_layout() {
+        let response = DaemonResponse {
+            id: "7".to_string(),
+            body: ResponseBody::Predict(PredictResponse {
+                ghost_text: "可以先".to_string(),
+                candidates: vec!["可以先".to_string(), "继续".to_string()],
+                confidence: 0.5,
+                source: PredictionSource::LocalNext,
+                elapsed_ms: 3,
+            }),
+        };
+        let frame = encode_response(&response);
+        let header = decode_header(frame[..HEADER_LEN].try_into().unwrap());
+        assert_eq!(header.kind, KIND_PREDICT_REPLY);
+        assert_eq!(header.id, 7);
+        assert_eq!(header.body_len, frame.len() - HEADER_LEN);
+
+        let body = &frame[HEADER_LEN..];
+        assert_eq!(f32::from_le_bytes(body[0..4].try_into().unwrap()), 0.5);
+        assert_eq!(read_u32(body, 4), 3);
+        assert_eq!(body[8], 1);
+        assert_eq!(read_u16(body, 10), 2);
+        let mut offset = PREDICT_REPLY_FIXED_LEN;
+        let ghost_len = read_u32(body, 12) as usize;
+        assert_eq!(take_str(body, &mut offset, ghost_len).unwrap(), "可以先");
+        let first_len = read_u32(body, offset) as usize;
+        offset += 4;
+        assert_eq!(take_str(body, &mut offset, first_len).unwrap(), "可以先");
+    }
+}
@@ -1,7 +1,10 @@
 mod config;
+mod frame;
 mod predictor;
 mod protocol;
 mod server;
+mod session;
+mod shm;
 
 use anyhow::Result;
 use config::DaemonConfig;
@@ -150,6 +150,10 @@ mod tests {
             mode: PredictMode::Next,
             max_tokens: 12,
             latency_budget_ms: 90,
+            stream: false,
+            session: None,
+            edits: None,
+            cursor: 0,
         };
 
         let result = predictor
@@ -2,11 +2,12 @@ use std::process::Stdio;
 
 use anyhow::{anyhow, Context, Result};
 use async_trait::async_trait;
+use tokio::io::AsyncReadExt;
 use tokio::process::Command;
 use tokio::time::{timeout, Duration};
 
 use crate::config::ModelConfig;
-use crate::predictor::{PredictionDraft, PredictorEngine};
+use crate::predictor::{DeltaSink, GhostStream, PredictionDraft, PredictorEngine};
 use crate::protocol::{PredictMode, PredictRequest, PredictionSource};
 
 pub struct LlamaCppPredictor {
@@ -43,7 +44,7 @@ impl LlamaCppPredictor {
         }
     }
 
-    async fn run_llama_cli(&self, request: &PredictRequest, mode: PredictMode) -> Result<String> {
+    fn command(&self, request: &PredictRequest, mode: PredictMode) -> Command {
         let prompt = self.build_prompt(request, mode);
         let mut command = Command::new(&self.cli_path);
         command
@@ -61,11 +62,15 @@ impl LlamaCppPredictor {
             .arg(prompt)
             .arg("--no-display-prompt")
             .stdout(Stdio::piped())
-            .stderr(Stdio::piped());
+            .stderr(Stdio::piped())
+            .kill_on_drop(true);
+        command
+    }
 
+    async fn run_llama_cli(&self, request: &PredictRequest, mode: PredictMode) -> Result<String> {
         let output = timeout(
             Duration::from_millis(request.latency_budget_ms),
-            command.output(),
+            self.command(request, mode).output(),
         )
         .await
         .context("llama.cpp command timed out")?
@@ -83,6 +88,101 @@ impl LlamaCppPredictor {
         let stdout = String::from_utf8(output.stdout).context("llama.cpp stdout is not UTF-8")?;
         Ok(stdout.trim().to_string())
     }
+
+    /// Reads stdout as llama.cpp prints tokens and forwards the first line as
+    /// it grows. The process is killed once that line is complete, since the
+    /// rest is never used.
+    async fn run_llama_cli_streaming(
+        &self,
+        request: &PredictRequest,
+        mode: PredictMode,
+        deltas: &DeltaSink<'_>,
+    ) -> Result<String> {
+        let mut child = self
+            .command(request, mode)
+            .spawn()
+            .context("failed to execute llama.cpp")?;
+        let mut stdout = child
+            .stdout
+            .take()
+            .context("llama.cpp stdout is not piped")?;
+        // Drained alongside stdout so verbose logging cannot fill the pipe.
+        let mut stderr = child
+            .stderr
+            .take()
+            .context("llama.cpp stderr is not piped")?;
+        let stderr_task = tokio::spawn(async move {
+            let mut buffer = Vec::new();
+            let _ = stderr.read_to_end(&mut buffer).await;
+            buffer
+        });
+
+        let read = async {
+            let mut stream = GhostStream::new(deltas);
+            let mut bytes = Vec::new();
+            let mut chunk = [0u8; 1024];
+            loop {
+                let count = stdout
+                    .read(&mut chunk)
+                    .await
+                    .context("failed to read llama.cpp output")?;
+                if count == 0 {
+                    return Ok::<_, anyhow::Error>((bytes, false));
+                }
+                bytes.extend_from_slice(&chunk[..count]);
+                // A chunk can end inside a multi-byte character; wait for the rest.
+                let text = match std::str::from_utf8(&bytes) {
+                    Ok(text) => text,
+                    Err(error) if error.error_len().is_none() => {
+                        std::str::from_utf8(&bytes[..error.valid_up_to()]).unwrap()
+                    }
+                    Err(_) => return Err(anyhow!("llama.cpp stdout is not UTF-8")),
+                };
+                let text = text.trim_start();
+                stream.update(text.lines().next().unwrap_or("").trim_end());
+                if text.contains('\n') {
+                    return Ok((bytes, true));
+                }
+            }
+        };
+        let (bytes, line_complete) =
+            timeout(Duration::from_millis(request.latency_budget_ms), read)
+                .await
+                .context("llama.cpp command timed out")??;
+
+        if !line_complete {
+            let status = child.wait().await.context("failed to wait for llama.cpp")?;
+            if !status.success() {
+                let stderr = stderr_task.await.unwrap_or_default();
+                return Err(anyhow!(
+                    "llama.cpp exited with {}: {}",
+                    status,
+                    String::from_utf8_lossy(&stderr).trim()
+                ));
+            }
+        }
+
+        let stdout = String::from_utf8(bytes).context("llama.cpp stdout is not UTF-8")?;
+        Ok(stdout.trim().to_string())
+    }
+}
+
+fn draft_from_output(raw: &str, mode: PredictMode) -> Result<PredictionDraft> {
+    let ghost_text = raw.lines().next().unwrap_or("").trim().to_string();
+
+    if ghost_text.is_empty() {
+        return Err(anyhow!("llama.cpp returned empty prediction"));
+    }
+
+    Ok(PredictionDraft {
+        candidates: vec![ghost_text.clone()],
+        ghost_text,
+        confidence: 0.66,
+        source: match mode {
+            PredictMode::Fim => PredictionSource::LocalFim,
+            PredictMode::Next => PredictionSource::LocalNext,
+        },
+    })
 }
 
 #[async_trait]
@@ -93,20 +193,16 @@ impl PredictorEngine for LlamaCppPredictor {
         mode: PredictMode,
     ) -> Result<PredictionDraft> {
         let raw = self.run_llama_cli(request, mode).await?;
-        let ghost_text = raw.lines().next().unwrap_or("").trim().to_string();
-
-        if ghost_text.is_empty() {
-            return Err(anyhow!("llama.cpp returned empty prediction"));
-        }
+        draft_from_output(&raw, mode)
+    }
 
-        Ok(PredictionDraft {
-            candidates: vec![ghost_text.clone()],
-            ghost_text,
-            confidence: 0.66,
-            source: match mode {
-                PredictMode::Fim => PredictionSource::LocalFim,
-                PredictMode::Next => PredictionSource::LocalNext,
-            },
-        })
+    async fn predict_streaming(
+        &self,
+        request: &PredictRequest,
+        mode: PredictMode,
+        deltas: &DeltaSink<'_>,
+    ) -> Result<PredictionDraft> {
+        let raw = self.run_llama_cli_streaming(request, mode, deltas).await?;
+        draft_from_output(&raw, mode)
     }
 }
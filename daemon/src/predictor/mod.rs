@@ -15,10 +15,59 @@ use tracing::warn;
 use crate::config::{DefaultMode, ModelBackend, ModelConfig, PredictConfig};
 use crate::protocol::{Language, PredictMode, PredictRequest, PredictResponse, PredictionSource};
 
+/// Receives ghost text while a backend generates it; each call carries the
+/// text to append to what came before.
+pub type DeltaSink<'a> = dyn Fn(&str) + Send + Sync + 'a;
+
 #[async_trait]
 pub trait PredictorEngine: Send + Sync {
     async fn predict(&self, request: &PredictRequest, mode: PredictMode)
         -> Result<PredictionDraft>;
+
+    /// Like `predict`, reporting the ghost text to `deltas` as it is generated.
+    /// Backends that produce the whole answer at once keep this default.
+    async fn predict_streaming(
+        &self,
+        request: &PredictRequest,
+        mode: PredictMode,
+        deltas: &DeltaSink<'_>,
+    ) -> Result<PredictionDraft> {
+        let _ = deltas;
+        self.predict(request, mode).await
+    }
+}
+
+/// Turns successive cleaned-up views of a partial backend output into deltas.
+/// Once the cleaned text stops extending what was already sent, for example
+/// because a later token revealed an echoed prompt, nothing more is streamed
+/// and the final reply corrects the client.
+pub(crate) struct GhostStream<'a> {
+    sink: &'a DeltaSink<'a>,
+    sent: String,
+    diverged: bool,
+}
+
+impl<'a> GhostStream<'a> {
+    pub(crate) fn new(sink: &'a DeltaSink<'a>) -> Self {
+        Self {
+            sink,
+            sent: String::new(),
+            diverged: false,
+        }
+    }
+
+    pub(crate) fn update(&mut self, text: &str) {
+        if self.diverged || text.len() <= self.sent.len() {
+            return;
+        }
+        match text.strip_prefix(self.sent.as_str()) {
+            Some(delta) => {
+                (self.sink)(delta);
+                self.sent.push_str(delta);
+            }
+            None => self.diverged = true,
+        }
+    }
 }
 
 #[derive(Debug, Clone)]
@@ -118,7 +167,13 @@ impl PredictorRouter {
         }
     }
 
-    pub async fn predict(&self, request: PredictRequest) -> PredictResponse {
+    /// With `deltas`, ghost text is also passed on as the backend generates
+    /// it. Cached and fallback answers produce no deltas.
+    pub async fn predict(
+        &self,
+        request: PredictRequest,
+        deltas: Option<&DeltaSink<'_>>,
+    ) -> PredictResponse {
         if !self.enabled {
             return PredictResponse::empty(PredictionSource::LocalNext, 0);
         }
@@ -150,7 +205,15 @@ impl PredictorRouter {
         }
 
         let started = Instant::now();
-        let draft = match self.primary.predict(&request, effective_mode).await {
+        let result = match deltas {
+            Some(deltas) => {
+                self.primary
+                    .predict_streaming(&request, effective_mode, deltas)
+                    .await
+            }
+            None => self.primary.predict(&request, effective_mode).await,
+        };
+        let draft = match result {
             Ok(value) => value,
             Err(error) => {
                 warn!("primary predictor failed, fallback to heuristic: {error:#}");
@@ -181,3 +244,24 @@ impl PredictorRouter {
         response
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Mutex;
+
+    use super::GhostStream;
+
+    #[test]
+    fn ghost_stream_sends_growth_until_divergence() {
+        let sent = Mutex::new(Vec::new());
+        let sink = |text: &str| sent.lock().unwrap().push(text.to_string());
+        let mut stream = GhostStream::new(&sink);
+        stream.update("");
+        stream.update("可以");
+        stream.update("可以");
+        stream.update("可以先");
+        stream.update("继续");
+        stream.update("继续讨论");
+        assert_eq!(*sent.lock().unwrap(), vec!["可以", "先"]);
+    }
+}
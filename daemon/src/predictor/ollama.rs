@@ -4,7 +4,7 @@ use reqwest::Client;
 use serde::{Deserialize, Serialize};
 
 use crate::config::ModelConfig;
-use crate::predictor::{PredictionDraft, PredictorEngine};
+use crate::predictor::{DeltaSink, GhostStream, PredictionDraft, PredictorEngine};
 use crate::protocol::{Language, PredictMode, PredictRequest, PredictionSource};
 
 pub struct OllamaPredictor {
@@ -56,12 +56,15 @@ impl OllamaPredictor {
         }
     }
 
-    async fn run_ollama(&self, request: &PredictRequest, mode: PredictMode) -> Result<String> {
-        let endpoint = format!("{}/api/chat", self.base_url);
-        let prompt = self.build_prompt(request, mode);
-        let payload = OllamaChatRequest {
+    fn chat_request(
+        &self,
+        request: &PredictRequest,
+        mode: PredictMode,
+        stream: bool,
+    ) -> OllamaChatRequest {
+        OllamaChatRequest {
             model: self.model.clone(),
-            stream: false,
+            stream,
             messages: vec![
                 OllamaMessage {
                     role: "system".to_string(),
@@ -69,7 +72,7 @@ impl OllamaPredictor {
                 },
                 OllamaMessage {
                     role: "user".to_string(),
-                    content: prompt,
+                    content: self.build_prompt(request, mode),
                 },
             ],
             options: OllamaOptions {
@@ -77,33 +80,108 @@ impl OllamaPredictor {
                 top_p: self.top_p,
                 num_predict: request.max_tokens.max(1),
             },
-        };
+        }
+    }
 
+    async fn send(&self, payload: &OllamaChatRequest) -> Result<reqwest::Response> {
+        let endpoint = format!("{}/api/chat", self.base_url);
         let response = self
             .client
             .post(endpoint)
-            .json(&payload)
+            .json(payload)
             .send()
             .await
             .context("failed to call ollama API")?;
 
         let status = response.status();
-        let body = response
-            .text()
-            .await
-            .context("failed to read ollama response body")?;
-
         if !status.is_success() {
+            let body = response.text().await.unwrap_or_default();
             return Err(anyhow!("ollama API failed ({status}): {body}"));
         }
+        Ok(response)
+    }
+
+    async fn run_ollama(&self, request: &PredictRequest, mode: PredictMode) -> Result<String> {
+        let body = self
+            .send(&self.chat_request(request, mode, false))
+            .await?
+            .text()
+            .await
+            .context("failed to read ollama response body")?;
 
         let parsed: OllamaChatResponse =
             serde_json::from_str(&body).context("invalid ollama response format")?;
         Ok(parsed.message.content)
     }
+
+    /// Reads the newline-delimited chunks Ollama streams and forwards the
+    /// cleaned-up ghost text as it grows. Reading stops once the first line is
+    /// complete, since nothing after it is kept, which also ends generation.
+    async fn run_ollama_streaming(
+        &self,
+        request: &PredictRequest,
+        mode: PredictMode,
+        deltas: &DeltaSink<'_>,
+    ) -> Result<String> {
+        let mut response = self.send(&self.chat_request(request, mode, true)).await?;
+        let mut stream = GhostStream::new(deltas);
+        let mut pending = Vec::new();
+        let mut raw = String::new();
+        while let Some(chunk) = response
+            .chunk()
+            .await
+            .context("failed to read ollama stream")?
+        {
+            pending.extend_from_slice(&chunk);
+            while let Some(end) = pending.iter().position(|byte| *byte == b'\n') {
+                let line: Vec<u8> = pending.drain(..=end).collect();
+                if line.iter().all(u8::is_ascii_whitespace) {
+                    continue;
+                }
+                let parsed: OllamaChatChunk =
+                    serde_json::from_slice(&line).context("invalid ollama stream chunk")?;
+                if let Some(error) = parsed.error {
+                    return Err(anyhow!("ollama stream failed: {error}"));
+                }
+                if let Some(message) = parsed.message {
+                    raw.push_str(&message.content);
+                }
+                let text = strip_echo(&raw, request);
+                if !echoing_prefix(&raw, request) {
+                    stream.update(first_line(&text));
+                }
+                if parsed.done || text.contains('\n') {
+                    return Ok(raw);
+                }
+            }
+        }
+        Ok(raw)
+    }
 }
 
-fn sanitize_output(raw: &str, request: &PredictRequest) -> String {
+fn draft_from_output(
+    raw: &str,
+    request: &PredictRequest,
+    mode: PredictMode,
+) -> Result<PredictionDraft> {
+    let ghost_text = sanitize_output(raw, request);
+    if ghost_text.is_empty() {
+        return Err(anyhow!("ollama returned empty prediction"));
+    }
+
+    Ok(PredictionDraft {
+        candidates: vec![ghost_text.clone()],
+        ghost_text,
+        confidence: 0.71,
+        source: match mode {
+            PredictMode::Fim => PredictionSource::LocalFim,
+            PredictMode::Next => PredictionSource::LocalNext,
+        },
+    })
+}
+
+/// Removes wrapping quotes and an echoed prefix, and cuts at the suffix.
+fn strip_echo(raw: &str, request: &PredictRequest) -> String {
     let mut text = raw.trim().to_string();
     text = text.trim_matches('`').trim_matches('"').trim().to_string();
 
@@ -116,12 +194,22 @@ fn sanitize_output(raw: &str, request: &PredictRequest) -> String {
             text.truncate(position);
         }
     }
+    text
+}
 
-    if let Some(position) = text.find('\n') {
-        text.truncate(position);
-    }
+/// Whether a partial reply could still turn out to repeat the prefix, which
+/// `strip_echo` only removes once it is complete.
+fn echoing_prefix(raw: &str, request: &PredictRequest) -> bool {
+    let text = raw.trim_start().trim_start_matches(['`', '"']).trim_start();
+    !text.starts_with(&request.prefix) && request.prefix.starts_with(text)
+}
+
+fn first_line(text: &str) -> &str {
+    text.split('\n').next().unwrap_or("").trim()
+}
 
-    text.trim().to_string()
+fn sanitize_output(raw: &str, request: &PredictRequest) -> String {
+    first_line(&strip_echo(raw, request)).to_string()
 }
 
 #[async_trait]
@@ -132,20 +220,17 @@ impl PredictorEngine for OllamaPredictor {
         mode: PredictMode,
     ) -> Result<PredictionDraft> {
         let raw = self.run_ollama(request, mode).await?;
-        let ghost_text = sanitize_output(&raw, request);
-        if ghost_text.is_empty() {
-            return Err(anyhow!("ollama returned empty prediction"));
-        }
+        draft_from_output(&raw, request, mode)
+    }
 
-        Ok(PredictionDraft {
-            candidates: vec![ghost_text.clone()],
-            ghost_text,
-            confidence: 0.71,
-            source: match mode {
-                PredictMode::Fim => PredictionSource::LocalFim,
-                PredictMode::Next => PredictionSource::LocalNext,
-            },
-        })
+    async fn predict_streaming(
+        &self,
+        request: &PredictRequest,
+        mode: PredictMode,
+        deltas: &DeltaSink<'_>,
+    ) -> Result<PredictionDraft> {
+        let raw = self.run_ollama_streaming(request, mode, deltas).await?;
+        draft_from_output(&raw, request, mode)
     }
 }
 
@@ -175,6 +260,16 @@ struct OllamaChatResponse {
     message: OllamaMessageResponse,
 }
 
+#[derive(Debug, Deserialize)]
+struct OllamaChatChunk {
+    #[serde(default)]
+    message: Option<OllamaMessageResponse>,
+    #[serde(default)]
+    done: bool,
+    #[serde(default)]
+    error: Option<String>,
+}
+
 #[derive(Debug, Deserialize)]
 struct OllamaMessageResponse {
     content: String,
@@ -182,7 +277,7 @@ struct OllamaMessageResponse {
 
 #[cfg(test)]
 mod tests {
-    use super::sanitize_output;
+    use super::{echoing_prefix, sanitize_output};
     use crate::protocol::{Language, PredictMode, PredictRequest};
 
     fn make_request(prefix: &str, suffix: &str) -> PredictRequest {
@@ -193,6 +288,10 @@ mod tests {
             mode: PredictMode::Fim,
             max_tokens: 12,
             latency_budget_ms: 90,
+            stream: false,
+            session: None,
+            edits: None,
+            cursor: 0,
         }
     }
 
@@ -209,4 +308,12 @@ mod tests {
         let output = sanitize_output("你好，今天过得怎么样", &request);
         assert_eq!(output, "，今天过得怎么样");
     }
+
+    #[test]
+    fn holds_back_partial_prefix_echo() {
+        let request = make_request("你好", "");
+        assert!(echoing_prefix("\"你", &request));
+        assert!(!echoing_prefix("你好，", &request));
+        assert!(!echoing_prefix("今天", &request));
+    }
 }
@@ -12,7 +12,27 @@ pub struct DaemonRequest {
 #[serde(tag = "type", rename_all = "snake_case")]
 pub enum RequestBody {
     Predict(PredictRequest),
-    Ping,
+    Ping(PingRequest),
+    Cancel(CancelRequest),
+}
+
+/// Wire formats a client can offer in `ping`; the daemon answers with the one it picked.
+pub const PROTOCOL_BINARY_V2: &str = "binary-v2";
+/// Binary frames through shared-memory rings; only valid on a ping that
+/// passes the ring descriptors.
+pub const PROTOCOL_SHM_RING_V1: &str = "shm-ring-v1";
+
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub struct PingRequest {
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub protocols: Vec<String>,
+}
+
+/// Abandons earlier requests on the same connection. Cancelled requests get no reply.
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub struct CancelRequest {
+    #[serde(default)]
+    pub ids: Vec<String>,
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -27,10 +47,27 @@ pub struct DaemonResponse {
 #[serde(tag = "type", rename_all = "snake_case")]
 pub enum ResponseBody {
     Predict(PredictResponse),
-    Pong,
+    GhostDelta(GhostDeltaResponse),
+    Pong(PongResponse),
     Error(ErrorResponse),
 }
 
+/// Ghost text generated so far for a streaming `predict`, to append to the
+/// earlier deltas. The final `predict` reply still follows and is authoritative.
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub struct GhostDeltaResponse {
+    pub text: String,
+}
+
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub struct PongResponse {
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub protocol: Option<String>,
+    /// Tells the client that `predict` may refer to a context session.
+    #[serde(default, skip_serializing_if = "std::ops::Not::not")]
+    pub sessions: bool,
+}
+
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct ErrorResponse {
     pub code: ErrorCode,
@@ -47,6 +84,7 @@ pub enum ErrorCode {
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct PredictRequest {
+    #[serde(default)]
     pub prefix: String,
     #[serde(default)]
     pub suffix: String,
@@ -58,6 +96,28 @@ pub struct PredictRequest {
     pub max_tokens: u32,
     #[serde(default = "default_latency_budget_ms")]
     pub latency_budget_ms: u64,
+    /// Asks for `ghost_delta` messages while the backend generates.
+    #[serde(default, skip_serializing_if = "std::ops::Not::not")]
+    pub stream: bool,
+    /// Context session on this connection. With `edits`, the context is the
+    /// session's previous one with the edits applied, split at `cursor`;
+    /// otherwise `prefix` and `suffix` replace it.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub session: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub edits: Option<Vec<ContextEdit>>,
+    #[serde(default)]
+    pub cursor: usize,
+}
+
+/// Deletes `delete` bytes at byte offset `at` and inserts `insert` there.
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct ContextEdit {
+    pub at: usize,
+    #[serde(default)]
+    pub delete: usize,
+    #[serde(default, skip_serializing_if = "String::is_empty")]
+    pub insert: String,
 }
 
 impl PredictRequest {
@@ -139,8 +199,89 @@ mod tests {
                 assert_eq!(payload.prefix, "你好");
                 assert_eq!(payload.mode, PredictMode::Next);
                 assert_eq!(payload.language, Language::Zh);
+                assert!(!payload.stream);
+            }
+            _ => panic!("expected predict request"),
+        }
+    }
+
+    #[test]
+    fn parse_streaming_predict_and_serialize_delta() {
+        let raw = r#"{"id":"5","type":"predict","prefix":"你好","stream":true}"#;
+        let request: DaemonRequest = serde_json::from_str(raw).unwrap();
+        assert!(matches!(request.body, RequestBody::Predict(ref payload) if payload.stream));
+
+        let delta = DaemonResponse {
+            id: "5".to_string(),
+            body: ResponseBody::GhostDelta(GhostDeltaResponse {
+                text: "，很".to_string(),
+            }),
+        };
+        assert_eq!(
+            serde_json::to_string(&delta).unwrap(),
+            r#"{"id":"5","type":"ghost_delta","text":"，很"}"#
+        );
+    }
+
+    #[test]
+    fn parse_session_delta_predict() {
+        let raw = r#"{"id":"6","type":"predict","session":3,"cursor":5,"edits":[{"at":0,"delete":3},{"at":2,"insert":"们"}]}"#;
+        let request: DaemonRequest = serde_json::from_str(raw).unwrap();
+        match request.body {
+            RequestBody::Predict(payload) => {
+                assert!(payload.prefix.is_empty());
+                assert_eq!(payload.session, Some(3));
+                assert_eq!(payload.cursor, 5);
+                assert_eq!(
+                    payload.edits.unwrap(),
+                    vec![
+                        ContextEdit {
+                            at: 0,
+                            delete: 3,
+                            insert: String::new(),
+                        },
+                        ContextEdit {
+                            at: 2,
+                            delete: 0,
+                            insert: "们".to_string(),
+                        },
+                    ]
+                );
             }
             _ => panic!("expected predict request"),
         }
     }
+
+    #[test]
+    fn parse_ping_with_and_without_protocols() {
+        let plain: DaemonRequest = serde_json::from_str(r#"{"id":"1","type":"ping"}"#).unwrap();
+        assert!(matches!(plain.body, RequestBody::Ping(ref ping) if ping.protocols.is_empty()));
+
+        let offer: DaemonRequest =
+            serde_json::from_str(r#"{"id":"2","type":"ping","protocols":["binary-v2"]}"#).unwrap();
+        match offer.body {
+            RequestBody::Ping(ping) => assert_eq!(ping.protocols, vec![PROTOCOL_BINARY_V2]),
+            _ => panic!("expected ping request"),
+        }
+
+        let pong = DaemonResponse {
+            id: "1".to_string(),
+            body: ResponseBody::Pong(PongResponse::default()),
+        };
+        assert_eq!(
+            serde_json::to_string(&pong).unwrap(),
+            r#"{"id":"1","type":"pong"}"#
+        );
+    }
+
+    #[test]
+    fn parse_cancel_request() {
+        let request: DaemonRequest =
+            serde_json::from_str(r#"{"type":"cancel","ids":["3","4"]}"#).unwrap();
+        assert!(request.id.is_empty());
+        match request.body {
+            RequestBody::Cancel(cancel) => assert_eq!(cancel.ids, vec!["3", "4"]),
+            _ => panic!("expected cancel request"),
+        }
+    }
 }
@@ -1,18 +1,73 @@
+use std::collections::HashMap;
+use std::future::Future;
+use std::io::Cursor;
+use std::os::fd::OwnedFd;
 use std::path::Path;
-use std::sync::Arc;
+use std::sync::{Arc, Mutex, OnceLock};
 
 use anyhow::{Context, Result};
 use tokio::fs;
-use tokio::io::{AsyncBufReadExt, AsyncWriteExt, BufReader};
+use tokio::io::{AsyncBufReadExt, AsyncRead, AsyncReadExt, AsyncWriteExt, BufReader};
 use tokio::net::{UnixListener, UnixStream};
+use tokio::sync::mpsc;
+use tokio::task::AbortHandle;
 use tokio::time::{timeout, Duration};
-use tracing::{error, info, warn};
+use tracing::{debug, error, info, warn};
 
 use crate::config::ServerConfig;
-use crate::predictor::PredictorRouter;
+use crate::frame;
+use crate::predictor::{DeltaSink, PredictorRouter};
 use crate::protocol::{
-    DaemonRequest, DaemonResponse, ErrorCode, ErrorResponse, RequestBody, ResponseBody,
+    DaemonRequest, DaemonResponse, ErrorCode, ErrorResponse, GhostDeltaResponse, PingRequest,
+    PongResponse, RequestBody, ResponseBody, PROTOCOL_BINARY_V2, PROTOCOL_SHM_RING_V1,
 };
+use crate::session::ContextSessions;
+use crate::shm::{self, ShmRing, ShmRings};
+
+/// How long a reply waits for room in a full reply ring before the
+/// connection is given up.
+const RING_FULL_TIMEOUT: Duration = Duration::from_secs(1);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum WireFormat {
+    Json,
+    Binary,
+    SharedMemory,
+}
+
+/// Requests still running on one connection, so a later `cancel` can abort them.
+#[derive(Default)]
+struct InFlight {
+    tasks: Mutex<HashMap<String, AbortHandle>>,
+}
+
+impl InFlight {
+    fn spawn<F>(self: &Arc<Self>, id: String, task: F)
+    where
+        F: Future<Output = ()> + Send + 'static,
+    {
+        // Registration happens under the lock so a task that finishes
+        // immediately cannot leave a stale entry behind.
+        let mut tasks = self.tasks.lock().unwrap();
+        let registry = self.clone();
+        let key = id.clone();
+        let handle = tokio::spawn(async move {
+            task.await;
+            registry.tasks.lock().unwrap().remove(&key);
+        });
+        if !id.is_empty() {
+            tasks.insert(id, handle.abort_handle());
+        }
+    }
+
+    fn cancel(&self, ids: &[String]) -> usize {
+        let mut tasks = self.tasks.lock().unwrap();
+        ids.iter()
+            .filter_map(|id| tasks.remove(id))
+            .map(|handle| handle.abort())
+            .count()
+    }
+}
 
 pub struct PredictionServer {
     config: ServerConfig,
@@ -78,57 +133,284 @@ async fn handle_connection(
     predictor: Arc<PredictorRouter>,
     timeout_ms: u64,
 ) -> Result<()> {
+    // The hello ping may carry the shared-memory ring descriptors, which only
+    // recvmsg delivers, so the first read bypasses the buffered reader.
+    let (initial, mut passed_fds) = shm::recv_with_fds(&stream).await?;
+    if initial.is_empty() {
+        return Ok(());
+    }
     let (reader, mut writer) = stream.into_split();
-    let mut lines = BufReader::new(reader).lines();
+    let mut reader = BufReader::new(Cursor::new(initial).chain(reader));
+    let rings: Arc<OnceLock<ShmRings>> = Arc::default();
+
+    // Clients keep one connection open and pipeline requests on it, so each
+    // request runs in its own task and replies are written as they complete.
+    let (responses, mut pending) = mpsc::unbounded_channel::<(DaemonResponse, WireFormat)>();
+    let writer_rings = rings.clone();
+    let writer_task = tokio::spawn(async move {
+        while let Some((response, format)) = pending.recv().await {
+            let payload = match format {
+                WireFormat::Json => {
+                    let mut payload = serde_json::to_vec(&response)?;
+                    payload.push(b'\n');
+                    payload
+                }
+                WireFormat::Binary => frame::encode_response(&response),
+                WireFormat::SharedMemory => {
+                    let rings = writer_rings.get().expect("rings are attached before use");
+                    write_ring(&rings.replies, &frame::encode_response(&response)).await?;
+                    continue;
+                }
+            };
+            writer.write_all(&payload).await?;
+        }
+        Ok::<(), anyhow::Error>(())
+    });
 
-    while let Some(line) = lines.next_line().await? {
-        if line.trim().is_empty() {
+    let in_flight = Arc::new(InFlight::default());
+    let mut format = WireFormat::Json;
+    let mut ring_buffer = Vec::new();
+    let mut sessions = ContextSessions::default();
+    loop {
+        let request = match format {
+            WireFormat::Json => {
+                let mut line = String::new();
+                if reader.read_line(&mut line).await? == 0 {
+                    break;
+                }
+                if line.trim().is_empty() {
+                    continue;
+                }
+                parse_line(&line)
+            }
+            WireFormat::Binary => match read_frame(&mut reader).await? {
+                Some(request) => request,
+                None => break,
+            },
+            WireFormat::SharedMemory => {
+                let rings = rings.get().expect("rings are attached before use");
+                match read_ring_frame(rings, &mut ring_buffer, &mut reader).await? {
+                    Some(request) => request,
+                    None => break,
+                }
+            }
+        };
+
+        let mut request = match request {
+            Ok(request) => request,
+            Err(response) => {
+                let _ = responses.send((response, format));
+                continue;
+            }
+        };
+
+        // Sessions are resolved here, in arrival order, so each delta applies
+        // to the context of the request before it even if that one was
+        // cancelled.
+        if let RequestBody::Predict(predict) = &mut request.body {
+            if let Err(message) = sessions.resolve(predict) {
+                debug!("rejected session request: {message}");
+                let _ = responses.send((invalid_request(request.id, message), format));
+                continue;
+            }
+        }
+
+        // A client that offers another protocol in its ping gets a pong
+        // naming the one picked; every message after that ping uses it.
+        if let RequestBody::Ping(ping) = &request.body {
+            if format == WireFormat::Json {
+                let fds = std::mem::take(&mut passed_fds);
+                if let Some((next, name)) = negotiate(ping, fds, &rings) {
+                    let pong = DaemonResponse {
+                        id: request.id,
+                        body: ResponseBody::Pong(PongResponse {
+                            protocol: Some(name.to_string()),
+                            sessions: true,
+                        }),
+                    };
+                    let _ = responses.send((pong, WireFormat::Json));
+                    format = next;
+                    continue;
+                }
+            }
+        }
+
+        // Dropping an aborted prediction also drops its backend call, so a
+        // superseded request stops consuming model time.
+        if let RequestBody::Cancel(cancel) = &request.body {
+            let cancelled = in_flight.cancel(&cancel.ids);
+            debug!("cancelled {cancelled} of {} requests", cancel.ids.len());
             continue;
         }
-        let response = process_line(line, predictor.clone(), timeout_ms).await;
-        let payload = serde_json::to_string(&response)?;
-        writer.write_all(payload.as_bytes()).await?;
-        writer.write_all(b"\n").await?;
+
+        let predictor = predictor.clone();
+        let responses = responses.clone();
+        in_flight.spawn(request.id.clone(), async move {
+            let id = request.id.clone();
+            let deltas = |text: &str| {
+                let delta = DaemonResponse {
+                    id: id.clone(),
+                    body: ResponseBody::GhostDelta(GhostDeltaResponse {
+                        text: text.to_string(),
+                    }),
+                };
+                let _ = responses.send((delta, format));
+            };
+            let response = handle_request(request, predictor, timeout_ms, &deltas).await;
+            let _ = responses.send((response, format));
+        });
     }
-    Ok(())
+    drop(responses);
+    writer_task.await?
 }
 
-async fn process_line(
-    line: String,
-    predictor: Arc<PredictorRouter>,
-    timeout_ms: u64,
-) -> DaemonResponse {
-    match serde_json::from_str::<DaemonRequest>(&line) {
-        Ok(request) => handle_request(request, predictor, timeout_ms).await,
-        Err(error) => {
-            error!("invalid request JSON: {error}");
-            DaemonResponse {
-                id: String::new(),
-                body: ResponseBody::Error(ErrorResponse {
-                    code: ErrorCode::InvalidRequest,
-                    message: format!("invalid JSON payload: {error}"),
-                }),
+/// Picks the protocol for a hello ping. Shared memory wins when the ping
+/// passed usable rings; descriptors that are not used are closed.
+fn negotiate(
+    ping: &PingRequest,
+    fds: Vec<OwnedFd>,
+    rings: &OnceLock<ShmRings>,
+) -> Option<(WireFormat, &'static str)> {
+    let offered = |name: &str| ping.protocols.iter().any(|protocol| protocol == name);
+    if offered(PROTOCOL_SHM_RING_V1) && !fds.is_empty() {
+        match ShmRings::attach(fds) {
+            Ok(attached) => {
+                if rings.set(attached).is_ok() {
+                    return Some((WireFormat::SharedMemory, PROTOCOL_SHM_RING_V1));
+                }
             }
+            Err(error) => warn!("declining shared memory rings: {error}"),
+        }
+    }
+    offered(PROTOCOL_BINARY_V2).then_some((WireFormat::Binary, PROTOCOL_BINARY_V2))
+}
+
+fn parse_line(line: &str) -> std::result::Result<DaemonRequest, DaemonResponse> {
+    serde_json::from_str::<DaemonRequest>(line).map_err(|error| {
+        error!("invalid request JSON: {error}");
+        invalid_request(String::new(), format!("invalid JSON payload: {error}"))
+    })
+}
+
+async fn read_frame<R>(
+    reader: &mut R,
+) -> Result<Option<std::result::Result<DaemonRequest, DaemonResponse>>>
+where
+    R: AsyncReadExt + Unpin,
+{
+    let mut header = [0u8; frame::HEADER_LEN];
+    match reader.read_exact(&mut header).await {
+        Ok(_) => {}
+        Err(error) if error.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(None),
+        Err(error) => return Err(error.into()),
+    }
+    let header = frame::decode_header(&header);
+    if header.body_len > frame::MAX_BODY_LEN {
+        anyhow::bail!("frame body of {} bytes exceeds limit", header.body_len);
+    }
+    let mut body = vec![0u8; header.body_len];
+    reader.read_exact(&mut body).await?;
+    Ok(Some(request_from_frame(&header, &body)))
+}
+
+/// Waits for the next complete frame in the request ring. The socket only
+/// stays open to report that the client went away.
+async fn read_ring_frame<R>(
+    rings: &ShmRings,
+    buffer: &mut Vec<u8>,
+    socket: &mut R,
+) -> Result<Option<std::result::Result<DaemonRequest, DaemonResponse>>>
+where
+    R: AsyncRead + Unpin,
+{
+    loop {
+        if buffer.len() >= frame::HEADER_LEN {
+            let header = frame::decode_header(buffer[..frame::HEADER_LEN].try_into()?);
+            if header.body_len > frame::MAX_BODY_LEN {
+                anyhow::bail!("frame body of {} bytes exceeds limit", header.body_len);
+            }
+            let frame_len = frame::HEADER_LEN + header.body_len;
+            if buffer.len() >= frame_len {
+                let request = request_from_frame(&header, &buffer[frame::HEADER_LEN..frame_len]);
+                buffer.drain(..frame_len);
+                return Ok(Some(request));
+            }
+        }
+        let mut probe = [0u8; 1];
+        tokio::select! {
+            waited = rings.requests.wait() => {
+                waited?;
+                rings.requests.read(buffer)?;
+            }
+            read = socket.read(&mut probe) => {
+                if read? == 0 {
+                    return Ok(None);
+                }
+                anyhow::bail!("unexpected socket data after switching to shared memory");
+            }
+        }
+    }
+}
+
+fn request_from_frame(
+    header: &frame::FrameHeader,
+    body: &[u8],
+) -> std::result::Result<DaemonRequest, DaemonResponse> {
+    frame::decode_request(header, body).map_err(|message| {
+        error!("invalid request frame: {message}");
+        invalid_request(header.id.to_string(), message)
+    })
+}
+
+/// The addon drains the reply ring on every wakeup, so it is only full while
+/// the event loop is busy; wait for room rather than drop the reply.
+async fn write_ring(ring: &ShmRing, payload: &[u8]) -> Result<()> {
+    if payload.len() > ring.capacity() {
+        anyhow::bail!(
+            "reply frame of {} bytes does not fit the ring",
+            payload.len()
+        );
+    }
+    let started = tokio::time::Instant::now();
+    while !ring.write(payload) {
+        if started.elapsed() > RING_FULL_TIMEOUT {
+            anyhow::bail!("reply ring stayed full");
         }
+        tokio::time::sleep(Duration::from_millis(1)).await;
+    }
+    ring.notify()?;
+    Ok(())
+}
+
+fn invalid_request(id: String, message: String) -> DaemonResponse {
+    DaemonResponse {
+        id,
+        body: ResponseBody::Error(ErrorResponse {
+            code: ErrorCode::InvalidRequest,
+            message,
+        }),
     }
 }
 
+/// Streaming predictions report ghost text to `deltas` before the reply.
 async fn handle_request(
     request: DaemonRequest,
     predictor: Arc<PredictorRouter>,
     timeout_ms: u64,
+    deltas: &DeltaSink<'_>,
 ) -> DaemonResponse {
     let id = request.id;
     match request.body {
-        RequestBody::Ping => DaemonResponse {
+        RequestBody::Ping(_) => DaemonResponse {
             id,
-            body: ResponseBody::Pong,
+            body: ResponseBody::Pong(PongResponse::default()),
         },
         RequestBody::Predict(predict_request) => {
             let effective_timeout_ms = timeout_ms.max(predict_request.latency_budget_ms).max(1);
+            let deltas = predict_request.stream.then_some(deltas);
             match timeout(
                 Duration::from_millis(effective_timeout_ms),
-                predictor.predict(predict_request),
+                predictor.predict(predict_request, deltas),
             )
             .await
             {
@@ -145,6 +427,10 @@ async fn handle_request(
                 },
             }
         }
+        RequestBody::Cancel(_) => invalid_request(
+            id,
+            "cancel only applies to requests on the same connection".to_string(),
+        ),
     }
 }
 
@@ -162,11 +448,11 @@ mod tests {
         ));
         let request = DaemonRequest {
             id: "1".to_string(),
-            body: RequestBody::Ping,
+            body: RequestBody::Ping(Default::default()),
         };
 
-        let response = handle_request(request, predictor, 100).await;
-        assert!(matches!(response.body, ResponseBody::Pong));
+        let response = handle_request(request, predictor, 100, &|_: &str| {}).await;
+        assert!(matches!(response.body, ResponseBody::Pong(_)));
         assert_eq!(response.id, "1");
     }
 
@@ -185,10 +471,14 @@ mod tests {
                 mode: PredictMode::Next,
                 max_tokens: 8,
                 latency_budget_ms: 50,
+                stream: false,
+                session: None,
+                edits: None,
+                cursor: 0,
             }),
         };
 
-        let response = handle_request(request, predictor, 100).await;
+        let response = handle_request(request, predictor, 100, &|_: &str| {}).await;
         match response.body {
             ResponseBody::Predict(prediction) => {
                 assert!(!prediction.ghost_text.is_empty());
@@ -196,4 +486,173 @@ mod tests {
             other => panic!("unexpected response: {other:?}"),
         }
     }
+
+    #[tokio::test]
+    async fn answers_pipelined_requests_on_one_connection() {
+        let predictor = Arc::new(PredictorRouter::new(
+            ModelConfig::default(),
+            PredictConfig::default(),
+        ));
+        let (client, server) = UnixStream::pair().unwrap();
+        let server_task = tokio::spawn(handle_connection(server, predictor, 100));
+
+        let (reader, mut writer) = client.into_split();
+        writer
+            .write_all(
+                concat!(
+                    r#"{"id":"1","type":"predict","prefix":"你好","mode":"next"}"#,
+                    "\n",
+                    r#"{"id":"2","type":"ping"}"#,
+                    "\n"
+                )
+                .as_bytes(),
+            )
+            .await
+            .unwrap();
+
+        let mut lines = BufReader::new(reader).lines();
+        let mut ids = Vec::new();
+        for _ in 0..2 {
+            let line = lines.next_line().await.unwrap().unwrap();
+            let response: DaemonResponse = serde_json::from_str(&line).unwrap();
+            ids.push(response.id);
+        }
+        ids.sort();
+        assert_eq!(ids, vec!["1".to_string(), "2".to_string()]);
+
+        drop(writer);
+        server_task.await.unwrap().unwrap();
+    }
+
+    #[tokio::test]
+    async fn rejects_deltas_for_unknown_sessions() {
+        let predictor = Arc::new(PredictorRouter::new(
+            ModelConfig::default(),
+            PredictConfig::default(),
+        ));
+        let (client, server) = UnixStream::pair().unwrap();
+        let server_task = tokio::spawn(handle_connection(server, predictor, 100));
+
+        let (reader, mut writer) = client.into_split();
+        writer
+            .write_all(
+                concat!(
+                    r#"{"id":"1","type":"predict","prefix":"你","mode":"next","session":4}"#,
+                    "\n",
+                    r#"{"id":"2","type":"predict","mode":"next","session":4,"cursor":6,"edits":[{"at":3,"insert":"好"}]}"#,
+                    "\n",
+                    r#"{"id":"3","type":"predict","mode":"next","session":5,"cursor":0,"edits":[]}"#,
+                    "\n"
+                )
+                .as_bytes(),
+            )
+            .await
+            .unwrap();
+
+        let mut lines = BufReader::new(reader).lines();
+        let mut replies = Vec::new();
+        for _ in 0..3 {
+            let line = lines.next_line().await.unwrap().unwrap();
+            let response: DaemonResponse = serde_json::from_str(&line).unwrap();
+            replies.push((response.id, matches!(response.body, ResponseBody::Predict(_))));
+        }
+        replies.sort();
+        assert_eq!(
+            replies,
+            vec![
+                ("1".to_string(), true),
+                ("2".to_string(), true),
+                ("3".to_string(), false)
+            ]
+        );
+
+        drop(writer);
+        server_task.await.unwrap().unwrap();
+    }
+
+    #[tokio::test]
+    async fn cancel_aborts_registered_task() {
+        let in_flight = Arc::new(InFlight::default());
+        let (done_tx, mut done_rx) = mpsc::unbounded_channel::<()>();
+        in_flight.spawn("7".to_string(), async move {
+            std::future::pending::<()>().await;
+            let _ = done_tx.send(());
+        });
+
+        assert_eq!(in_flight.cancel(&["7".to_string(), "8".to_string()]), 1);
+        assert!(done_rx.recv().await.is_none());
+        assert!(in_flight.tasks.lock().unwrap().is_empty());
+    }
+
+    #[tokio::test]
+    async fn finished_tasks_leave_the_registry() {
+        let in_flight = Arc::new(InFlight::default());
+        let (done_tx, mut done_rx) = mpsc::unbounded_channel::<()>();
+        in_flight.spawn("1".to_string(), async move {
+            let _ = done_tx.send(());
+        });
+        done_rx.recv().await.unwrap();
+        tokio::task::yield_now().await;
+        assert_eq!(in_flight.cancel(&["1".to_string()]), 0);
+    }
+
+    #[tokio::test]
+    async fn switches_to_binary_frames_after_negotiating_ping() {
+        let predictor = Arc::new(PredictorRouter::new(
+            ModelConfig::default(),
+            PredictConfig::default(),
+        ));
+        let (client, server) = UnixStream::pair().unwrap();
+        let server_task = tokio::spawn(handle_connection(server, predictor, 100));
+
+        let (reader, mut writer) = client.into_split();
+        let mut reader = BufReader::new(reader);
+        writer
+            .write_all(b"{\"id\":\"1\",\"type\":\"ping\",\"protocols\":[\"binary-v2\"]}\n")
+            .await
+            .unwrap();
+        let mut line = String::new();
+        reader.read_line(&mut line).await.unwrap();
+        assert_eq!(line, "{\"id\":\"1\",\"type\":\"pong\",\"protocol\":\"binary-v2\",\"sessions\":true}\n");
+
+        let mut ping = vec![0u8; frame::HEADER_LEN];
+        ping[4] = 0x02;
+        ping[8..16].copy_from_slice(&9u64.to_le_bytes());
+        writer.write_all(&ping).await.unwrap();
+
+        let mut header = [0u8; frame::HEADER_LEN];
+        reader.read_exact(&mut header).await.unwrap();
+        let header = frame::decode_header(&header);
+        assert_eq!(header.kind, 0x82);
+        assert_eq!(header.id, 9);
+        assert_eq!(header.body_len, 0);
+
+        drop(writer);
+        server_task.await.unwrap().unwrap();
+    }
+
+    #[tokio::test]
+    async fn offering_shared_memory_without_rings_falls_back_to_binary() {
+        let predictor = Arc::new(PredictorRouter::new(
+            ModelConfig::default(),
+            PredictConfig::default(),
+        ));
+        let (client, server) = UnixStream::pair().unwrap();
+        let server_task = tokio::spawn(handle_connection(server, predictor, 100));
+
+        let (reader, mut writer) = client.into_split();
+        let mut reader = BufReader::new(reader);
+        writer
+            .write_all(
+                b"{\"id\":\"1\",\"type\":\"ping\",\"protocols\":[\"shm-ring-v1\",\"binary-v2\"]}\n",
+            )
+            .await
+            .unwrap();
+        let mut line = String::new();
+        reader.read_line(&mut line).await.unwrap();
+        assert_eq!(line, "{\"id\":\"1\",\"type\":\"pong\",\"protocol\":\"binary-v2\",\"sessions\":true}\n");
+
+        drop(writer);
+        server_task.await.unwrap().unwrap();
+    }
 }
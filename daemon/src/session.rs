@@ -0,0 +1,183 @@
+//! Context sessions: a client that opens one sends its full context once and
+//! then only the edits since the previous request, and the daemon rebuilds
+//! the prefix and suffix from the context it kept. Sessions live as long as
+//! the connection. See docs/IPC.md.
+
+use std::collections::HashMap;
+
+use crate::protocol::{ContextEdit, PredictRequest};
+
+/// Sessions kept per connection; the least recently used one goes first.
+/// A client whose session was evicted gets an error and resends in full.
+const MAX_SESSIONS: usize = 64;
+/// Bound on a session's context, well above the addon's window.
+const MAX_CONTEXT_LEN: usize = 64 * 1024;
+
+#[derive(Default)]
+pub struct ContextSessions {
+    contexts: HashMap<u64, Context>,
+    clock: u64,
+}
+
+struct Context {
+    text: String,
+    last_used: u64,
+}
+
+impl ContextSessions {
+    /// Fills in `prefix` and `suffix` of a request that names a session and
+    /// records its context for the next one. A session whose edits do not
+    /// apply is dropped, so every later delta fails until the client resyncs.
+    pub fn resolve(&mut self, request: &mut PredictRequest) -> Result<(), String> {
+        let Some(session) = request.session else {
+            return Ok(());
+        };
+        self.clock += 1;
+        let text = match request.edits.take() {
+            None => {
+                let mut text = std::mem::take(&mut request.prefix);
+                request.cursor = text.len();
+                text.push_str(&request.suffix);
+                text
+            }
+            Some(edits) => {
+                let mut text = self
+                    .contexts
+                    .remove(&session)
+                    .map(|context| context.text)
+                    .ok_or_else(|| format!("unknown session {session}"))?;
+                apply_edits(&mut text, &edits)?;
+                if !text.is_char_boundary(request.cursor) {
+                    return Err(format!("cursor {} is not a character boundary", request.cursor));
+                }
+                request.suffix = text[request.cursor..].to_string();
+                text
+            }
+        };
+        if text.len() > MAX_CONTEXT_LEN {
+            self.contexts.remove(&session);
+            return Err(format!("session context of {} bytes exceeds limit", text.len()));
+        }
+        request.prefix = text[..request.cursor].to_string();
+
+        if !self.contexts.contains_key(&session) && self.contexts.len() >= MAX_SESSIONS {
+            if let Some(oldest) = self
+                .contexts
+                .iter()
+                .min_by_key(|(_, context)| context.last_used)
+                .map(|(id, _)| *id)
+            {
+                self.contexts.remove(&oldest);
+            }
+        }
+        self.contexts.insert(
+            session,
+            Context {
+                text,
+                last_used: self.clock,
+            },
+        );
+        Ok(())
+    }
+}
+
+fn apply_edits(text: &mut String, edits: &[ContextEdit]) -> Result<(), String> {
+    for edit in edits {
+        let end = edit
+            .at
+            .checked_add(edit.delete)
+            .filter(|end| *end <= text.len())
+            .ok_or_else(|| format!("edit at {} runs past the context", edit.at))?;
+        if !text.is_char_boundary(edit.at) || !text.is_char_boundary(end) {
+            return Err(format!("edit at {} splits a character", edit.at));
+        }
+        text.replace_range(edit.at..end, &edit.insert);
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::protocol::{Language, PredictMode};
+
+    fn request(session: Option<u64>, prefix: &str, suffix: &str) -> PredictRequest {
+        PredictRequest {
+            prefix: prefix.to_string(),
+            suffix: suffix.to_string(),
+            language: Language::Zh,
+            mode: PredictMode::Fim,
+            max_tokens: 8,
+            latency_budget_ms: 90,
+            stream: false,
+            session,
+            edits: None,
+            cursor: 0,
+        }
+    }
+
+    fn delta(session: u64, cursor: usize, edits: Vec<ContextEdit>) -> PredictRequest {
+        PredictRequest {
+            edits: Some(edits),
+            cursor,
+            ..request(Some(session), "", "")
+        }
+    }
+
+    #[test]
+    fn applies_edits_to_the_last_context() {
+        let mut sessions = ContextSessions::default();
+        let mut full = request(Some(1), "今天天气", "。");
+        sessions.resolve(&mut full).unwrap();
+        assert_eq!((full.prefix.as_str(), full.suffix.as_str()), ("今天天气", "。"));
+
+        // The window's first character scrolls out while one is typed.
+        let mut next = delta(
+            1,
+            "天天气很".len(),
+            vec![
+                ContextEdit {
+                    at: 0,
+                    delete: "今".len(),
+                    insert: String::new(),
+                },
+                ContextEdit {
+                    at: "天天气".len(),
+                    delete: 0,
+                    insert: "很".to_string(),
+                },
+            ],
+        );
+        sessions.resolve(&mut next).unwrap();
+        assert_eq!((next.prefix.as_str(), next.suffix.as_str()), ("天天气很", "。"));
+    }
+
+    #[test]
+    fn rejects_bad_edits_and_forgets_the_session() {
+        let mut sessions = ContextSessions::default();
+        sessions.resolve(&mut request(Some(1), "你好", "")).unwrap();
+
+        let split = ContextEdit {
+            at: 1,
+            delete: 0,
+            insert: "x".to_string(),
+        };
+        assert!(sessions.resolve(&mut delta(1, 0, vec![split])).is_err());
+        assert!(sessions.resolve(&mut delta(1, 0, Vec::new())).is_err());
+        assert!(sessions.resolve(&mut delta(2, 0, Vec::new())).is_err());
+
+        let mut plain = request(None, "你好", "");
+        sessions.resolve(&mut plain).unwrap();
+        assert_eq!(plain.prefix, "你好");
+    }
+
+    #[test]
+    fn evicts_the_least_recently_used_session() {
+        let mut sessions = ContextSessions::default();
+        for session in 0..=MAX_SESSIONS as u64 {
+            sessions.resolve(&mut request(Some(session), "a", "")).unwrap();
+        }
+        assert!(sessions.resolve(&mut delta(0, 1, Vec::new())).is_err());
+        assert!(sessions.resolve(&mut delta(1, 1, Vec::new())).is_ok());
+    }
+}
@@ -0,0 +1,321 @@
+//! Shared-memory transport: the client passes two memfd-backed rings and
+//! their eventfds with its hello ping, and once the daemon accepts
+//! `shm-ring-v1` both directions carry binary-v2 frames through the rings
+//! instead of the socket. See docs/IPC.md for the layout.
+
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use tokio::io::unix::AsyncFd;
+use tokio::io::Interest;
+use tokio::net::UnixStream;
+
+pub const RING_HEADER_LEN: usize = 128;
+const HEAD_OFFSET: usize = 0;
+const TAIL_OFFSET: usize = 64;
+const MIN_CAPACITY: usize = 4096;
+const MAX_CAPACITY: usize = 64 << 20;
+const REQUIRED_SEALS: libc::c_int = libc::F_SEAL_SHRINK | libc::F_SEAL_GROW;
+/// Descriptors a hello ping offering the rings carries, in this order.
+pub const HELLO_FDS: usize = 4;
+
+/// One direction of the transport. The daemon consumes the request ring and
+/// produces into the reply ring; each side only ever moves its own position.
+pub struct ShmRing {
+    memory: NonNull<u8>,
+    capacity: usize,
+    _memfd: OwnedFd,
+    event: AsyncFd<OwnedFd>,
+}
+
+// The mapping is only touched through the atomics in its header and the byte
+// ranges they hand to one side at a time.
+unsafe impl Send for ShmRing {}
+unsafe impl Sync for ShmRing {}
+
+impl ShmRing {
+    /// Maps a ring the client created. The memfd must be sealed against
+    /// resizing, so the client cannot truncate it under the mapping.
+    pub fn attach(memfd: OwnedFd, eventfd: OwnedFd) -> io::Result<Self> {
+        let seals = unsafe { libc::fcntl(memfd.as_raw_fd(), libc::F_GET_SEALS) };
+        if seals < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        if seals & REQUIRED_SEALS != REQUIRED_SEALS {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "ring memfd is not sealed",
+            ));
+        }
+        let mut stat: libc::stat = unsafe { std::mem::zeroed() };
+        if unsafe { libc::fstat(memfd.as_raw_fd(), &mut stat) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let size = stat.st_size as usize;
+        let capacity = size.saturating_sub(RING_HEADER_LEN);
+        if size < RING_HEADER_LEN
+            || !capacity.is_power_of_two()
+            || !(MIN_CAPACITY..=MAX_CAPACITY).contains(&capacity)
+        {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("ring of {size} bytes has an invalid size"),
+            ));
+        }
+        let memory = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                size,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                memfd.as_raw_fd(),
+                0,
+            )
+        };
+        if memory == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        let memory = NonNull::new(memory.cast::<u8>()).expect("mmap returned null");
+        let ring = Self {
+            memory,
+            capacity,
+            _memfd: memfd,
+            event: AsyncFd::with_interest(eventfd, Interest::READABLE)?,
+        };
+        Ok(ring)
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.capacity
+    }
+
+    fn position(&self, offset: usize) -> &AtomicU64 {
+        unsafe { &*self.memory.as_ptr().add(offset).cast::<AtomicU64>() }
+    }
+
+    fn data(&self) -> *mut u8 {
+        unsafe { self.memory.as_ptr().add(RING_HEADER_LEN) }
+    }
+
+    /// Appends everything the producer has written to `out`. Fails if the
+    /// positions are inconsistent, which only a misbehaving peer causes.
+    pub fn read(&self, out: &mut Vec<u8>) -> io::Result<()> {
+        let head = self.position(HEAD_OFFSET).load(Ordering::Acquire);
+        let tail = self.position(TAIL_OFFSET).load(Ordering::Relaxed);
+        let available = head.wrapping_sub(tail) as usize;
+        if available > self.capacity {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "ring positions are inconsistent",
+            ));
+        }
+        let offset = tail as usize & (self.capacity - 1);
+        let first = available.min(self.capacity - offset);
+        unsafe {
+            out.extend_from_slice(std::slice::from_raw_parts(self.data().add(offset), first));
+            out.extend_from_slice(std::slice::from_raw_parts(self.data(), available - first));
+        }
+        self.position(TAIL_OFFSET).store(head, Ordering::Release);
+        Ok(())
+    }
+
+    /// Copies all of `bytes` into the ring, or nothing if they do not fit yet.
+    pub fn write(&self, bytes: &[u8]) -> bool {
+        let head = self.position(HEAD_OFFSET).load(Ordering::Relaxed);
+        let tail = self.position(TAIL_OFFSET).load(Ordering::Acquire);
+        let used = head.wrapping_sub(tail) as usize;
+        if used > self.capacity || bytes.len() > self.capacity - used {
+            return false;
+        }
+        let offset = head as usize & (self.capacity - 1);
+        let first = bytes.len().min(self.capacity - offset);
+        unsafe {
+            std::ptr::copy_nonoverlapping(bytes.as_ptr(), self.data().add(offset), first);
+            std::ptr::copy_nonoverlapping(bytes[first..].as_ptr(), self.data(), bytes.len() - first);
+        }
+        self.position(HEAD_OFFSET)
+            .store(head + bytes.len() as u64, Ordering::Release);
+        true
+    }
+
+    /// Wakes the consumer on the other side.
+    pub fn notify(&self) -> io::Result<()> {
+        let one = 1u64;
+        let written = unsafe {
+            libc::write(
+                self.event.get_ref().as_raw_fd(),
+                (&one as *const u64).cast(),
+                std::mem::size_of::<u64>(),
+            )
+        };
+        if written < 0 {
+            let error = io::Error::last_os_error();
+            // The counter is only saturated if the peer stopped reading, in
+            // which case it has a wakeup pending anyway.
+            if error.kind() != io::ErrorKind::WouldBlock {
+                return Err(error);
+            }
+        }
+        Ok(())
+    }
+
+    /// Waits until the producer signals new data.
+    pub async fn wait(&self) -> io::Result<()> {
+        loop {
+            let mut guard = self.event.readable().await?;
+            match guard.try_io(|event| read_counter(event.get_ref().as_raw_fd())) {
+                Ok(result) => return result,
+                Err(_would_block) => continue,
+            }
+        }
+    }
+}
+
+impl Drop for ShmRing {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(
+                self.memory.as_ptr().cast(),
+                RING_HEADER_LEN + self.capacity,
+            );
+        }
+    }
+}
+
+fn read_counter(fd: RawFd) -> io::Result<()> {
+    let mut count = 0u64;
+    let read = unsafe {
+        libc::read(
+            fd,
+            (&mut count as *mut u64).cast(),
+            std::mem::size_of::<u64>(),
+        )
+    };
+    if read < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Both rings of one connection, from the descriptors of a hello ping:
+/// request memfd, reply memfd, request eventfd, reply eventfd.
+pub struct ShmRings {
+    pub requests: ShmRing,
+    pub replies: ShmRing,
+}
+
+impl ShmRings {
+    pub fn attach(fds: Vec<OwnedFd>) -> io::Result<Self> {
+        let [request_memfd, reply_memfd, request_event, reply_event]: [OwnedFd; HELLO_FDS] =
+            fds.try_into().map_err(|fds: Vec<OwnedFd>| {
+                io::Error::new(
+                    io::ErrorKind::InvalidInput,
+                    format!("expected {HELLO_FDS} descriptors, got {}", fds.len()),
+                )
+            })?;
+        Ok(Self {
+            requests: ShmRing::attach(request_memfd, request_event)?,
+            replies: ShmRing::attach(reply_memfd, reply_event)?,
+        })
+    }
+}
+
+/// Reads the first bytes of a connection together with any descriptors sent
+/// along with them. Returns no bytes once the peer has closed.
+pub async fn recv_with_fds(stream: &UnixStream) -> io::Result<(Vec<u8>, Vec<OwnedFd>)> {
+    loop {
+        stream.readable().await?;
+        match stream.try_io(Interest::READABLE, || recvmsg_fds(stream.as_raw_fd())) {
+            Err(error) if error.kind() == io::ErrorKind::WouldBlock => continue,
+            result => return result,
+        }
+    }
+}
+
+fn recvmsg_fds(fd: RawFd) -> io::Result<(Vec<u8>, Vec<OwnedFd>)> {
+    let mut data = vec![0u8; 4096];
+    // Room for a handful of descriptors; u64 keeps the buffer aligned for cmsghdr.
+    let mut control = [0u64; 16];
+    let mut iov = libc::iovec {
+        iov_base: data.as_mut_ptr().cast(),
+        iov_len: data.len(),
+    };
+    let mut message: libc::msghdr = unsafe { std::mem::zeroed() };
+    message.msg_iov = &mut iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.as_mut_ptr().cast();
+    message.msg_controllen = std::mem::size_of_val(&control) as _;
+
+    let received = unsafe { libc::recvmsg(fd, &mut message, libc::MSG_CMSG_CLOEXEC) };
+    if received < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    let mut fds = Vec::new();
+    unsafe {
+        let mut header = libc::CMSG_FIRSTHDR(&message);
+        while !header.is_null() {
+            if (*header).cmsg_level == libc::SOL_SOCKET && (*header).cmsg_type == libc::SCM_RIGHTS
+            {
+                let payload = (*header).cmsg_len as usize - libc::CMSG_LEN(0) as usize;
+                let first = libc::CMSG_DATA(header).cast::<libc::c_int>();
+                for index in 0..payload / std::mem::size_of::<libc::c_int>() {
+                    fds.push(OwnedFd::from_raw_fd(first.add(index).read_unaligned()));
+                }
+            }
+            header = libc::CMSG_NXTHDR(&message, header);
+        }
+    }
+    data.truncate(received as usize);
+    Ok((data, fds))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn ring_fds(capacity: usize, seal: bool) -> (OwnedFd, OwnedFd) {
+        unsafe {
+            let memfd = libc::memfd_create(c"test-ring".as_ptr(), libc::MFD_ALLOW_SEALING);
+            assert!(memfd >= 0);
+            assert_eq!(
+                libc::ftruncate(memfd, (RING_HEADER_LEN + capacity) as libc::off_t),
+                0
+            );
+            if seal {
+                assert_eq!(libc::fcntl(memfd, libc::F_ADD_SEALS, REQUIRED_SEALS), 0);
+            }
+            let eventfd = libc::eventfd(0, libc::EFD_NONBLOCK);
+            assert!(eventfd >= 0);
+            (OwnedFd::from_raw_fd(memfd), OwnedFd::from_raw_fd(eventfd))
+        }
+    }
+
+    #[tokio::test]
+    async fn ring_wraps_and_refuses_overflow() {
+        let (memfd, eventfd) = ring_fds(MIN_CAPACITY, true);
+        let ring = ShmRing::attach(memfd, eventfd).unwrap();
+        let mut out = Vec::new();
+
+        // Move the positions close to the end so the next write wraps.
+        let filler = vec![1u8; MIN_CAPACITY - 10];
+        assert!(ring.write(&filler));
+        ring.read(&mut out).unwrap();
+        out.clear();
+
+        let frame: Vec<u8> = (0..64u8).collect();
+        assert!(ring.write(&frame));
+        assert!(!ring.write(&vec![0u8; MIN_CAPACITY]));
+        ring.notify().unwrap();
+        ring.wait().await.unwrap();
+        ring.read(&mut out).unwrap();
+        assert_eq!(out, frame);
+    }
+
+    #[test]
+    fn rejects_unsealed_rings() {
+        let (memfd, eventfd) = ring_fds(MIN_CAPACITY, false);
+        assert!(ShmRing::attach(memfd, eventfd).is_err());
+    }
+}
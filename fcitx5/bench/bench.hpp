@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace aetherime::bench {
+
+struct Case {
+    std::string name;
+    std::function<void(uint64_t iterations)> body;
+};
+
+std::vector<Case> &registry();
+
+struct Registrar {
+    Registrar(std::string name, std::function<void(uint64_t)> body) {
+        registry().push_back({std::move(name), std::move(body)});
+    }
+};
+
+template <typename T>
+inline void doNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} // namespace aetherime::bench
+
+#define AETHERIME_BENCH_CONCAT_INNER(a, b) a##b
+#define AETHERIME_BENCH_CONCAT(a, b) AETHERIME_BENCH_CONCAT_INNER(a, b)
+
+// Registers a benchmark body that runs `iterations` times.
+#define AETHERIME_BENCHMARK(name, iterations)                                                     \
+    static void AETHERIME_BENCH_CONCAT(benchBody, __LINE__)(uint64_t iterations);                 \
+    static ::aetherime::bench::Registrar AETHERIME_BENCH_CONCAT(benchRegistrar, __LINE__)(        \
+        name, AETHERIME_BENCH_CONCAT(benchBody, __LINE__));                                      \
+    static void AETHERIME_BENCH_CONCAT(benchBody, __LINE__)(uint64_t iterations)
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "bench.hpp"
+
+namespace {
+
+// Heap allocations made by this thread; background threads such as the mock
+// daemon do not count against the benchmark.
+thread_local uint64_t allocationCount = 0;
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    ++allocationCount;
+    if (void *pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+
+void operator delete(void *pointer, std::size_t) noexcept { std::free(pointer); }
+
+namespace aetherime::bench {
+
+std::vector<Case> &registry() {
+    static std::vector<Case> cases;
+    return cases;
+}
+
+} // namespace aetherime::bench
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    double nsPerOp = 0;
+    double allocationsPerOp = 0;
+    uint64_t iterations = 0;
+};
+
+Result runCase(const aetherime::bench::Case &benchCase) {
+    constexpr auto kTargetTime = std::chrono::milliseconds(300);
+    uint64_t iterations = 1;
+    while (true) {
+        const auto allocationsBefore = allocationCount;
+        const auto start = Clock::now();
+        benchCase.body(iterations);
+        const auto elapsed = Clock::now() - start;
+        if (elapsed >= kTargetTime || iterations >= (1ULL << 32)) {
+            const auto count = static_cast<double>(iterations);
+            return {std::chrono::duration<double, std::nano>(elapsed).count() / count,
+                    static_cast<double>(allocationCount - allocationsBefore) / count, iterations};
+        }
+        iterations *= elapsed < kTargetTime / 10 ? 10 : 2;
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : nullptr;
+    std::printf("%-48s %14s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "iterations");
+    for (const auto &benchCase : aetherime::bench::registry()) {
+        if (filter && benchCase.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        const auto result = runCase(benchCase);
+        std::printf("%-48s %14.1f %12.2f %12llu\n", benchCase.name.c_str(), result.nsPerOp,
+                    result.allocationsPerOp, static_cast<unsigned long long>(result.iterations));
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "bench.hpp"
+#include "daemon_client.hpp"
+#include "mock_daemon.hpp"
+
+namespace aetherime {
+namespace {
+
+using namespace std::chrono_literals;
+
+const PredictionRequest kRequest = [] {
+    PredictionRequest request;
+    for (int i = 0; i < 8; ++i) {
+        request.prefix += "我们下午三点在会议室继续讨论这个方案，";
+    }
+    request.suffix = "然后再决定 next steps";
+    return request;
+}();
+
+// A mock daemon and a connected client, set up once per case so that only
+// the round trips are timed.
+struct Fixture {
+    explicit Fixture(bench::MockDaemonOptions options)
+        : daemon(options), client(daemon.socketPath(), nullptr) {
+        if (daemon.socketPath().empty() || !client.ping()) {
+            std::fprintf(stderr, "mock daemon unavailable\n");
+        }
+    }
+
+    bench::MockDaemon daemon;
+    DaemonClient client;
+};
+
+void roundTrips(Fixture &fixture, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        bench::doNotOptimize(fixture.client.predict(kRequest));
+    }
+}
+
+AETHERIME_BENCHMARK("client/predict json ghost_24B", iterations) {
+    static Fixture fixture({false, 24, 3, 0us});
+    roundTrips(fixture, iterations);
+}
+
+AETHERIME_BENCHMARK("client/predict binary ghost_24B", iterations) {
+    static Fixture fixture({true, 24, 3, 0us});
+    roundTrips(fixture, iterations);
+}
+
+AETHERIME_BENCHMARK("client/predict json ghost_4k", iterations) {
+    static Fixture fixture({false, 4096, 3, 0us});
+    roundTrips(fixture, iterations);
+}
+
+AETHERIME_BENCHMARK("client/predict binary ghost_4k", iterations) {
+    static Fixture fixture({true, 4096, 3, 0us});
+    roundTrips(fixture, iterations);
+}
+
+AETHERIME_BENCHMARK("client/predict shm ghost_24B", iterations) {
+    static Fixture fixture({true, 24, 3, 0us, true});
+    roundTrips(fixture, iterations);
+}
+
+AETHERIME_BENCHMARK("client/predict shm ghost_4k", iterations) {
+    static Fixture fixture({true, 4096, 3, 0us, true});
+    roundTrips(fixture, iterations);
+}
+
+AETHERIME_BENCHMARK("client/predict binary latency_200us", iterations) {
+    static Fixture fixture({true, 24, 3, 200us});
+    roundTrips(fixture, iterations);
+}
+
+} // namespace
+} // namespace aetherime
@@ -0,0 +1,238 @@
+#include <cstring>
+#include <optional>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "ipc_codec.hpp"
+
+namespace aetherime {
+namespace {
+
+// Regex-based reply parsing as it shipped before the single-pass reader,
+// kept here as the baseline for comparison.
+namespace legacy {
+
+std::string unescapeJson(const std::string &value) {
+    std::string out;
+    out.reserve(value.size());
+    bool escaped = false;
+    for (char c : value) {
+        if (!escaped && c == '\\') {
+            escaped = true;
+            continue;
+        }
+        if (escaped) {
+            switch (c) {
+            case 'n':
+                out.push_back('\n');
+                break;
+            case 'r':
+                out.push_back('\r');
+                break;
+            case 't':
+                out.push_back('\t');
+                break;
+            default:
+                out.push_back(c);
+                break;
+            }
+            escaped = false;
+            continue;
+        }
+        out.push_back(c);
+    }
+    return out;
+}
+
+std::optional<std::string> extractStringField(const std::string &payload, const std::string &field) {
+    std::regex pattern("\"" + field + "\"\\s*:\\s*\"((?:\\\\.|[^\"])*)\"");
+    std::smatch match;
+    if (!std::regex_search(payload, match, pattern) || match.size() < 2) {
+        return std::nullopt;
+    }
+    return unescapeJson(match[1].str());
+}
+
+std::vector<std::string> extractStringArray(const std::string &payload, const std::string &field) {
+    std::vector<std::string> result;
+    std::regex fieldPattern("\"" + field + "\"\\s*:\\s*\\[(.*?)\\]");
+    std::smatch fieldMatch;
+    if (!std::regex_search(payload, fieldMatch, fieldPattern) || fieldMatch.size() < 2) {
+        return result;
+    }
+
+    std::string arrayBody = fieldMatch[1].str();
+    std::regex itemPattern("\"((?:\\\\.|[^\"])*)\"");
+    for (std::sregex_iterator iterator(arrayBody.begin(), arrayBody.end(), itemPattern);
+         iterator != std::sregex_iterator(); ++iterator) {
+        result.push_back(unescapeJson((*iterator)[1].str()));
+    }
+    return result;
+}
+
+std::optional<float> extractFloatField(const std::string &payload, const std::string &field) {
+    std::regex pattern("\"" + field + "\"\\s*:\\s*(-?[0-9]+(?:\\.[0-9]+)?)");
+    std::smatch match;
+    if (!std::regex_search(payload, match, pattern) || match.size() < 2) {
+        return std::nullopt;
+    }
+    return std::stof(match[1].str());
+}
+
+std::optional<int> extractIntField(const std::string &payload, const std::string &field) {
+    std::regex pattern("\"" + field + "\"\\s*:\\s*(-?[0-9]+)");
+    std::smatch match;
+    if (!std::regex_search(payload, match, pattern) || match.size() < 2) {
+        return std::nullopt;
+    }
+    return std::stoi(match[1].str());
+}
+
+PredictionResult decode(const std::string &response) {
+    PredictionResult result;
+    result.ghostText = extractStringField(response, "ghost_text").value_or("");
+    result.candidates = extractStringArray(response, "candidates");
+    result.confidence = extractFloatField(response, "confidence").value_or(0.0f);
+    result.source = extractStringField(response, "source").value_or("");
+    result.elapsedMs = extractIntField(response, "elapsed_ms").value_or(0);
+    return result;
+}
+
+} // namespace legacy
+
+const std::string kShortReply =
+    R"({"id":"1739","type":"predict","ghost_text":"可以先","candidates":["可以先","继续","补充一下"],)"
+    R"("confidence":0.42,"source":"local_next","elapsed_ms":3})";
+
+const std::string kLongReply =
+    R"({"id":"1740","type":"predict","ghost_text":"我们下午三点在\"会议室 B\"继续讨论这个方案，\n)"
+    R"(然后再决定 next steps","candidates":["我们下午三点在\"会议室 B\"继续讨论这个方案，\n然后再决定 next steps",)"
+    R"("继续讨论","再确认一下","看看大家的意见","补充一些细节","明天","稍后","OK, let's sync"],)"
+    R"("confidence":0.87,"source":"local_fim","elapsed_ms":412})";
+
+AETHERIME_BENCHMARK("decode/regex short_zh", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        bench::doNotOptimize(legacy::decode(kShortReply));
+    }
+}
+
+AETHERIME_BENCHMARK("decode/single_pass short_zh", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        DaemonReply reply;
+        decodeReply(kShortReply, reply);
+        bench::doNotOptimize(reply);
+    }
+}
+
+AETHERIME_BENCHMARK("decode/regex long_mixed", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        bench::doNotOptimize(legacy::decode(kLongReply));
+    }
+}
+
+AETHERIME_BENCHMARK("decode/single_pass long_mixed", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        DaemonReply reply;
+        decodeReply(kLongReply, reply);
+        bench::doNotOptimize(reply);
+    }
+}
+
+void appendLe32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+std::string binaryReply(const PredictionResult &result) {
+    std::string body;
+    uint32_t confidenceBits = 0;
+    std::memcpy(&confidenceBits, &result.confidence, sizeof(confidenceBits));
+    appendLe32(body, confidenceBits);
+    appendLe32(body, static_cast<uint32_t>(result.elapsedMs));
+    body.push_back('\0');
+    body.push_back('\0');
+    body.push_back(static_cast<char>(result.candidates.size()));
+    body.push_back('\0');
+    appendLe32(body, static_cast<uint32_t>(result.ghostText.size()));
+    body += result.ghostText;
+    for (const auto &candidate : result.candidates) {
+        appendLe32(body, static_cast<uint32_t>(candidate.size()));
+        body += candidate;
+    }
+
+    std::string frame;
+    appendLe32(frame, static_cast<uint32_t>(body.size()));
+    frame += std::string("\x81\0\0\0", 4);
+    appendLe32(frame, 1740);
+    appendLe32(frame, 0);
+    return frame + body;
+}
+
+const std::string kLongBinaryReply = binaryReply(legacy::decode(kLongReply));
+
+const PredictionRequest kLongRequest = [] {
+    PredictionRequest request;
+    for (int i = 0; i < 16; ++i) {
+        request.prefix += "我们下午在\"会议室 B\"讨论方案，";
+    }
+    request.suffix = "然后再决定\n next steps";
+    return request;
+}();
+
+AETHERIME_BENCHMARK("decode/binary long_mixed", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        DaemonReply reply;
+        size_t consumed = 0;
+        decodeFrame(kLongBinaryReply, reply, consumed);
+        bench::doNotOptimize(reply);
+    }
+}
+
+AETHERIME_BENCHMARK("encode/json long_context", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        bench::doNotOptimize(encodePredictRequest(i, kLongRequest));
+    }
+}
+
+AETHERIME_BENCHMARK("encode/json_string long_context", iterations) {
+    std::string out;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        out.clear();
+        appendJsonString(out, kLongRequest.prefix);
+        bench::doNotOptimize(out);
+    }
+}
+
+AETHERIME_BENCHMARK("encode/binary long_context", iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        std::string frame;
+        appendPredictFrame(frame, i, kLongRequest);
+        bench::doNotOptimize(frame);
+    }
+}
+
+// The next keystroke on kLongRequest: one character typed, and the first one
+// scrolled out of the window.
+const PredictionRequest kNextLongRequest = [] {
+    auto request = kLongRequest;
+    request.prefix.erase(0, std::strlen("我"));
+    request.prefix += "好";
+    return request;
+}();
+
+AETHERIME_BENCHMARK("encode/binary session_delta", iterations) {
+    const auto before = kLongRequest.prefix + kLongRequest.suffix;
+    const auto after = kNextLongRequest.prefix + kNextLongRequest.suffix;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        SessionContext session{1, diffContext(before, after), kNextLongRequest.prefix.size()};
+        std::string frame;
+        appendPredictFrame(frame, i, kNextLongRequest, &session);
+        bench::doNotOptimize(frame);
+    }
+}
+
+} // namespace
+} // namespace aetherime
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "daemon_client.hpp"
+#include "latency_trace.hpp"
+#include "mock_daemon.hpp"
+#include "text_fields.hpp"
+#include "text_scan.hpp"
+
+namespace aetherime {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string socketPath;
+    bool mock = false;
+    uint64_t mockLatencyMs = 0;
+    std::vector<uint64_t> contexts{1, 2, 4, 8, 16, 32};
+    uint64_t durationSec = 10;
+    double keysPerSec = 5.0;
+    uint64_t contextChars = 200;
+    uint64_t budgetMs = 90;
+    Language language = Language::Zh;
+};
+
+struct StepResult {
+    LatencyHistogram latency;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> replies{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> unreachable{0};
+};
+
+constexpr std::string_view kZhText =
+    "我们下午三点在会议室继续讨论这个方案，请大家提前准备好相关的数据和报告。"
+    "如果时间允许的话，我们还会讨论下个季度的计划以及预算安排。";
+constexpr std::string_view kEnText =
+    "We will continue the design review in the meeting room at three this afternoon. "
+    "Please bring the latest numbers, and if time allows we will also go over next "
+    "quarter's plan and the budget. ";
+
+// One simulated input context: its own connection, typing at a randomized
+// rate and asking for a prediction after every keystroke, as the addon does
+// once the trigger delay passes. Requests are blocking, so a slow daemon
+// also slows the typist down, like a context whose previous request is
+// still in flight.
+void runContext(const Options &options, size_t index, Clock::time_point deadline,
+                StepResult &result) {
+    DaemonClient client(options.socketPath, nullptr);
+    if (!client.ping()) {
+        result.unreachable.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::mt19937_64 random(index * 0x9E3779B97F4A7C15ULL + 1);
+    std::exponential_distribution<double> gap(options.keysPerSec);
+    const auto text = options.language == Language::Zh ? kZhText : kEnText;
+    const auto textChars = countCodePoints(text);
+    // Contexts start at different places in the sample so that replies
+    // cannot be served from one cached prefix.
+    size_t position = random() % textChars;
+    std::string document;
+    for (uint64_t i = 0; i < options.contextChars; ++i, ++position) {
+        const auto start = codePointOffset(text, position % textChars);
+        document.append(text.substr(start, codePointOffset(text.substr(start), 1)));
+    }
+
+    PredictionRequest request;
+    request.language = options.language;
+    request.mode = PredictMode::Next;
+    request.latencyBudgetMs = static_cast<int>(options.budgetMs);
+    const auto timeout = std::chrono::milliseconds(options.budgetMs);
+
+    auto nextKey = Clock::now();
+    while (true) {
+        nextKey += std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(gap(random)));
+        if (nextKey >= deadline) {
+            return;
+        }
+        std::this_thread::sleep_until(nextKey);
+
+        // Type the next character of the sample, keeping the window size.
+        const auto start = codePointOffset(text, position++ % textChars);
+        document.append(text.substr(start, codePointOffset(text.substr(start), 1)));
+        document.erase(0, codePointOffset(document, 1));
+        request.prefix = document;
+
+        result.requests.fetch_add(1, std::memory_order_relaxed);
+        const auto sentAt = Clock::now();
+        const auto prediction = client.predict(request);
+        const auto elapsed = Clock::now() - sentAt;
+        if (prediction) {
+            result.replies.fetch_add(1, std::memory_order_relaxed);
+            result.latency.record(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        } else if (elapsed >= timeout) {
+            // Failures after the budget are the client giving up on the reply.
+            result.timeouts.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            result.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        nextKey = std::max(nextKey, Clock::now());
+    }
+}
+
+double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * static_cast<double>(part) / static_cast<double>(total) : 0.0;
+}
+
+void runStep(const Options &options, uint64_t contexts) {
+    StepResult result;
+    const auto startedAt = Clock::now();
+    const auto deadline = startedAt + std::chrono::seconds(options.durationSec);
+    std::vector<std::thread> threads;
+    threads.reserve(contexts);
+    for (uint64_t i = 0; i < contexts; ++i) {
+        threads.emplace_back(
+            [&, i] { runContext(options, static_cast<size_t>(i), deadline, result); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto seconds = std::chrono::duration<double>(Clock::now() - startedAt).count();
+
+    const auto summary = result.latency.summary();
+    const auto requests = result.requests.load();
+    std::printf("%8llu %10.1f %10.1f %9.1f %9.1f %9.1f %9.2f %9.2f %11llu\n",
+                static_cast<unsigned long long>(contexts),
+                static_cast<double>(contexts) * options.keysPerSec,
+                static_cast<double>(result.replies.load()) / seconds,
+                static_cast<double>(summary.p50Ns) / 1e6, static_cast<double>(summary.p99Ns) / 1e6,
+                static_cast<double>(summary.maxNs) / 1e6,
+                percent(result.timeouts.load(), requests), percent(result.errors.load(), requests),
+                static_cast<unsigned long long>(result.unreachable.load()));
+    std::fflush(stdout);
+}
+
+bool parseList(std::string_view field, std::vector<uint64_t> &values) {
+    values.clear();
+    while (true) {
+        const auto comma = field.find(',');
+        uint64_t value = 0;
+        if (!parseNumber(field.substr(0, comma), value) || value == 0) {
+            return false;
+        }
+        values.push_back(value);
+        if (comma == std::string_view::npos) {
+            return true;
+        }
+        field.remove_prefix(comma + 1);
+    }
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+    for (int arg = 1; arg < argc; ++arg) {
+        const std::string_view option = argv[arg];
+        if (option == "--mock") {
+            options.mock = true;
+            continue;
+        }
+        if (arg + 1 == argc) {
+            return false;
+        }
+        const std::string_view value = argv[++arg];
+        bool ok = true;
+        if (option == "--socket") {
+            options.socketPath = value;
+        } else if (option == "--mock-latency-ms") {
+            ok = parseNumber(value, options.mockLatencyMs);
+        } else if (option == "--contexts") {
+            ok = parseList(value, options.contexts);
+        } else if (option == "--duration-s") {
+            ok = parseNumber(value, options.durationSec) && options.durationSec > 0;
+        } else if (option == "--keys-per-sec") {
+            options.keysPerSec = std::atof(argv[arg]);
+            ok = options.keysPerSec > 0;
+        } else if (option == "--context-chars") {
+            ok = parseNumber(value, options.contextChars) && options.contextChars > 0;
+        } else if (option == "--budget-ms") {
+            ok = parseNumber(value, options.budgetMs) && options.budgetMs > 0;
+        } else if (option == "--language") {
+            ok = value == "zh" || value == "en";
+            options.language = value == "en" ? Language::En : Language::Zh;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+} // namespace aetherime
+
+// Simulates many input contexts sharing one daemon, as on a terminal server,
+// and steps through increasing concurrency to show where it saturates.
+int main(int argc, char **argv) {
+    using namespace aetherime;
+
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::fprintf(stderr,
+                     "usage: %s [--socket PATH | --mock [--mock-latency-ms N]] "
+                     "[--contexts 1,2,4,...] [--duration-s N] [--keys-per-sec X] "
+                     "[--context-chars N] [--budget-ms N] [--language zh|en]\n",
+                     argv[0]);
+        return 2;
+    }
+
+    std::unique_ptr<bench::MockDaemon> daemon;
+    if (options.mock) {
+        bench::MockDaemonOptions mockOptions;
+        mockOptions.latency = std::chrono::milliseconds(options.mockLatencyMs);
+        daemon = std::make_unique<bench::MockDaemon>(mockOptions);
+        if (daemon->socketPath().empty()) {
+            std::fprintf(stderr, "cannot start mock daemon\n");
+            return 1;
+        }
+        options.socketPath = daemon->socketPath();
+    } else if (options.socketPath.empty()) {
+        const char *socket = std::getenv("AETHERIME_SOCKET");
+        options.socketPath = socket && *socket ? socket : "/tmp/aetherime.sock";
+    }
+
+    std::printf("# %s, %.1f keys/s per context, %llu chars of context, %llu ms budget, %llu s "
+                "per step\n",
+                options.socketPath.c_str(), options.keysPerSec,
+                static_cast<unsigned long long>(options.contextChars),
+                static_cast<unsigned long long>(options.budgetMs),
+                static_cast<unsigned long long>(options.durationSec));
+    std::printf("%8s %10s %10s %9s %9s %9s %9s %9s %11s\n", "contexts", "offered/s", "replies/s",
+                "p50_ms", "p99_ms", "max_ms", "timeout%", "error%", "unreachable");
+    for (const auto contexts : options.contexts) {
+        runStep(options, contexts);
+    }
+    return 0;
+}
@@ -0,0 +1,381 @@
+#include "mock_daemon.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipc_codec.hpp"
+
+namespace aetherime::bench {
+
+namespace {
+
+constexpr uint8_t kFramePredict = 0x01;
+constexpr uint8_t kFramePing = 0x02;
+constexpr uint8_t kFramePredictReply = 0x81;
+constexpr uint8_t kFramePong = 0x82;
+constexpr uint8_t kFrameGhostDelta = 0x83;
+constexpr uint8_t kFlagStream = 0x01;
+// Streamed replies arrive in this many deltas, spread over the latency.
+constexpr size_t kStreamChunks = 4;
+
+void appendLe(std::string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+uint64_t readLe(const std::string &input, size_t offset, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(input[offset + i])) << (8 * i);
+    }
+    return value;
+}
+
+void appendFrameHeader(std::string &out, uint8_t kind, uint64_t id, size_t bodySize) {
+    appendLe(out, bodySize, 4);
+    out.push_back(static_cast<char>(kind));
+    out.push_back('\0');
+    appendLe(out, 0, 2);
+    appendLe(out, id, 8);
+}
+
+bool writeAll(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        const auto result = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+} // namespace
+
+MockDaemon::MockDaemon(MockDaemonOptions options) : options_(options) {
+    while (ghost_.size() + 3 <= options_.ghostBytes) {
+        ghost_ += "好";
+    }
+    ghost_.append(options_.ghostBytes - ghost_.size(), 'a');
+
+    char directory[] = "/tmp/aetherime-bench-XXXXXX";
+    if (!mkdtemp(directory)) {
+        return;
+    }
+    directory_ = directory;
+    const std::string path = directory_ + "/daemon.sock";
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0 ||
+        bind(listenFd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+        listen(listenFd_, SOMAXCONN) < 0 || pipe2(wakeFd_, O_CLOEXEC) < 0) {
+        return;
+    }
+    socketPath_ = path;
+    thread_ = std::thread([this] { run(); });
+}
+
+MockDaemon::~MockDaemon() {
+    if (thread_.joinable()) {
+        const char stop = 0;
+        (void)!write(wakeFd_[1], &stop, 1);
+        thread_.join();
+    }
+    for (int fd : {listenFd_, wakeFd_[0], wakeFd_[1]}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (!socketPath_.empty()) {
+        unlink(socketPath_.c_str());
+    }
+    if (!directory_.empty()) {
+        rmdir(directory_.c_str());
+    }
+}
+
+void MockDaemon::run() {
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<pollfd> fds;
+    while (true) {
+        fds.clear();
+        fds.push_back({wakeFd_[0], POLLIN, 0});
+        fds.push_back({listenFd_, POLLIN, 0});
+        for (const auto &connection : connections) {
+            fds.push_back({connection->fd, POLLIN, 0});
+            fds.push_back(
+                {connection->requestRing ? connection->requestRing->eventFd() : -1, POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        for (size_t i = connections.size(); i-- > 0;) {
+            const auto &socket = fds[2 + 2 * i];
+            const auto &ring = fds[3 + 2 * i];
+            auto &connection = *connections[i];
+            bool open = true;
+            if (socket.revents) {
+                open = serve(connection);
+            }
+            if (open && (ring.revents & POLLIN)) {
+                connection.requestRing->clearEvents();
+                open = connection.requestRing->read(connection.incoming) && answer(connection);
+            }
+            if (!open) {
+                for (int fd : connection.passedFds) {
+                    close(fd);
+                }
+                close(connection.fd);
+                connections.erase(connections.begin() + static_cast<ptrdiff_t>(i));
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            const int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                connections.push_back(std::make_unique<Connection>());
+                connections.back()->fd = fd;
+            }
+        }
+    }
+    for (const auto &connection : connections) {
+        close(connection->fd);
+    }
+}
+
+// Reads what is available on the socket, keeping descriptors passed along
+// with the hello, and answers every complete request in it. Returns false
+// once the peer has gone away.
+bool MockDaemon::serve(Connection &connection) {
+    char buffer[4096];
+    alignas(cmsghdr) char control[CMSG_SPACE(4 * sizeof(int))];
+    iovec iov{buffer, sizeof(buffer)};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    const auto readBytes = recvmsg(connection.fd, &message, MSG_CMSG_CLOEXEC);
+    if (readBytes <= 0) {
+        return readBytes < 0 && errno == EINTR;
+    }
+    for (auto *header = CMSG_FIRSTHDR(&message); header;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            connection.passedFds.push_back(fd);
+        }
+    }
+    connection.incoming.append(buffer, static_cast<size_t>(readBytes));
+    return answer(connection);
+}
+
+bool MockDaemon::answer(Connection &connection) {
+    // The pong that switches to the rings still goes out on the socket.
+    const bool viaSocket = connection.wire != WireFormat::SharedMemory;
+    auto &incoming = connection.incoming;
+    std::string out;
+    bool predicted = false;
+    std::vector<uint64_t> streamed;
+    while (true) {
+        if (connection.wire != WireFormat::Json) {
+            if (incoming.size() < kFrameHeaderSize) {
+                break;
+            }
+            const auto frameSize = kFrameHeaderSize + readLe(incoming, 0, 4);
+            if (incoming.size() < frameSize) {
+                break;
+            }
+            const auto kind = static_cast<uint8_t>(incoming[4]);
+            const auto flags = static_cast<uint8_t>(incoming[5]);
+            const auto id = readLe(incoming, 8, 8);
+            incoming.erase(0, frameSize);
+            if (kind == kFramePredict && (flags & kFlagStream)) {
+                streamed.push_back(id);
+            } else if (kind == kFramePredict) {
+                appendPrediction(out, id, true);
+                predicted = true;
+            } else if (kind == kFramePing) {
+                appendFrameHeader(out, kFramePong, id, 0);
+            }
+            continue;
+        }
+
+        const auto newline = incoming.find('\n');
+        if (newline == std::string::npos) {
+            break;
+        }
+        const std::string line = incoming.substr(0, newline);
+        incoming.erase(0, newline + 1);
+        DaemonReply request;
+        if (!decodeReply(line, request) || !request.hasId) {
+            continue; // cancels carry their ids in a list
+        }
+        if (line.find(R"("type":"ping")") != std::string::npos) {
+            out += R"({"id":")" + std::to_string(request.id) + R"(","type":"pong")";
+            const auto protocol = negotiate(connection, line);
+            if (!protocol.empty()) {
+                out += R"(,"protocol":")" + std::string(protocol) + "\"";
+            }
+            out += "}\n";
+        } else if (line.find(R"("stream":true)") != std::string::npos) {
+            streamed.push_back(request.id);
+        } else {
+            appendPrediction(out, request.id, false);
+            predicted = true;
+        }
+    }
+
+    if (!out.empty()) {
+        if (predicted && options_.latency.count() > 0) {
+            std::this_thread::sleep_for(options_.latency);
+        }
+        if (!(viaSocket ? writeAll(connection.fd, out) : send(connection, out))) {
+            return false;
+        }
+    }
+    for (const auto id : streamed) {
+        if (!streamPrediction(connection, id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Picks the protocol for a hello ping, mapping the rings passed with it when
+// shared memory is accepted. Descriptors not used are closed.
+std::string_view MockDaemon::negotiate(Connection &connection, const std::string &ping) {
+    auto fds = std::move(connection.passedFds);
+    connection.passedFds.clear();
+    std::string_view protocol;
+    if (options_.sharedMemory && fds.size() == 4 &&
+        ping.find(kProtocolShmRingV1) != std::string::npos) {
+        connection.requestRing = ShmRing::attach(fds[0], fds[2]);
+        connection.replyRing = ShmRing::attach(fds[1], fds[3]);
+        fds.clear();
+        if (connection.requestRing && connection.replyRing) {
+            protocol = kProtocolShmRingV1;
+        } else {
+            connection.requestRing.reset();
+            connection.replyRing.reset();
+        }
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+    if (protocol.empty() && options_.binary && ping.find(kProtocolBinaryV2) != std::string::npos) {
+        protocol = kProtocolBinaryV2;
+    }
+    connection.wire = protocol == kProtocolShmRingV1 ? WireFormat::SharedMemory
+                      : protocol.empty()             ? WireFormat::Json
+                                                     : WireFormat::Binary;
+    return protocol;
+}
+
+bool MockDaemon::send(Connection &connection, const std::string &data) const {
+    if (connection.wire != WireFormat::SharedMemory) {
+        return writeAll(connection.fd, data);
+    }
+    if (!connection.replyRing->write(data)) {
+        return false;
+    }
+    connection.replyRing->notify();
+    return true;
+}
+
+// Sends the ghost in deltas with the latency spread between them, then the
+// final reply, like a model generating token by token.
+bool MockDaemon::streamPrediction(Connection &connection, uint64_t id) const {
+    const bool binary = connection.wire != WireFormat::Json;
+    size_t sent = 0;
+    for (size_t chunk = 1; chunk <= kStreamChunks; ++chunk) {
+        auto end = ghost_.size() * chunk / kStreamChunks;
+        while (end < ghost_.size() && (static_cast<unsigned char>(ghost_[end]) & 0xC0) == 0x80) {
+            ++end;
+        }
+        if (options_.latency.count() > 0) {
+            std::this_thread::sleep_for(options_.latency / kStreamChunks);
+        }
+        if (end <= sent) {
+            continue;
+        }
+        const auto delta = ghost_.substr(sent, end - sent);
+        sent = end;
+        std::string out;
+        if (binary) {
+            appendFrameHeader(out, kFrameGhostDelta, id, delta.size());
+            out += delta;
+        } else {
+            out += R"({"id":")" + std::to_string(id) + R"(","type":"ghost_delta","text":)";
+            appendJsonString(out, delta);
+            out += "}\n";
+        }
+        if (!send(connection, out)) {
+            return false;
+        }
+    }
+    std::string out;
+    appendPrediction(out, id, binary);
+    return send(connection, out);
+}
+
+void MockDaemon::appendPrediction(std::string &out, uint64_t id, bool binary) const {
+    if (binary) {
+        const size_t bodySize = 16 + ghost_.size() + options_.candidateCount * (4 + ghost_.size());
+        appendFrameHeader(out, kFramePredictReply, id, bodySize);
+        const float confidence = 0.5f;
+        uint32_t confidenceBits = 0;
+        std::memcpy(&confidenceBits, &confidence, sizeof(confidenceBits));
+        appendLe(out, confidenceBits, 4);
+        appendLe(out, 0, 4); // elapsed_ms
+        out.push_back('\0'); // local_fim
+        out.push_back('\0');
+        appendLe(out, options_.candidateCount, 2);
+        appendLe(out, ghost_.size(), 4);
+        out += ghost_;
+        for (size_t i = 0; i < options_.candidateCount; ++i) {
+            appendLe(out, ghost_.size(), 4);
+            out += ghost_;
+        }
+        return;
+    }
+    out += R"({"id":")" + std::to_string(id) + R"(","type":"predict","ghost_text":)";
+    appendJsonString(out, ghost_);
+    out += R"(,"candidates":[)";
+    for (size_t i = 0; i < options_.candidateCount; ++i) {
+        if (i > 0) {
+            out.push_back(',');
+        }
+        appendJsonString(out, ghost_);
+    }
+    out += R"(],"confidence":0.5,"source":"local_fim","elapsed_ms":0})";
+    out.push_back('\n');
+}
+
+} // namespace aetherime::bench
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "daemon_client.hpp"
+#include "shm_ring.hpp"
+
+namespace aetherime::bench {
+
+struct MockDaemonOptions {
+    // Accept the binary-v2 offer in the hello ping; otherwise stay on JSON.
+    bool binary = true;
+    // UTF-8 bytes of ghost text per reply; candidates repeat it.
+    size_t ghostBytes = 24;
+    size_t candidateCount = 3;
+    // Delay before each prediction reply, standing in for model time.
+    // Streaming requests get their deltas spread over it instead.
+    std::chrono::microseconds latency{0};
+    // Accept the shared-memory rings when the hello ping passes them.
+    bool sharedMemory = false;
+};
+
+// A daemon stand-in serving the addon protocol on a Unix socket in a fresh
+// temporary directory. Requests are answered from a background thread with
+// canned predictions, so client round trips can be measured without a model.
+class MockDaemon {
+public:
+    explicit MockDaemon(MockDaemonOptions options);
+    ~MockDaemon();
+
+    MockDaemon(const MockDaemon &) = delete;
+    MockDaemon &operator=(const MockDaemon &) = delete;
+
+    // Empty if the socket could not be set up.
+    const std::string &socketPath() const { return socketPath_; }
+
+private:
+    struct Connection {
+        int fd = -1;
+        std::string incoming;
+        WireFormat wire = WireFormat::Json;
+        std::vector<int> passedFds;
+        std::unique_ptr<ShmRing> requestRing;
+        std::unique_ptr<ShmRing> replyRing;
+    };
+
+    void run();
+    bool serve(Connection &connection);
+    bool answer(Connection &connection);
+    std::string_view negotiate(Connection &connection, const std::string &ping);
+    bool send(Connection &connection, const std::string &data) const;
+    bool streamPrediction(Connection &connection, uint64_t id) const;
+    void appendPrediction(std::string &out, uint64_t id, bool binary) const;
+
+    MockDaemonOptions options_;
+    std::string directory_;
+    std::string socketPath_;
+    std::string ghost_;
+    int listenFd_ = -1;
+    int wakeFd_[2] = {-1, -1};
+    std::thread thread_;
+};
+
+} // namespace aetherime::bench
@@ -0,0 +1,450 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/key.h>
+#include <fcitx/event.h>
+#include <fcitx/inputcontext.h>
+#include <fcitx/inputmethodentry.h>
+#include <fcitx/instance.h>
+#include <fcitx/text.h>
+
+#include "aetherime_engine.hpp"
+#include "latency_trace.hpp"
+#include "mock_daemon.hpp"
+#include "text_fields.hpp"
+#include "text_scan.hpp"
+
+namespace aetherime {
+namespace {
+
+using Clock = LatencyTracer::Clock;
+
+struct TraceEvent {
+    enum class Kind { Key, Text };
+
+    uint64_t timeMs = 0;
+    Kind kind = Kind::Key;
+    fcitx::Key key;
+    std::string text;
+    size_t cursorChars = 0;
+};
+
+std::string unescapeText(std::string_view field) {
+    std::string text;
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] != '\\' || i + 1 == field.size()) {
+            text.push_back(field[i]);
+            continue;
+        }
+        switch (field[++i]) {
+        case 'n':
+            text.push_back('\n');
+            break;
+        case 't':
+            text.push_back('\t');
+            break;
+        default:
+            text.push_back(field[i]);
+            break;
+        }
+    }
+    return text;
+}
+
+// Each line is "<ms><TAB>key<TAB><fcitx key name>" or
+// "<ms><TAB>text<TAB><cursor chars><TAB><surrounding text>", where the text
+// uses \n, \t and \\ escapes. Times are relative to the start of the trace.
+std::optional<std::vector<TraceEvent>> loadTrace(const char *path) {
+    std::ifstream input(path);
+    if (!input) {
+        std::fprintf(stderr, "cannot open %s\n", path);
+        return std::nullopt;
+    }
+    std::vector<TraceEvent> events;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(input, line)) {
+        ++lineNumber;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+        const auto fields = splitTabs(line);
+        TraceEvent event;
+        bool ok = fields.size() >= 3 && parseNumber(fields[0], event.timeMs) &&
+                  (events.empty() || event.timeMs >= events.back().timeMs);
+        if (ok && fields[1] == "key" && fields.size() == 3) {
+            event.key = fcitx::Key(std::string(fields[2]).c_str());
+            ok = event.key.isValid();
+        } else if (ok && fields[1] == "text" && fields.size() == 4) {
+            event.kind = TraceEvent::Kind::Text;
+            uint64_t cursor = 0;
+            ok = parseNumber(fields[2], cursor);
+            event.cursorChars = static_cast<size_t>(cursor);
+            event.text = unescapeText(fields[3]);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::fprintf(stderr, "%s:%zu: expected time, key or text event\n", path, lineNumber);
+            return std::nullopt;
+        }
+        events.push_back(std::move(event));
+    }
+    return events;
+}
+
+size_t commonPrefixChars(std::string_view lhs, std::string_view rhs) {
+    size_t length = 0;
+    while (length < lhs.size() && length < rhs.size() && lhs[length] == rhs[length]) {
+        ++length;
+    }
+    // Only whole code points count.
+    while (length > 0 && length < lhs.size() &&
+           (static_cast<unsigned char>(lhs[length]) & 0xC0) == 0x80) {
+        --length;
+    }
+    return countCodePoints(lhs.substr(0, length));
+}
+
+class Replay;
+
+// Plays the application: keeps the document the engine commits into and
+// reports preedit updates back to the replay.
+class ReplayInputContext final : public fcitx::InputContext {
+public:
+    ReplayInputContext(fcitx::InputContextManager &manager, Replay *replay)
+        : fcitx::InputContext(manager, "aetherime-replay"), replay_(replay) {
+        created();
+        setCapabilityFlags(fcitx::CapabilityFlags(fcitx::CapabilityFlag::Preedit) |
+                           fcitx::CapabilityFlag::SurroundingText);
+        setDocument({}, 0);
+    }
+    ~ReplayInputContext() override { destroy(); }
+
+    const char *frontend() const override { return "replay"; }
+
+    void setDocument(std::string text, size_t cursorChars);
+    void insert(std::string_view text);
+    void eraseBefore();
+    // Applications report their surrounding text after handling a commit or
+    // key, not while the engine is still running; edits become visible to
+    // the engine here, before the next event.
+    void publish() { surroundingText().setText(document_, cursorChars_, cursorChars_); }
+
+protected:
+    void commitStringImpl(const std::string &text) override;
+    void deleteSurroundingTextImpl(int offset, unsigned int size) override;
+    void forwardKeyImpl(const fcitx::ForwardKeyEvent &) override {}
+    void updatePreeditImpl() override;
+
+private:
+    size_t cursorByte() const { return codePointOffset(document_, cursorChars_); }
+
+    Replay *replay_;
+    std::string document_;
+    size_t cursorChars_ = 0;
+};
+
+class Replay {
+public:
+    Replay(fcitx::Instance &instance, AetherImeEngine &engine)
+        : engine_(engine), ic_(instance.inputContextManager(), this) {}
+
+    void apply(const TraceEvent &event);
+    void onCommit(const std::string &text);
+    void onPreedit();
+    void report() const;
+
+private:
+    void pressKey(const fcitx::Key &key);
+
+    AetherImeEngine &engine_;
+    ReplayInputContext ic_;
+    fcitx::InputMethodEntry entry_{"aetherime", "AetherIME", "zh_CN", "aetherime"};
+
+    LatencyHistogram keyLatency_;
+    LatencyHistogram ghostLatency_;
+    uint64_t keys_ = 0;
+    uint64_t filteredKeys_ = 0;
+    uint64_t commits_ = 0;
+    uint64_t ghostsShown_ = 0;
+    uint64_t opportunities_ = 0;
+    uint64_t matchedChars_ = 0;
+    uint64_t accepted_ = 0;
+
+    Clock::time_point lastKeyAt_;
+    bool awaitingGhost_ = false;
+    bool composing_ = false;
+    bool tabWithGhost_ = false;
+    std::string visibleGhost_;
+    // The ghost that was showing when the current word was started; the
+    // next commit shows whether accepting it would have helped.
+    std::string armedGhost_;
+};
+
+void ReplayInputContext::setDocument(std::string text, size_t cursorChars) {
+    document_ = std::move(text);
+    cursorChars_ = std::min(cursorChars, countCodePoints(document_));
+    publish();
+}
+
+void ReplayInputContext::insert(std::string_view text) {
+    document_.insert(cursorByte(), text);
+    cursorChars_ += countCodePoints(text);
+}
+
+void ReplayInputContext::eraseBefore() {
+    if (cursorChars_ == 0) {
+        return;
+    }
+    const auto end = cursorByte();
+    --cursorChars_;
+    const auto start = cursorByte();
+    document_.erase(start, end - start);
+}
+
+void ReplayInputContext::commitStringImpl(const std::string &text) {
+    insert(text);
+    replay_->onCommit(text);
+}
+
+void ReplayInputContext::deleteSurroundingTextImpl(int offset, unsigned int size) {
+    const auto first = static_cast<long long>(cursorChars_) + offset;
+    const auto total = static_cast<long long>(countCodePoints(document_));
+    if (first < 0 || first + size > total) {
+        return;
+    }
+    const auto start = codePointOffset(document_, static_cast<size_t>(first));
+    const auto end = codePointOffset(document_, static_cast<size_t>(first) + size);
+    document_.erase(start, end - start);
+    if (cursorChars_ > static_cast<size_t>(first)) {
+        cursorChars_ = std::max(static_cast<size_t>(first), cursorChars_ - size);
+    }
+}
+
+void ReplayInputContext::updatePreeditImpl() { replay_->onPreedit(); }
+
+void Replay::apply(const TraceEvent &event) {
+    ic_.publish();
+    if (event.kind == TraceEvent::Kind::Text) {
+        ic_.setDocument(event.text, event.cursorChars);
+        return;
+    }
+    pressKey(event.key);
+}
+
+void Replay::pressKey(const fcitx::Key &key) {
+    ++keys_;
+    if (!composing_ && !visibleGhost_.empty()) {
+        armedGhost_ = visibleGhost_;
+    }
+    tabWithGhost_ = key.check(FcitxKey_Tab) && !visibleGhost_.empty();
+    lastKeyAt_ = Clock::now();
+    awaitingGhost_ = true;
+
+    fcitx::KeyEvent event(&ic_, key);
+    engine_.keyEvent(entry_, event);
+    keyLatency_.record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - lastKeyAt_).count()));
+    tabWithGhost_ = false;
+
+    if (event.filtered()) {
+        ++filteredKeys_;
+        return;
+    }
+    // What the application does with keys the engine lets through.
+    if (key.check(FcitxKey_BackSpace)) {
+        ic_.eraseBefore();
+    } else if (key.check(FcitxKey_Return)) {
+        ic_.insert("\n");
+    } else if (key.states() == fcitx::KeyStates() ||
+               key.states() == fcitx::KeyStates(fcitx::KeyState::Shift)) {
+        ic_.insert(fcitx::Key::keySymToUTF8(key.sym()));
+    }
+}
+
+void Replay::onCommit(const std::string &text) {
+    ++commits_;
+    if (tabWithGhost_) {
+        ++accepted_;
+    }
+    if (!armedGhost_.empty()) {
+        if (const auto matched = commonPrefixChars(text, armedGhost_); matched > 0) {
+            ++opportunities_;
+            matchedChars_ += matched;
+        }
+        armedGhost_.clear();
+    }
+}
+
+void Replay::onPreedit() {
+    const auto &preedit = ic_.inputPanel().clientPreedit();
+    std::string ghost;
+    composing_ = false;
+    for (size_t i = 0; i < preedit.size(); ++i) {
+        if (preedit.formatAt(static_cast<int>(i)) & fcitx::TextFormatFlag::Italic) {
+            ghost += preedit.stringAt(static_cast<int>(i));
+        } else if (!preedit.stringAt(static_cast<int>(i)).empty()) {
+            composing_ = true;
+        }
+    }
+    if (ghost == visibleGhost_) {
+        return;
+    }
+    visibleGhost_ = std::move(ghost);
+    if (visibleGhost_.empty()) {
+        return;
+    }
+    ++ghostsShown_;
+    if (awaitingGhost_) {
+        ghostLatency_.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - lastKeyAt_)
+                .count()));
+        awaitingGhost_ = false;
+    }
+}
+
+void printLatency(const char *name, const LatencySummary &summary) {
+    std::printf("%-24s %8llu %10.1f %10.1f %10.1f\n", name,
+                static_cast<unsigned long long>(summary.count),
+                static_cast<double>(summary.p50Ns) / 1000.0,
+                static_cast<double>(summary.p99Ns) / 1000.0,
+                static_cast<double>(summary.maxNs) / 1000.0);
+}
+
+void Replay::report() const {
+    auto *tracer = engine_.latencyTracer();
+    std::printf("keys %llu (filtered %llu), commits %llu\n",
+                static_cast<unsigned long long>(keys_),
+                static_cast<unsigned long long>(filteredKeys_),
+                static_cast<unsigned long long>(commits_));
+    std::printf("daemon predictions %llu, replies %llu\n",
+                static_cast<unsigned long long>(
+                    tracer->summary(LatencyStage::RequestEncode).count),
+                static_cast<unsigned long long>(
+                    tracer->summary(LatencyStage::DaemonRoundTrip).count));
+    std::printf("ghosts shown %llu, accept opportunities %llu (%llu chars), accepted %llu\n\n",
+                static_cast<unsigned long long>(ghostsShown_),
+                static_cast<unsigned long long>(opportunities_),
+                static_cast<unsigned long long>(matchedChars_),
+                static_cast<unsigned long long>(accepted_));
+
+    std::printf("%-24s %8s %10s %10s %10s\n", "latency", "count", "p50_us", "p99_us", "max_us");
+    printLatency("keystroke", keyLatency_.summary());
+    printLatency("keystroke_to_ghost", ghostLatency_.summary());
+    for (size_t i = 0; i < static_cast<size_t>(LatencyStage::Count); ++i) {
+        const auto stage = static_cast<LatencyStage>(i);
+        if (const auto summary = tracer->summary(stage); summary.count > 0) {
+            printLatency(latencyStageName(stage), summary);
+        }
+    }
+    std::printf("\n%s", engine_.counterReport().c_str());
+}
+
+void usage(const char *program) {
+    std::fprintf(stderr,
+                 "usage: %s [--mock] [--mock-latency-ms N] [--speed X] [--settle-ms N] "
+                 "trace.tsv\n",
+                 program);
+}
+
+} // namespace
+} // namespace aetherime
+
+// Replays a recorded typing session through the engine against a stub input
+// context, in real time, and reports per-keystroke latency, daemon traffic
+// and how often the ghost text matched what was typed next. With --mock an
+// in-process mock daemon answers; otherwise AETHERIME_SOCKET is used.
+int main(int argc, char **argv) {
+    using namespace aetherime;
+
+    bool mock = false;
+    uint64_t mockLatencyMs = 0;
+    double speed = 1.0;
+    uint64_t settleMs = 500;
+    int arg = 1;
+    for (; arg < argc && std::string_view(argv[arg]).substr(0, 2) == "--"; ++arg) {
+        const std::string_view option = argv[arg];
+        const bool hasValue = arg + 1 < argc;
+        if (option == "--mock") {
+            mock = true;
+        } else if (option == "--mock-latency-ms" && hasValue &&
+                   parseNumber(argv[arg + 1], mockLatencyMs)) {
+            ++arg;
+        } else if (option == "--settle-ms" && hasValue && parseNumber(argv[arg + 1], settleMs)) {
+            ++arg;
+        } else if (option == "--speed" && hasValue && (speed = std::atof(argv[arg + 1])) > 0) {
+            ++arg;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - arg != 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    const auto events = loadTrace(argv[arg]);
+    if (!events) {
+        return 1;
+    }
+
+    std::unique_ptr<bench::MockDaemon> daemon;
+    if (mock) {
+        bench::MockDaemonOptions options;
+        options.latency = std::chrono::milliseconds(mockLatencyMs);
+        daemon = std::make_unique<bench::MockDaemon>(options);
+        if (daemon->socketPath().empty()) {
+            std::fprintf(stderr, "cannot start mock daemon\n");
+            return 1;
+        }
+        setenv("AETHERIME_SOCKET", daemon->socketPath().c_str(), 1);
+    }
+
+    char *instanceArgv[] = {argv[0], nullptr};
+    fcitx::Instance instance(1, instanceArgv);
+    AetherImeEngine engine(&instance);
+    Replay replay(instance, engine);
+
+    // Events are played from one timer so that daemon replies and trigger
+    // delays run on the event loop in between, as they would live.
+    auto &loop = instance.eventLoop();
+    const auto start = fcitx::now(CLOCK_MONOTONIC);
+    const auto at = [&](size_t index) {
+        return start + static_cast<uint64_t>(static_cast<double>((*events)[index].timeMs) *
+                                             1000.0 / speed);
+    };
+    size_t next = 0;
+    auto timer = loop.addTimeEvent(
+        CLOCK_MONOTONIC, events->empty() ? start : at(0), 0,
+        [&](fcitx::EventSourceTime *source, uint64_t) {
+            if (next == events->size()) {
+                loop.exit();
+                return true;
+            }
+            replay.apply((*events)[next++]);
+            source->setTime(next < events->size() ? at(next)
+                                                  : fcitx::now(CLOCK_MONOTONIC) + settleMs * 1000);
+            source->setOneShot();
+            return true;
+        });
+    loop.exec();
+
+    std::printf("trace %s: %zu events, %.1f s\n", argv[arg], events->size(),
+                static_cast<double>(fcitx::now(CLOCK_MONOTONIC) - start) / 1e6);
+    replay.report();
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <string>
+
+#include "bench.hpp"
+#include "text_scan.hpp"
+
+namespace aetherime {
+namespace {
+
+// About 4 KiB of surrounding text as the window sees it: mostly CJK with
+// some ASCII, punctuation and the occasional character JSON must escape.
+const std::string kMixedText = [] {
+    std::string text;
+    while (text.size() < 4096) {
+        text += "我们下午三点在会议室 B 继续讨论这个方案，然后再决定 next steps。";
+        text += "The draft is in \"docs/plan.md\" for review.\n";
+    }
+    return text;
+}();
+
+const std::string kAsciiText = [] {
+    std::string text;
+    while (text.size() < 4096) {
+        text += "The quick brown fox jumps over the lazy dog; ";
+    }
+    return text;
+}();
+
+// Registers one case per operation for each implementation the CPU supports,
+// so the scalar fallback can be compared against the dispatched kernels.
+void registerKernel(const char *name) {
+    const TextScanKernels *kernels = textScanKernels(name);
+    if (!kernels) {
+        return;
+    }
+    const std::string prefix = std::string("scan/") + name + " ";
+    const std::string text = kMixedText;
+    bench::Registrar(prefix + "validate mixed_4k", [kernels, text](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            bench::doNotOptimize(kernels->validateUtf8(text.data(), text.size()));
+        }
+    });
+    bench::Registrar(prefix + "validate ascii_4k", [kernels](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            bench::doNotOptimize(kernels->validateUtf8(kAsciiText.data(), kAsciiText.size()));
+        }
+    });
+    bench::Registrar(prefix + "count mixed_4k", [kernels, text](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            bench::doNotOptimize(kernels->countCodePoints(text.data(), text.size()));
+        }
+    });
+    bench::Registrar(prefix + "offset mixed_4k", [kernels, text](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            bench::doNotOptimize(kernels->codePointOffset(text.data(), text.size(), 1500));
+        }
+    });
+    bench::Registrar(prefix + "json_escape mixed_4k", [kernels, text](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            size_t escapes = 0;
+            for (size_t pos = kernels->findJsonEscape(text.data(), text.size()); pos < text.size();
+                 pos += 1 + kernels->findJsonEscape(text.data() + pos + 1, text.size() - pos - 1)) {
+                ++escapes;
+            }
+            bench::doNotOptimize(escapes);
+        }
+    });
+}
+
+const bool kRegistered = [] {
+    registerKernel("scalar");
+    registerKernel("sse4.2");
+    registerKernel("avx2");
+    return true;
+}();
+
+} // namespace
+} // namespace aetherime
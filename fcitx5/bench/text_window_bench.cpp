@@ -0,0 +1,67 @@
+#include <string>
+
+#include "bench.hpp"
+#include "text_window.hpp"
+
+namespace aetherime {
+namespace {
+
+// What buildPredictContext() does per keystroke: the app reports the whole
+// document again with one more character typed at the cursor.
+struct Edit {
+    std::string before;
+    std::string after;
+    size_t cursorChars;
+};
+
+Edit makeEdit(size_t paragraphs) {
+    std::string text;
+    for (size_t i = 0; i < paragraphs; ++i) {
+        text += "我们下午三点在会议室 B 继续讨论这个方案，然后再决定 next steps。\n";
+    }
+    // Cursor in the middle, on a paragraph boundary.
+    const size_t cursorByte = text.size() / 2 - (text.size() / 2) % (text.size() / paragraphs);
+    size_t cursorChars = 0;
+    for (size_t i = 0; i < cursorByte; ++i) {
+        cursorChars += (static_cast<unsigned char>(text[i]) & 0xC0) != 0x80;
+    }
+    Edit edit{text, text, cursorChars};
+    edit.after.insert(cursorByte, "好");
+    return edit;
+}
+
+const Edit kSmallEdit = makeEdit(48);   // about 4 KiB
+const Edit kLargeEdit = makeEdit(2400); // about 200 KiB
+
+void typeAndErase(const Edit &edit, uint64_t iterations) {
+    SurroundingWindow window(256, 128);
+    window.update(edit.before, edit.cursorChars);
+    for (uint64_t i = 0; i < iterations; ++i) {
+        if (i % 2 == 0) {
+            window.update(edit.after, edit.cursorChars + 1);
+        } else {
+            window.update(edit.before, edit.cursorChars);
+        }
+        bench::doNotOptimize(window.before());
+    }
+}
+
+void rescan(const Edit &edit, uint64_t iterations) {
+    SurroundingWindow window(256, 128);
+    for (uint64_t i = 0; i < iterations; ++i) {
+        window.reset();
+        window.update(edit.after, edit.cursorChars + 1);
+        bench::doNotOptimize(window.before());
+    }
+}
+
+AETHERIME_BENCHMARK("window/update 4k", iterations) { typeAndErase(kSmallEdit, iterations); }
+
+AETHERIME_BENCHMARK("window/update 200k", iterations) { typeAndErase(kLargeEdit, iterations); }
+
+AETHERIME_BENCHMARK("window/rescan 4k", iterations) { rescan(kSmallEdit, iterations); }
+
+AETHERIME_BENCHMARK("window/rescan 200k", iterations) { rescan(kLargeEdit, iterations); }
+
+} // namespace
+} // namespace aetherime
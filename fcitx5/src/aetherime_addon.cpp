@@ -1,18 +1,21 @@
 #include <algorithm>
 #include <array>
 #include <cctype>
+#include <cstdio>
 #include <cstdlib>
 #include <memory>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include <fcitx-config/configuration.h>
+#include <fcitx-config/iniparser.h>
+#include <fcitx-config/option.h>
+#include <fcitx-utils/i18n.h>
 #include <fcitx-utils/inputbuffer.h>
 #include <fcitx-utils/log.h>
-#include <fcitx-utils/utf8.h>
-#include <fcitx/addonfactory.h>
-#include <fcitx/addonmanager.h>
+#include <fcitx-utils/standardpath.h>
 #include <fcitx/candidatelist.h>
 #include <fcitx/inputcontext.h>
 #include <fcitx/inputcontextproperty.h>
@@ -20,15 +23,16 @@
 #include <fcitx/inputpanel.h>
 #include <fcitx/instance.h>
 
+#include "aetherime_engine.hpp"
 #include "ghost_session.hpp"
-#include "libime_backend.hpp"
+#include "text_window.hpp"
 
 namespace aetherime {
 
-class AetherImeEngine;
-
 namespace {
 
+constexpr char kConfigPath[] = "conf/aetherime.conf";
+
 const std::array<fcitx::Key, 10> kSelectionKeys = {
     fcitx::Key{FcitxKey_1}, fcitx::Key{FcitxKey_2}, fcitx::Key{FcitxKey_3},
     fcitx::Key{FcitxKey_4}, fcitx::Key{FcitxKey_5}, fcitx::Key{FcitxKey_6},
@@ -36,12 +40,8 @@ const std::array<fcitx::Key, 10> kSelectionKeys = {
     fcitx::Key{FcitxKey_0},
 };
 
-fcitx::KeyList makeSelectionKeyList() {
-    fcitx::KeyList list;
-    list.reserve(kSelectionKeys.size());
-    for (const auto &key : kSelectionKeys) {
-        list.emplace_back(key);
-    }
+const fcitx::KeyList &selectionKeyList() {
+    static const fcitx::KeyList list(kSelectionKeys.begin(), kSelectionKeys.end());
     return list;
 }
 
@@ -51,6 +51,30 @@ std::string toLowerAscii(std::string value) {
     return value;
 }
 
+// Completions follow the capitalization of what was typed: "Hel" offers
+// "Hello" and "HEL" offers "HELLO".
+std::string matchTypedCase(std::string_view typed, std::string_view word) {
+    std::string result(word);
+    if (typed.empty() || !std::isupper(static_cast<unsigned char>(typed.front()))) {
+        return result;
+    }
+    const bool allUpper =
+        typed.size() > 1 && std::none_of(typed.begin(), typed.end(), [](unsigned char c) {
+            return std::islower(c);
+        });
+    for (auto &c : result) {
+        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        if (!allUpper) {
+            break;
+        }
+    }
+    return result;
+}
+
+bool isEnglishWordKey(const fcitx::Key &key, bool composing) {
+    return key.isLAZ() || key.isUAZ() || (composing && key.check(FcitxKey_apostrophe));
+}
+
 void appendUnique(std::vector<std::string> &output, const std::vector<std::string> &input,
                   size_t limit) {
     for (const auto &entry : input) {
@@ -67,29 +91,48 @@ void appendUnique(std::vector<std::string> &output, const std::vector<std::strin
     }
 }
 
-const std::unordered_map<std::string, std::vector<std::string>> &fallbackZhLexicon() {
-    static const auto lexicon = std::unordered_map<std::string, std::vector<std::string>>{
-        {"ni", {"你", "呢", "泥"}},
-        {"nihao", {"你好", "你好吗", "你好呀"}},
-        {"wo", {"我", "握", "窝"}},
-        {"women", {"我们", "我们先", "我们可以"}},
-        {"jintian", {"今天", "今天的", "今天我们"}},
-        {"xiexie", {"谢谢", "谢谢你", "谢谢大家"}},
-        {"qingwen", {"请问", "请问一下", "请问现在方便吗"}},
-        {"woxiang", {"我想", "我想要", "我想先"}},
-        {"ceshi", {"测试", "测试一下", "测试完成"}},
-    };
-    return lexicon;
+constexpr size_t kLexicalCandidateLimit = 5;
+constexpr size_t kContextBeforeChars = 256;
+constexpr size_t kContextAfterChars = 128;
+// Predictions sent to the daemon at once across all input contexts; enough
+// for the focused context's ghost and its prefetch.
+constexpr size_t kMaxDaemonRequests = 2;
+
+// Latency stats go to the per-user runtime directory unless overridden; a
+// shared directory such as /tmp is never picked by default, so without one
+// there is no stats file.
+std::string statsFilePath() {
+    if (const char *value = std::getenv("AETHERIME_STATS_FILE"); value && *value) {
+        return value;
+    }
+    const char *runtimeDir = std::getenv("XDG_RUNTIME_DIR");
+    if (!runtimeDir || !*runtimeDir) {
+        return {};
+    }
+    return std::string(runtimeDir) + "/aetherime-latency.txt";
 }
 
-const std::unordered_map<std::string, std::vector<std::string>> &enLexicon() {
-    static const auto lexicon = std::unordered_map<std::string, std::vector<std::string>>{
-        {"hello", {"hello", "hello there", "hello team"}},
-        {"please", {"please", "please review", "please help"}},
-        {"thanks", {"thanks", "thanks a lot", "thanks for your help"}},
-        {"build", {"build", "build this", "build the feature"}},
-        {"need", {"need", "need to", "need your help"}},
-    };
+// Fallback lexicons are looked up in the package data directory unless an
+// environment override points at another file.
+std::unique_ptr<MappedLexicon> openLexicon(const char *envName, const std::string &fileName) {
+    std::string path;
+    if (const char *value = std::getenv(envName); value && *value) {
+        path = value;
+    } else {
+        path = fcitx::StandardPath::global().locate(fcitx::StandardPath::Type::PkgData,
+                                                    "aetherime/" + fileName);
+    }
+    if (path.empty()) {
+        FCITX_WARN() << "AetherIME fallback lexicon not found: " << fileName;
+        return nullptr;
+    }
+    auto lexicon = MappedLexicon::open(path);
+    if (!lexicon) {
+        FCITX_WARN() << "AetherIME failed to map lexicon: " << path;
+        return nullptr;
+    }
+    FCITX_INFO() << "AetherIME mapped " << lexicon->entryCount() << " lexicon entries from "
+                 << path;
     return lexicon;
 }
 
@@ -108,63 +151,73 @@ private:
     std::string text_;
 };
 
-class AetherImeEngine final : public fcitx::InputMethodEngineV2 {
-public:
-    explicit AetherImeEngine(fcitx::Instance *instance);
-
-    void keyEvent(const fcitx::InputMethodEntry &entry, fcitx::KeyEvent &keyEvent) override;
-    void reset(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) override;
-
-    std::string subModeLabelImpl(const fcitx::InputMethodEntry &entry,
-                                 fcitx::InputContext &ic) override;
-    std::string subModeIconImpl(const fcitx::InputMethodEntry &entry,
-                                fcitx::InputContext &ic) override;
-
-    auto factory() const { return &factory_; }
-    auto instance() const { return instance_; }
-    const std::string &socketPath() const { return socketPath_; }
-    const LibImeBackend &libimeBackend() const { return *libimeBackend_; }
-
-private:
-    fcitx::Instance *instance_;
-    std::string socketPath_;
-    std::shared_ptr<LibImeBackend> libimeBackend_;
-    fcitx::FactoryFor<AetherImeState> factory_;
-};
-
 class AetherImeState final : public fcitx::InputContextProperty {
 public:
     AetherImeState(AetherImeEngine *engine, fcitx::InputContext *ic)
         : engine_(engine),
           ic_(ic),
-          ghostSession_(DaemonClient(engine->socketPath())),
+          ghostSession_(engine->dispatcher(), &engine->instance()->eventLoop()),
+          pinyinSession_(engine->libimeBackend()),
+          englishCompleter_(engine->lexicon(true)),
           buffer_({fcitx::InputBufferOption::AsciiOnly, fcitx::InputBufferOption::FixedCursor}) {}
 
     void keyEvent(fcitx::KeyEvent &event);
+    void activate();
     void reset();
     void onEngineReset();
     void commitCandidateText(const std::string &text);
 
     bool englishMode() const { return englishMode_; }
+    GhostStats ghostStats() const { return ghostSession_.stats(); }
+    const TextWindowStats &windowStats() const { return surroundingWindow_.stats(); }
 
 private:
     void toggleEnglishMode();
     void togglePredict();
     void updatePrediction(const std::string &contextTail = {});
+    void configureGhostSession();
+    void onGhostUpdated();
+    void syncGhost();
     void updateUI();
-    std::vector<std::string> lexicalCandidates() const;
-    std::pair<std::string, std::string> buildPredictContext(const std::string &predictBase) const;
-    void commitAndRefresh(const std::string &text);
+    void invalidateUI();
+    std::vector<std::string> lexicalCandidates();
+    std::string highlightedCandidate() const;
+    std::pair<std::string, std::string> buildPredictContext(const std::string &predictBase);
+    // With keyPassesThrough the key that ended the word still reaches the
+    // application and changes the text after the commit, so no ghost is
+    // requested for it.
+    void commitAndRefresh(const std::string &text, bool keyPassesThrough = false);
 
     AetherImeEngine *engine_;
     fcitx::InputContext *ic_;
     GhostSession ghostSession_;
+    PinyinSession pinyinSession_;
+    PrefixCompleter englishCompleter_;
+    SurroundingWindow surroundingWindow_{kContextBeforeChars, kContextAfterChars};
     fcitx::InputBuffer buffer_;
     bool englishMode_ = false;
     bool predictEnabled_ = true;
     std::string ghostText_;
     std::string predictionSource_;
     std::vector<std::string> mergedCandidates_;
+
+    enum class PinyinStatus { None, LibIme, Loading, Fallback };
+
+    // What the last updateUI() pushed, so unchanged components are skipped.
+    struct RenderedUI {
+        bool valid = false;
+        bool active = false;
+        bool clientPreedit = false;
+        std::string input;
+        std::string ghost;
+        std::vector<std::string> candidates;
+        const fcitx::CandidateList *candidateList = nullptr;
+        bool englishMode = false;
+        bool predictEnabled = false;
+        PinyinStatus pinyinStatus = PinyinStatus::None;
+        std::string source;
+    };
+    RenderedUI rendered_;
 };
 
 AetherImeCandidateWord::AetherImeCandidateWord(AetherImeState *state, std::string text)
@@ -186,21 +239,135 @@ AetherImeEngine::AetherImeEngine(fcitx::Instance *instance)
           }
           return std::string("/tmp/aetherime.sock");
       }()),
-      libimeBackend_(std::make_shared<LibImeBackend>()),
+      statsPath_(statsFilePath()),
+      libimeBackend_(std::make_shared<LibImeBackend>(&instance_->eventLoop())),
+      dispatcher_(std::make_unique<PredictionDispatcher>(socketPath_, &instance_->eventLoop(),
+                                                         &latencyTracer_, kMaxDaemonRequests)),
+      zhLexicon_(openLexicon("AETHERIME_LEXICON_ZH", "zh.lex")),
+      enLexicon_(openLexicon("AETHERIME_LEXICON_EN", "en.lex")),
       factory_([this](fcitx::InputContext &ic) { return new AetherImeState(this, &ic); }) {
     instance_->inputContextManager().registerProperty("aetherimeState", &factory_);
+    reloadConfig();
     FCITX_INFO() << "AetherIME pinyin backend status: " << libimeBackend_->status();
 }
 
+AetherImeEngine::~AetherImeEngine() = default;
+
+void AetherImeEngine::setConfig(const fcitx::RawConfig &config) {
+    config_.load(config, true);
+    fcitx::safeSaveAsIni(config_, kConfigPath);
+    applyConfig();
+}
+
+void AetherImeEngine::reloadConfig() {
+    fcitx::readAsIni(config_, kConfigPath);
+    applyConfig();
+}
+
+// The transport choice applies from the next connection on.
+void AetherImeEngine::applyConfig() {
+    dispatcher_->client().setSharedMemory(*config_.sharedMemoryTransport);
+    updateStatsTimer();
+}
+
+void AetherImeEngine::updateStatsTimer() {
+    const auto intervalSec = *config_.statsIntervalSec;
+    if (intervalSec <= 0 || statsPath_.empty()) {
+        statsEvent_.reset();
+        return;
+    }
+    const uint64_t intervalUs = static_cast<uint64_t>(intervalSec) * 1000000;
+    statsEvent_ = instance_->eventLoop().addTimeEvent(
+        CLOCK_MONOTONIC, fcitx::now(CLOCK_MONOTONIC) + intervalUs, 0,
+        [this, intervalUs](fcitx::EventSourceTime *source, uint64_t) {
+            if (!latencyTracer_.writeReport(statsPath_, counterReport())) {
+                FCITX_WARN() << "AetherIME failed to write latency stats: " << statsPath_;
+            }
+            source->setNextInterval(intervalUs);
+            source->setOneShot();
+            return true;
+        });
+}
+
+std::string AetherImeEngine::counterReport() {
+    GhostStats ghost;
+    TextWindowStats window;
+    std::string budgets;
+    instance_->inputContextManager().foreach([&](fcitx::InputContext *ic) {
+        const auto *state = ic->propertyFor(&factory_);
+        window.rescans += state->windowStats().rescans;
+        window.incrementalUpdates += state->windowStats().incrementalUpdates;
+        const auto stats = state->ghostStats();
+        const auto &budget = stats.budget;
+        if (budget.keyIntervalMs > 0 || budget.replies + budget.timeouts > 0) {
+            char line[256];
+            std::snprintf(line, sizeof(line), "budget %s %d %d %.1f %.1f %d %llu %llu\n",
+                          ic->program().empty() ? "-" : ic->program().c_str(),
+                          budget.decision.maxTokens, budget.decision.latencyBudgetMs,
+                          budget.keyIntervalMs, budget.msPerToken, budget.paused ? 1 : 0,
+                          static_cast<unsigned long long>(budget.replies),
+                          static_cast<unsigned long long>(budget.timeouts));
+            budgets += line;
+        }
+        ghost.cacheHits += stats.cacheHits;
+        ghost.cacheMisses += stats.cacheMisses;
+        ghost.typeThroughs += stats.typeThroughs;
+        ghost.prefetches += stats.prefetches;
+        ghost.prefetchHits += stats.prefetchHits;
+        ghost.cacheSize += stats.cacheSize;
+        return true;
+    });
+
+    std::string out = "# counter value\n";
+    const auto add = [&out](const char *name, uint64_t value) {
+        out += name;
+        out += ' ';
+        out += std::to_string(value);
+        out += '\n';
+    };
+    add("ghost_cache_hits", ghost.cacheHits);
+    add("ghost_cache_misses", ghost.cacheMisses);
+    add("ghost_cache_entries", ghost.cacheSize);
+    add("ghost_type_throughs", ghost.typeThroughs);
+    add("ghost_prefetches", ghost.prefetches);
+    add("ghost_prefetch_hits", ghost.prefetchHits);
+    const auto candidates = libimeBackend_->candidateCacheStats();
+    add("pinyin_cache_hits", candidates.hits);
+    add("pinyin_cache_misses", candidates.misses);
+    add("pinyin_cache_entries", candidates.size);
+    add("surrounding_rescans", window.rescans);
+    add("surrounding_incremental_updates", window.incrementalUpdates);
+    const auto dispatch = dispatcher_->stats();
+    add("dispatch_submitted", dispatch.submitted);
+    add("dispatch_superseded", dispatch.superseded);
+    add("dispatch_dropped", dispatch.dropped);
+    add("dispatch_queued", dispatch.queued);
+    add("dispatch_in_flight", dispatch.inFlight);
+    if (!budgets.empty()) {
+        out += "# budget program max_tokens latency_budget_ms key_interval_ms ms_per_token paused "
+               "replies timeouts\n";
+        out += budgets;
+    }
+    return out;
+}
+
 void AetherImeEngine::keyEvent(const fcitx::InputMethodEntry &entry, fcitx::KeyEvent &keyEvent) {
     FCITX_UNUSED(entry);
     if (keyEvent.isRelease()) {
         return;
     }
+    LatencySpan span(&latencyTracer_, LatencyStage::KeyEvent);
     auto *state = keyEvent.inputContext()->propertyFor(&factory_);
     state->keyEvent(keyEvent);
 }
 
+void AetherImeEngine::activate(const fcitx::InputMethodEntry &entry,
+                               fcitx::InputContextEvent &event) {
+    FCITX_UNUSED(entry);
+    auto *state = event.inputContext()->propertyFor(&factory_);
+    state->activate();
+}
+
 void AetherImeEngine::reset(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) {
     FCITX_UNUSED(entry);
     auto *state = event.inputContext()->propertyFor(&factory_);
@@ -225,6 +392,10 @@ std::string AetherImeEngine::subModeIconImpl(const fcitx::InputMethodEntry &entr
 }
 
 void AetherImeState::keyEvent(fcitx::KeyEvent &event) {
+    if (!event.key().isModifier()) {
+        ghostSession_.noteKeystroke();
+    }
+
     if (event.key().check(FcitxKey_semicolon, fcitx::KeyState::Ctrl)) {
         togglePredict();
         event.filterAndAccept();
@@ -238,7 +409,9 @@ void AetherImeState::keyEvent(fcitx::KeyEvent &event) {
     }
 
     if (auto candidateList = ic_->inputPanel().candidateList()) {
-        const int selectionIndex = event.key().keyListIndex(kSelectionKeys);
+        // In English mode digits end the word and are typed, so they never
+        // select.
+        const int selectionIndex = englishMode_ ? -1 : event.key().keyListIndex(kSelectionKeys);
         if (selectionIndex >= 0 && selectionIndex < candidateList->size()) {
             candidateList->candidate(selectionIndex).select(ic_);
             event.filterAndAccept();
@@ -291,7 +464,7 @@ void AetherImeState::keyEvent(fcitx::KeyEvent &event) {
             return;
         }
         if (!buffer_.empty()) {
-            commitAndRefresh(buffer_.userInput());
+            commitAndRefresh(englishMode_ ? highlightedCandidate() : buffer_.userInput());
             event.filterAndAccept();
         }
         return;
@@ -316,13 +489,24 @@ void AetherImeState::keyEvent(fcitx::KeyEvent &event) {
 
     if (event.key().check(FcitxKey_Return)) {
         if (!buffer_.empty()) {
-            commitAndRefresh(buffer_.userInput());
-            event.filterAndAccept();
+            // The word is done; the newline or send still belongs to the app.
+            commitAndRefresh(buffer_.userInput(), englishMode_);
+            if (!englishMode_) {
+                event.filterAndAccept();
+            }
         }
         return;
     }
 
     if (event.key().check(FcitxKey_space)) {
+        if (englishMode_) {
+            // Words are committed as typed; completions are picked explicitly.
+            if (!buffer_.empty()) {
+                commitAndRefresh(buffer_.userInput() + " ");
+                event.filterAndAccept();
+            }
+            return;
+        }
         if (!buffer_.empty() && !mergedCandidates_.empty()) {
             commitCandidateText(mergedCandidates_.front());
             event.filterAndAccept();
@@ -336,11 +520,14 @@ void AetherImeState::keyEvent(fcitx::KeyEvent &event) {
         return;
     }
 
-    if (englishMode_ && buffer_.empty()) {
+    auto normalized = event.key().normalize();
+    if (englishMode_ && !isEnglishWordKey(normalized, !buffer_.empty())) {
+        // Anything that cannot continue a word ends it and reaches the app.
+        if (!buffer_.empty()) {
+            commitAndRefresh(buffer_.userInput(), true);
+        }
         return;
     }
-
-    auto normalized = event.key().normalize();
     if (!normalized.isSimple()) {
         if (!buffer_.empty()) {
             event.filterAndAccept();
@@ -355,8 +542,11 @@ void AetherImeState::keyEvent(fcitx::KeyEvent &event) {
     }
 }
 
+void AetherImeState::activate() { ghostSession_.focus(); }
+
 void AetherImeState::reset() {
     buffer_.clear();
+    pinyinSession_.reset();
     ghostSession_.clearGhost();
     ghostText_.clear();
     predictionSource_.clear();
@@ -366,6 +556,7 @@ void AetherImeState::reset() {
 
 void AetherImeState::onEngineReset() {
     buffer_.clear();
+    pinyinSession_.reset();
     mergedCandidates_.clear();
     updateUI();
 }
@@ -374,17 +565,23 @@ void AetherImeState::commitCandidateText(const std::string &text) {
     commitAndRefresh(text);
 }
 
-void AetherImeState::commitAndRefresh(const std::string &text) {
+void AetherImeState::commitAndRefresh(const std::string &text, bool keyPassesThrough) {
     if (text.empty()) {
         return;
     }
     ic_->commitString(text);
     buffer_.clear();
+    pinyinSession_.reset();
     mergedCandidates_.clear();
-    predictionSource_.clear();
-    ghostText_.clear();
-    ghostSession_.clearGhost();
-    updatePrediction(text);
+    if (keyPassesThrough) {
+        ghostSession_.clearGhost();
+        ghostText_.clear();
+        predictionSource_.clear();
+    } else if (predictEnabled_ && ghostSession_.consumeTyped(text)) {
+        syncGhost();
+    } else {
+        updatePrediction(text);
+    }
     updateUI();
 }
 
@@ -399,55 +596,91 @@ void AetherImeState::togglePredict() {
     updateUI();
 }
 
-std::vector<std::string> AetherImeState::lexicalCandidates() const {
+// The completion under the panel cursor, else the top one, else the word as
+// typed.
+std::string AetherImeState::highlightedCandidate() const {
+    const auto &candidateList = ic_->inputPanel().candidateList();
+    if (candidateList && candidateList->cursorIndex() >= 0 &&
+        candidateList->cursorIndex() < candidateList->size()) {
+        return candidateList->candidate(candidateList->cursorIndex()).text().toString();
+    }
+    return mergedCandidates_.empty() ? buffer_.userInput() : mergedCandidates_.front();
+}
+
+std::vector<std::string> AetherImeState::lexicalCandidates() {
+    LatencySpan span(engine_->latencyTracer(), LatencyStage::LexicalCandidates);
     const auto code = toLowerAscii(buffer_.userInput());
     if (code.empty()) {
         return {};
     }
 
     if (!englishMode_) {
-        const auto libimeCandidates = engine_->libimeBackend().query(code, 5);
+        const auto libimeCandidates = [&] {
+            LatencySpan querySpan(engine_->latencyTracer(), LatencyStage::PinyinQuery);
+            return pinyinSession_.query(code, kLexicalCandidateLimit);
+        }();
         if (!libimeCandidates.empty()) {
             return libimeCandidates;
         }
     }
 
-    const auto &table = englishMode_ ? enLexicon() : fallbackZhLexicon();
-    auto iterator = table.find(code);
-    if (iterator == table.end()) {
+    if (englishMode_) {
+        const auto typed = buffer_.userInput();
+        std::vector<std::string> candidates;
+        for (const auto &match : englishCompleter_.complete(code)) {
+            if (candidates.size() >= kLexicalCandidateLimit) {
+                break;
+            }
+            candidates.push_back(matchTypedCase(typed, match.text));
+        }
+        return candidates;
+    }
+
+    const auto *lexicon = engine_->lexicon(false);
+    if (!lexicon) {
         return {};
     }
-    return iterator->second;
+    std::array<LexiconCandidate, kLexicalCandidateLimit> found;
+    auto count = lexicon->exact(code, found.data(), found.size());
+    if (count < found.size()) {
+        // Pinyin abbreviations still produce words: "nih" offers 你好.
+        std::array<LexiconCandidate, kLexicalCandidateLimit> completions;
+        const auto completed = lexicon->complete(code, completions.data(), completions.size());
+        for (size_t i = 0; i < completed && count < found.size(); ++i) {
+            const auto duplicate =
+                std::find_if(found.begin(), found.begin() + count, [&](const auto &candidate) {
+                    return candidate.text == completions[i].text;
+                });
+            if (duplicate == found.begin() + count) {
+                found[count++] = completions[i];
+            }
+        }
+    }
+
+    std::vector<std::string> candidates;
+    candidates.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        candidates.emplace_back(found[i].text);
+    }
+    return candidates;
 }
 
 std::pair<std::string, std::string> AetherImeState::buildPredictContext(
-    const std::string &predictBase) const {
+    const std::string &predictBase) {
+    LatencySpan span(engine_->latencyTracer(), LatencyStage::PredictContext);
     std::string prefix = predictBase;
     std::string suffix;
 
     const auto &surrounding = ic_->surroundingText();
-    if (!surrounding.isValid()) {
-        return {prefix, suffix};
-    }
-    const auto &text = surrounding.text();
-    if (!fcitx::utf8::validate(text)) {
+    if (!surrounding.isValid() || surrounding.text().empty()) {
         return {prefix, suffix};
     }
-    if (text.empty()) {
+    if (!surroundingWindow_.update(surrounding.text(), surrounding.cursor())) {
         return {prefix, suffix};
     }
 
-    const auto totalChars = fcitx::utf8::length(text);
-    const auto cursorChars = std::min<size_t>(surrounding.cursor(), totalChars);
-    const auto beforeChars = std::min<size_t>(256, cursorChars);
-    const auto afterChars = std::min<size_t>(128, totalChars - cursorChars);
-
-    const auto startByte = fcitx::utf8::ncharByteLength(text.begin(), cursorChars - beforeChars);
-    const auto cursorByte = fcitx::utf8::ncharByteLength(text.begin(), cursorChars);
-    const auto endByte = fcitx::utf8::ncharByteLength(text.begin(), cursorChars + afterChars);
-
-    prefix = text.substr(startByte, cursorByte - startByte) + prefix;
-    suffix = text.substr(cursorByte, endByte - cursorByte);
+    prefix.insert(0, surroundingWindow_.before());
+    suffix = surroundingWindow_.after();
     return {prefix, suffix};
 }
 
@@ -456,93 +689,195 @@ void AetherImeState::updatePrediction(const std::string &contextTail) {
     predictionSource_.clear();
     ghostText_.clear();
 
+    // While composing, the session keeps its ghost hidden so that committing
+    // text which matches it can be typed through. Space commits the top
+    // pinyin candidate, so the ghost that would follow it is fetched ahead.
     if (!buffer_.empty()) {
         const auto lexical = lexicalCandidates();
-        appendUnique(mergedCandidates_, lexical, 5);
+        appendUnique(mergedCandidates_, lexical, kLexicalCandidateLimit);
+        if (predictEnabled_ && !englishMode_ && !mergedCandidates_.empty()) {
+            auto [prefix, suffix] = buildPredictContext(mergedCandidates_.front());
+            configureGhostSession();
+            ghostSession_.prefetch(prefix, suffix);
+        }
         return;
     }
 
     if (!predictEnabled_) {
+        ghostSession_.clearGhost();
         return;
     }
 
     auto [prefix, suffix] = buildPredictContext(contextTail);
     if (prefix.empty() && suffix.empty()) {
+        ghostSession_.clearGhost();
         return;
     }
 
+    configureGhostSession();
+    LatencySpan span(engine_->latencyTracer(), LatencyStage::GhostTrigger);
+    if (ghostSession_.onTextChanged(prefix, suffix, [this]() { onGhostUpdated(); })) {
+        syncGhost();
+    }
+}
+
+void AetherImeState::configureGhostSession() {
     ghostSession_.setLanguage(englishMode_ ? Language::En : Language::Zh);
     ghostSession_.setMode(PredictMode::Fim);
-    ghostText_ = ghostSession_.onTextChanged(prefix, suffix);
+    ghostSession_.setTriggerDelay(*engine_->config().triggerDelayMs);
+    ghostSession_.setCacheCapacity(*engine_->config().predictionCacheSize);
+    ghostSession_.setStreaming(*engine_->config().streamGhost);
+}
 
+void AetherImeState::onGhostUpdated() {
+    if (!buffer_.empty() || !predictEnabled_) {
+        return;
+    }
+    syncGhost();
+    updateUI();
+}
+
+void AetherImeState::syncGhost() {
+    ghostText_ = ghostSession_.ghost();
+    predictionSource_.clear();
     if (const auto &prediction = ghostSession_.lastPrediction(); prediction) {
         predictionSource_ = prediction->source;
     }
 }
 
+void AetherImeState::invalidateUI() { rendered_ = RenderedUI{}; }
+
 void AetherImeState::updateUI() {
+    LatencySpan span(engine_->latencyTracer(), LatencyStage::UpdateUI);
     auto &inputPanel = ic_->inputPanel();
     const bool active = !buffer_.empty() || !ghostText_.empty() || !mergedCandidates_.empty();
-    inputPanel.reset();
+    const bool clientPreedit = ic_->capabilityFlags().test(fcitx::CapabilityFlag::Preedit);
+
+    // Anything else that reset the panel (focus changes, other engines)
+    // leaves it empty or without our candidate list; start over then.
+    if (rendered_.active &&
+        (inputPanel.empty() || inputPanel.candidateList().get() != rendered_.candidateList)) {
+        invalidateUI();
+        rendered_.active = true;
+    }
+
     if (!active) {
-        if (ic_->capabilityFlags().test(fcitx::CapabilityFlag::Preedit)) {
-            inputPanel.setClientPreedit(fcitx::Text());
-        } else {
-            inputPanel.setPreedit(fcitx::Text());
+        if (rendered_.active || !rendered_.valid) {
+            inputPanel.reset();
+            if (clientPreedit) {
+                inputPanel.setClientPreedit(fcitx::Text());
+            } else {
+                inputPanel.setPreedit(fcitx::Text());
+            }
+            ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
+            ic_->updatePreedit();
         }
-        ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
-        ic_->updatePreedit();
+        invalidateUI();
+        rendered_.valid = true;
         return;
     }
 
-    if (!mergedCandidates_.empty()) {
-        auto candidateList = std::make_unique<fcitx::CommonCandidateList>();
-        candidateList->setSelectionKey(makeSelectionKeyList());
-        candidateList->setPageSize(5);
-        for (const auto &candidate : mergedCandidates_) {
-            candidateList->append<AetherImeCandidateWord>(this, candidate);
-        }
-        inputPanel.setCandidateList(std::move(candidateList));
+    const bool fresh = !rendered_.valid || !rendered_.active;
+    bool panelChanged = fresh;
+    bool preeditChanged = fresh;
+    if (fresh) {
+        inputPanel.reset();
+        invalidateUI();
     }
 
-    fcitx::Text preedit;
-    if (!buffer_.empty()) {
-        preedit.append(buffer_.userInput(), fcitx::TextFormatFlag::HighLight);
-    }
-    if (!ghostText_.empty()) {
-        fcitx::TextFormatFlags ghostFlags;
-        ghostFlags |= fcitx::TextFormatFlag::Italic;
-        preedit.append(ghostText_, ghostFlags);
+    if (fresh || mergedCandidates_ != rendered_.candidates) {
+        std::unique_ptr<fcitx::CommonCandidateList> candidateList;
+        if (!mergedCandidates_.empty()) {
+            candidateList = std::make_unique<fcitx::CommonCandidateList>();
+            candidateList->setSelectionKey(englishMode_ ? fcitx::KeyList{} : selectionKeyList());
+            candidateList->setPageSize(5);
+            for (const auto &candidate : mergedCandidates_) {
+                candidateList->append<AetherImeCandidateWord>(this, candidate);
+            }
+        }
+        rendered_.candidateList = candidateList.get();
+        rendered_.candidates = mergedCandidates_;
+        inputPanel.setCandidateList(std::move(candidateList));
+        panelChanged = true;
     }
 
-    if (ic_->capabilityFlags().test(fcitx::CapabilityFlag::Preedit)) {
-        inputPanel.setClientPreedit(preedit);
-    } else {
-        inputPanel.setPreedit(preedit);
+    const auto &input = buffer_.userInput();
+    if (fresh || clientPreedit != rendered_.clientPreedit || input != rendered_.input ||
+        ghostText_ != rendered_.ghost) {
+        fcitx::Text preedit;
+        if (!buffer_.empty()) {
+            preedit.append(input, fcitx::TextFormatFlag::HighLight);
+        }
+        if (!ghostText_.empty()) {
+            fcitx::TextFormatFlags ghostFlags;
+            ghostFlags |= fcitx::TextFormatFlag::Italic;
+            preedit.append(ghostText_, ghostFlags);
+        }
+        if (clientPreedit) {
+            if (!rendered_.clientPreedit) {
+                inputPanel.setPreedit(fcitx::Text());
+                panelChanged = true;
+            }
+            inputPanel.setClientPreedit(preedit);
+            preeditChanged = true;
+        } else {
+            if (rendered_.clientPreedit) {
+                inputPanel.setClientPreedit(fcitx::Text());
+                preeditChanged = true;
+            }
+            inputPanel.setPreedit(preedit);
+            panelChanged = true;
+        }
+        rendered_.clientPreedit = clientPreedit;
+        rendered_.input = input;
+        rendered_.ghost = ghostText_;
     }
 
-    inputPanel.setAuxUp(fcitx::Text(englishMode_ ? "EN" : "中"));
-    std::string status = predictEnabled_ ? "AI:on" : "AI:off";
-    if (!predictionSource_.empty()) {
-        status += " " + predictionSource_;
-    }
+    auto pinyinStatus = PinyinStatus::None;
     if (engine_->libimeBackend().available()) {
-        status += " PY:libime";
+        pinyinStatus = PinyinStatus::LibIme;
+    } else if (engine_->libimeBackend().loading()) {
+        pinyinStatus = PinyinStatus::Loading;
     } else if (!englishMode_) {
-        status += " PY:fallback";
+        pinyinStatus = PinyinStatus::Fallback;
+    }
+    if (fresh || englishMode_ != rendered_.englishMode ||
+        predictEnabled_ != rendered_.predictEnabled || pinyinStatus != rendered_.pinyinStatus ||
+        predictionSource_ != rendered_.source) {
+        inputPanel.setAuxUp(fcitx::Text(englishMode_ ? "EN" : "中"));
+        std::string status = predictEnabled_ ? "AI:on" : "AI:off";
+        if (!predictionSource_.empty()) {
+            status += " " + predictionSource_;
+        }
+        switch (pinyinStatus) {
+        case PinyinStatus::LibIme:
+            status += " PY:libime";
+            break;
+        case PinyinStatus::Loading:
+            status += " PY:loading";
+            break;
+        case PinyinStatus::Fallback:
+            status += " PY:fallback";
+            break;
+        case PinyinStatus::None:
+            break;
+        }
+        inputPanel.setAuxDown(fcitx::Text(status));
+        rendered_.englishMode = englishMode_;
+        rendered_.predictEnabled = predictEnabled_;
+        rendered_.pinyinStatus = pinyinStatus;
+        rendered_.source = predictionSource_;
+        panelChanged = true;
     }
-    inputPanel.setAuxDown(fcitx::Text(status));
 
-    ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
-    ic_->updatePreedit();
-}
-
-class AetherImeFactory final : public fcitx::AddonFactory {
-    fcitx::AddonInstance *create(fcitx::AddonManager *manager) override {
-        return new AetherImeEngine(manager->instance());
+    rendered_.valid = true;
+    rendered_.active = true;
+    if (panelChanged) {
+        ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
     }
-};
+    if (preeditChanged) {
+        ic_->updatePreedit();
+    }
+}
 
 } // namespace aetherime
-
-FCITX_ADDON_FACTORY(aetherime::AetherImeFactory)
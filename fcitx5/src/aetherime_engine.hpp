@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <fcitx-config/configuration.h>
+#include <fcitx-config/option.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/i18n.h>
+#include <fcitx/inputcontextproperty.h>
+#include <fcitx/inputmethodengine.h>
+#include <fcitx/instance.h>
+
+#include "latency_trace.hpp"
+#include "lexicon.hpp"
+#include "libime_backend.hpp"
+#include "prediction_dispatcher.hpp"
+
+namespace aetherime {
+
+FCITX_CONFIGURATION(AetherImeConfig,
+                    fcitx::Option<int, fcitx::IntConstrain> triggerDelayMs{
+                        this, "TriggerDelayMs", _("Prediction trigger delay (ms)"), 35,
+                        fcitx::IntConstrain(0, 1000)};
+                    fcitx::Option<int, fcitx::IntConstrain> predictionCacheSize{
+                        this, "PredictionCacheSize", _("Cached predictions per input field"), 64,
+                        fcitx::IntConstrain(0, 4096)};
+                    fcitx::Option<bool> streamGhost{this, "StreamGhost",
+                                                    _("Show ghost text while it is generated"),
+                                                    true};
+                    fcitx::Option<bool> sharedMemoryTransport{
+                        this, "SharedMemoryTransport",
+                        _("Exchange requests with the daemon through shared memory"), true};
+                    fcitx::Option<int, fcitx::IntConstrain> statsIntervalSec{
+                        this, "StatsIntervalSec", _("Latency stats file interval (s, 0 = off)"),
+                        0, fcitx::IntConstrain(0, 3600)};);
+
+class AetherImeState;
+
+class AetherImeEngine final : public fcitx::InputMethodEngineV2 {
+public:
+    explicit AetherImeEngine(fcitx::Instance *instance);
+    ~AetherImeEngine() override;
+
+    void keyEvent(const fcitx::InputMethodEntry &entry, fcitx::KeyEvent &keyEvent) override;
+    void activate(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) override;
+    void reset(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) override;
+
+    std::string subModeLabelImpl(const fcitx::InputMethodEntry &entry,
+                                 fcitx::InputContext &ic) override;
+    std::string subModeIconImpl(const fcitx::InputMethodEntry &entry,
+                                fcitx::InputContext &ic) override;
+
+    const fcitx::Configuration *getConfig() const override { return &config_; }
+    void setConfig(const fcitx::RawConfig &config) override;
+    void reloadConfig() override;
+
+    const AetherImeConfig &config() const { return config_; }
+    auto factory() const { return &factory_; }
+    auto instance() const { return instance_; }
+    const std::string &socketPath() const { return socketPath_; }
+    LibImeBackend &libimeBackend() const { return *libimeBackend_; }
+    PredictionDispatcher &dispatcher() { return *dispatcher_; }
+    LatencyTracer *latencyTracer() { return &latencyTracer_; }
+    const MappedLexicon *lexicon(bool english) const {
+        return english ? enLexicon_.get() : zhLexicon_.get();
+    }
+    // Cache and scheduling counters, and the prediction budget of each input
+    // context that has typed or predicted, written after the latency report.
+    std::string counterReport();
+
+private:
+    void applyConfig();
+    void updateStatsTimer();
+
+    fcitx::Instance *instance_;
+    AetherImeConfig config_;
+    std::string socketPath_;
+    LatencyTracer latencyTracer_;
+    std::string statsPath_;
+    std::unique_ptr<fcitx::EventSourceTime> statsEvent_;
+    std::shared_ptr<LibImeBackend> libimeBackend_;
+    std::unique_ptr<PredictionDispatcher> dispatcher_;
+    std::unique_ptr<MappedLexicon> zhLexicon_;
+    std::unique_ptr<MappedLexicon> enLexicon_;
+    fcitx::FactoryFor<AetherImeState> factory_;
+};
+
+} // namespace aetherime
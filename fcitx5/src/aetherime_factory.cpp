@@ -0,0 +1,16 @@
+#include <fcitx/addonfactory.h>
+#include <fcitx/addonmanager.h>
+
+#include "aetherime_engine.hpp"
+
+namespace aetherime {
+
+class AetherImeFactory final : public fcitx::AddonFactory {
+    fcitx::AddonInstance *create(fcitx::AddonManager *manager) override {
+        return new AetherImeEngine(manager->instance());
+    }
+};
+
+} // namespace aetherime
+
+FCITX_ADDON_FACTORY(aetherime::AetherImeFactory)
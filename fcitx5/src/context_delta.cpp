@@ -0,0 +1,109 @@
+#include "context_delta.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace aetherime {
+namespace {
+
+// How far the start of the window may move between two requests and still
+// be found again, and how many of its bytes must match to count.
+constexpr size_t kMaxHeadShift = 256;
+constexpr size_t kAnchorBytes = 16;
+constexpr size_t kCompareBlock = 32;
+
+bool isContinuation(char c) { return (static_cast<unsigned char>(c) & 0xC0) == 0x80; }
+
+bool splitsCharacter(std::string_view text, size_t offset) {
+    return offset < text.size() && isContinuation(text[offset]);
+}
+
+size_t commonPrefix(std::string_view lhs, std::string_view rhs, size_t limit) {
+    size_t length = 0;
+    while (length + kCompareBlock <= limit &&
+           std::memcmp(lhs.data() + length, rhs.data() + length, kCompareBlock) == 0) {
+        length += kCompareBlock;
+    }
+    while (length < limit && lhs[length] == rhs[length]) {
+        ++length;
+    }
+    return length;
+}
+
+size_t commonSuffix(std::string_view lhs, std::string_view rhs, size_t limit) {
+    const char *lhsEnd = lhs.data() + lhs.size();
+    const char *rhsEnd = rhs.data() + rhs.size();
+    size_t length = 0;
+    while (length + kCompareBlock <= limit &&
+           std::memcmp(lhsEnd - length - kCompareBlock, rhsEnd - length - kCompareBlock,
+                       kCompareBlock) == 0) {
+        length += kCompareBlock;
+    }
+    while (length < limit && lhsEnd[-static_cast<ptrdiff_t>(length) - 1] ==
+                                 rhsEnd[-static_cast<ptrdiff_t>(length) - 1]) {
+        ++length;
+    }
+    return length;
+}
+
+// Where the first bytes of text occur near the start of haystack, if they do
+// but not at the very start. Text starts on a character, so a match does too.
+std::optional<size_t> findHead(std::string_view haystack, std::string_view text) {
+    if (text.size() < kAnchorBytes) {
+        return std::nullopt;
+    }
+    const auto found =
+        haystack.substr(0, kMaxHeadShift + kAnchorBytes).find(text.substr(0, kAnchorBytes));
+    if (found == std::string_view::npos || found == 0) {
+        return std::nullopt;
+    }
+    return found;
+}
+
+} // namespace
+
+std::optional<std::vector<ContextEdit>> diffContext(std::string_view before,
+                                                    std::string_view after) {
+    std::vector<ContextEdit> edits;
+    size_t inserted = 0;
+
+    // The window keeps a fixed number of characters before the cursor, so
+    // typing at its end drops characters from its start.
+    size_t dropped = 0;
+    size_t grown = 0;
+    if (const auto drop = findHead(before, after)) {
+        dropped = *drop;
+        edits.push_back({0, static_cast<uint32_t>(dropped), {}});
+    } else if (const auto grow = findHead(after, before)) {
+        grown = *grow;
+        edits.push_back({0, 0, std::string(after.substr(0, grown))});
+        inserted += grown;
+    }
+
+    const auto oldText = before.substr(dropped);
+    const auto newText = after.substr(grown);
+    const auto limit = std::min(oldText.size(), newText.size());
+    size_t prefix = commonPrefix(oldText, newText, limit);
+    while (prefix > 0 && (splitsCharacter(oldText, prefix) || splitsCharacter(newText, prefix))) {
+        --prefix;
+    }
+    size_t suffix = commonSuffix(oldText, newText, limit - prefix);
+    while (suffix > 0 && (splitsCharacter(oldText, oldText.size() - suffix) ||
+                          splitsCharacter(newText, newText.size() - suffix))) {
+        --suffix;
+    }
+
+    const auto erase = oldText.size() - prefix - suffix;
+    const auto insert = newText.substr(prefix, newText.size() - prefix - suffix);
+    if (erase > 0 || !insert.empty()) {
+        edits.push_back({static_cast<uint32_t>(grown + prefix), static_cast<uint32_t>(erase),
+                         std::string(insert)});
+        inserted += insert.size();
+    }
+    if (inserted * 2 >= after.size() && !after.empty()) {
+        return std::nullopt;
+    }
+    return edits;
+}
+
+} // namespace aetherime
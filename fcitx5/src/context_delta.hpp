@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace aetherime {
+
+// Deletes erase bytes at byte offset at, then inserts insert there.
+struct ContextEdit {
+    uint32_t at = 0;
+    uint32_t erase = 0;
+    std::string insert;
+};
+
+// How a predict request refers to its session's context on the daemon.
+struct SessionContext {
+    uint64_t id = 0;
+    // Edits against the context last sent for the session, which replace
+    // the request's prefix and suffix. Unset sends the full context and
+    // (re)starts the session.
+    std::optional<std::vector<ContextEdit>> edits;
+    // Byte length of the prefix in the edited context.
+    size_t cursor = 0;
+};
+
+// Edits that turn before into after, in order and on code point
+// boundaries: one for the far end of the window when it slides with the
+// cursor, and one replacing the span that changed. Returns std::nullopt when
+// the two share too little for edits to be smaller than after itself.
+std::optional<std::vector<ContextEdit>> diffContext(std::string_view before,
+                                                    std::string_view after);
+
+} // namespace aetherime
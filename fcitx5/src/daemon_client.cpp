@@ -1,208 +1,612 @@
 #include "daemon_client.hpp"
 
 #include <array>
+#include <cerrno>
 #include <chrono>
 #include <cstring>
-#include <regex>
-#include <sstream>
 
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include "ipc_codec.hpp"
+
 namespace aetherime {
 namespace {
 
-std::string escapeJson(const std::string &value) {
-    std::string out;
-    out.reserve(value.size());
-    for (char c : value) {
-        switch (c) {
-        case '\\':
-            out += "\\\\";
-            break;
-        case '"':
-            out += "\\\"";
-            break;
-        case '\n':
-            out += "\\n";
-            break;
-        case '\r':
-            out += "\\r";
-            break;
-        case '\t':
-            out += "\\t";
-            break;
-        default:
-            out += c;
-            break;
-        }
+constexpr int kResponseGraceMs = 250;
+constexpr int kHelloTimeoutMs = 1000;
+
+std::optional<PredictionResult> predictionFromReply(const DaemonReply *reply) {
+    if (!reply || reply->type != ReplyType::Predict) {
+        return std::nullopt;
     }
-    return out;
+    return reply->prediction;
 }
 
-std::string unescapeJson(const std::string &value) {
-    std::string out;
-    out.reserve(value.size());
-    bool escaped = false;
-    for (char c : value) {
-        if (!escaped && c == '\\') {
-            escaped = true;
-            continue;
-        }
-        if (escaped) {
-            switch (c) {
-            case 'n':
-                out.push_back('\n');
-                break;
-            case 'r':
-                out.push_back('\r');
-                break;
-            case 't':
-                out.push_back('\t');
-                break;
-            default:
-                out.push_back(c);
-                break;
+int connectSocket(const std::string &socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends data with the descriptors attached to its first byte.
+ssize_t sendWithFds(int fd, std::string_view data, const int (&fds)[4]) {
+    iovec iov{const_cast<char *>(data.data()), data.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    auto *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent;
+}
+
+} // namespace
+
+PendingPrediction::~PendingPrediction() { client_->cancel(id_); }
+
+DaemonClient::DaemonClient(std::string socketPath, fcitx::EventLoop *eventLoop,
+                           LatencyTracer *tracer)
+    : socketPath_(std::move(socketPath)), eventLoop_(eventLoop), tracer_(tracer) {}
+
+DaemonClient::~DaemonClient() {
+    pending_.clear();
+    disconnect(false);
+}
+
+bool DaemonClient::ping() {
+    const auto id = nextId_++;
+    auto reply = roundTrip(id, std::nullopt, 1000);
+    return reply && reply->type == ReplyType::Pong;
+}
+
+std::optional<PredictionResult> DaemonClient::predict(const PredictionRequest &requestValue) {
+    const auto id = nextId_++;
+    auto reply = roundTrip(id, requestValue, requestValue.latencyBudgetMs + kResponseGraceMs);
+    return predictionFromReply(reply ? &*reply : nullptr);
+}
+
+std::unique_ptr<PendingPrediction> DaemonClient::predictAsync(const PredictionRequest &requestValue,
+                                                              PredictCallback callback,
+                                                              GhostDeltaCallback onDelta) {
+    const auto id = nextId_++;
+    if (!submit(id, requestValue, requestValue.latencyBudgetMs + kResponseGraceMs,
+                [callback = std::move(callback)](const DaemonReply *reply) {
+                    callback(predictionFromReply(reply));
+                })) {
+        return nullptr;
+    }
+    if (requestValue.stream && onDelta) {
+        pending_.at(id).onDelta = std::move(onDelta);
+    }
+    return std::make_unique<PendingPrediction>(this, id);
+}
+
+bool DaemonClient::submit(uint64_t id, std::optional<PredictionRequest> request, int timeoutMs,
+                          ReplyCallback callback) {
+    if (!ensureConnected()) {
+        return false;
+    }
+
+    Pending pending;
+    pending.request = std::move(request);
+    pending.callback = std::move(callback);
+    pending.submittedAt = LatencyTracer::Clock::now();
+    if (!negotiating_) {
+        appendRequest(id, pending);
+        if (!flush()) {
+            // The daemon went away since the last request; resend on a fresh connection.
+            disconnect(true);
+            if (!ensureConnected()) {
+                return false;
             }
-            escaped = false;
-            continue;
         }
-        out.push_back(c);
     }
-    return out;
+    if (negotiating_) {
+        queued_.push_back(id);
+    }
+
+    if (eventLoop_) {
+        pending.timeoutEvent = eventLoop_->addTimeEvent(
+            CLOCK_MONOTONIC,
+            fcitx::now(CLOCK_MONOTONIC) + static_cast<uint64_t>(timeoutMs) * 1000, 0,
+            [this, id](fcitx::EventSourceTime *, uint64_t) {
+                finish(id, nullptr);
+                return true;
+            });
+    }
+    pending_.emplace(id, std::move(pending));
+    updateEvents();
+    return true;
 }
 
-std::optional<std::string> extractStringField(const std::string &payload, const std::string &field) {
-    std::regex pattern("\"" + field + "\"\\s*:\\s*\"((?:\\\\.|[^\"])*)\"");
-    std::smatch match;
-    if (!std::regex_search(payload, match, pattern) || match.size() < 2) {
+std::optional<DaemonReply> DaemonClient::roundTrip(uint64_t id,
+                                                   std::optional<PredictionRequest> request,
+                                                   int timeoutMs) {
+    std::optional<DaemonReply> response;
+    bool done = false;
+    if (!submit(id, std::move(request), timeoutMs, [&](const DaemonReply *reply) {
+            if (reply) {
+                response = *reply;
+            }
+            done = true;
+        })) {
         return std::nullopt;
     }
-    return unescapeJson(match[1].str());
-}
 
-std::vector<std::string> extractStringArray(const std::string &payload, const std::string &field) {
-    std::vector<std::string> result;
-    std::regex fieldPattern("\"" + field + "\"\\s*:\\s*\\[(.*?)\\]");
-    std::smatch fieldMatch;
-    if (!std::regex_search(payload, fieldMatch, fieldPattern) || fieldMatch.size() < 2) {
-        return result;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (!done && fd_ >= 0) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            break;
+        }
+        pollfd pfds[] = {
+            {fd_, static_cast<short>(POLLIN | (outgoing_.empty() ? 0 : POLLOUT)), 0},
+            {replyRing_ ? replyRing_->eventFd() : -1, POLLIN, 0},
+        };
+        int ready = poll(pfds, 2, static_cast<int>(remaining.count()));
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        const auto &pfd = pfds[0];
+        fcitx::IOEventFlags flags;
+        if ((pfd.revents | pfds[1].revents) & POLLIN) {
+            flags |= fcitx::IOEventFlag::In;
+        }
+        if (pfd.revents & POLLOUT) {
+            flags |= fcitx::IOEventFlag::Out;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            flags |= fcitx::IOEventFlag::Err;
+        }
+        onIO(flags);
+    }
+    if (!done) {
+        cancel(id);
     }
+    return response;
+}
 
-    std::string arrayBody = fieldMatch[1].str();
-    std::regex itemPattern("\"((?:\\\\.|[^\"])*)\"");
-    for (std::sregex_iterator iterator(arrayBody.begin(), arrayBody.end(), itemPattern);
-         iterator != std::sregex_iterator(); ++iterator) {
-        result.push_back(unescapeJson((*iterator)[1].str()));
+void DaemonClient::cancel(uint64_t id) {
+    auto iterator = pending_.find(id);
+    if (iterator == pending_.end()) {
+        return;
+    }
+    const bool failed = iterator->second.failed;
+    pending_.erase(iterator);
+    // Requests lost with an earlier connection or still waiting for
+    // negotiation were never sent on this one. Otherwise tell the daemon to
+    // stop working on it; the cancel goes out with the next write and any
+    // late reply is dropped in finish().
+    if (failed || fd_ < 0 || negotiating_) {
+        return;
+    }
+    if (wire_ != WireFormat::Json) {
+        appendCancelFrame(outgoing_, id);
+    } else {
+        outgoing_ += encodeCancelRequest(id);
+        outgoing_.push_back('\n');
     }
-    return result;
+    updateEvents();
 }
 
-std::optional<float> extractFloatField(const std::string &payload, const std::string &field) {
-    std::regex pattern("\"" + field + "\"\\s*:\\s*(-?[0-9]+(?:\\.[0-9]+)?)");
-    std::smatch match;
-    if (!std::regex_search(payload, match, pattern) || match.size() < 2) {
-        return std::nullopt;
+void DaemonClient::finish(uint64_t id, const DaemonReply *reply) {
+    auto iterator = pending_.find(id);
+    if (iterator == pending_.end()) {
+        return;
+    }
+    if (tracer_ && reply && iterator->second.request) {
+        tracer_->recordSince(LatencyStage::DaemonRoundTrip, iterator->second.submittedAt);
+    }
+    auto callback = std::move(iterator->second.callback);
+    pending_.erase(iterator);
+    if (callback) {
+        callback(reply);
     }
-    return std::stof(match[1].str());
 }
 
-std::optional<int> extractIntField(const std::string &payload, const std::string &field) {
-    std::regex pattern("\"" + field + "\"\\s*:\\s*(-?[0-9]+)");
-    std::smatch match;
-    if (!std::regex_search(payload, match, pattern) || match.size() < 2) {
-        return std::nullopt;
+bool DaemonClient::ensureConnected() {
+    if (fd_ >= 0) {
+        return true;
+    }
+    fd_ = connectSocket(socketPath_);
+    if (fd_ < 0) {
+        return false;
     }
-    return std::stoi(match[1].str());
+
+    negotiating_ = true;
+    helloId_ = nextId_++;
+    if (!sendHello()) {
+        close(fd_);
+        fd_ = -1;
+        outgoing_.clear();
+        negotiating_ = false;
+        requestRing_.reset();
+        replyRing_.reset();
+        return false;
+    }
+    if (eventLoop_) {
+        ioEvent_ = eventLoop_->addIOEvent(
+            fd_, fcitx::IOEventFlag::In | fcitx::IOEventFlag::Out,
+            [this](fcitx::EventSourceIO *, int, fcitx::IOEventFlags flags) {
+                onIO(flags);
+                return true;
+            });
+        helloTimeoutEvent_ = eventLoop_->addTimeEvent(
+            CLOCK_MONOTONIC,
+            fcitx::now(CLOCK_MONOTONIC) + static_cast<uint64_t>(kHelloTimeoutMs) * 1000, 0,
+            [this](fcitx::EventSourceTime *, uint64_t) {
+                disconnect(true);
+                return true;
+            });
+    }
+    return true;
 }
 
-} // namespace
+// The rings travel with the hello ping. If they cannot be created or sent,
+// the ping offers binary framing alone.
+bool DaemonClient::sendHello() {
+    if (sharedMemory_) {
+        requestRing_ = ShmRing::create();
+        replyRing_ = requestRing_ ? ShmRing::create() : nullptr;
+    }
+    if (requestRing_ && replyRing_) {
+        outgoing_ = encodePingRequest(helloId_, true, true);
+        outgoing_.push_back('\n');
+        const int fds[] = {requestRing_->memoryFd(), replyRing_->memoryFd(),
+                           requestRing_->eventFd(), replyRing_->eventFd()};
+        const auto sent = sendWithFds(fd_, outgoing_, fds);
+        if (sent > 0) {
+            outgoing_.erase(0, static_cast<size_t>(sent));
+            return flush();
+        }
+    }
+    requestRing_.reset();
+    replyRing_.reset();
+    outgoing_ = encodePingRequest(helloId_, true);
+    outgoing_.push_back('\n');
+    return flush();
+}
 
-DaemonClient::DaemonClient(std::string socketPath) : socketPath_(std::move(socketPath)) {}
+// Requests that were already sent get one more attempt on a fresh connection,
+// which covers a daemon restart between two keystrokes.
+void DaemonClient::disconnect(bool retry) {
+    ioEvent_.reset();
+    ringEvent_.reset();
+    helloTimeoutEvent_.reset();
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    requestRing_.reset();
+    replyRing_.reset();
+    wire_ = WireFormat::Json;
+    daemonSessions_ = false;
+    sessionContexts_.clear();
+    ++generation_;
+    outgoing_.clear();
+    incoming_.clear();
+    scanned_ = 0;
+    negotiating_ = false;
+    queued_.clear();
 
-bool DaemonClient::ping() const {
-    auto response = request(R"({"id":"ping","type":"ping"})");
-    return response.has_value() && response->find("\"type\":\"pong\"") != std::string::npos;
+    std::vector<uint64_t> retried;
+    std::vector<uint64_t> failed;
+    for (auto &[id, pending] : pending_) {
+        if (pending.failed) {
+            continue;
+        }
+        if (retry && !pending.retried) {
+            pending.retried = true;
+            // Deltas already delivered would be repeated; the retry only
+            // asks for the final reply.
+            if (pending.request) {
+                pending.request->stream = false;
+            }
+            retried.push_back(id);
+        } else {
+            failed.push_back(id);
+        }
+    }
+    if (!retried.empty()) {
+        if (ensureConnected()) {
+            queued_ = std::move(retried);
+        } else {
+            failed.insert(failed.end(), retried.begin(), retried.end());
+        }
+    }
+    updateEvents();
+    // This may run inside submit(), whose caller is not ready for other
+    // requests' callbacks; firing their timeouts now reports them from the
+    // event loop instead.
+    for (auto id : failed) {
+        auto &pending = pending_.at(id);
+        if (!pending.timeoutEvent) {
+            finish(id, nullptr);
+            continue;
+        }
+        pending.failed = true;
+        pending.timeoutEvent->setTime(fcitx::now(CLOCK_MONOTONIC));
+        pending.timeoutEvent->setOneShot();
+    }
 }
 
-std::optional<PredictionResult> DaemonClient::predict(const PredictionRequest &requestValue) const {
-    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
-    std::ostringstream payload;
-    payload << "{\"id\":\"" << now << "\",\"type\":\"predict\",\"prefix\":\""
-            << escapeJson(requestValue.prefix) << "\",\"suffix\":\""
-            << escapeJson(requestValue.suffix) << "\",\"language\":\""
-            << (requestValue.language == Language::Zh ? "zh" : "en") << "\",\"mode\":\""
-            << (requestValue.mode == PredictMode::Fim ? "fim" : "next")
-            << "\",\"max_tokens\":" << requestValue.maxTokens
-            << ",\"latency_budget_ms\":" << requestValue.latencyBudgetMs << "}";
+void DaemonClient::negotiated(WireFormat wire) {
+    negotiating_ = false;
+    wire_ = wire;
+    helloTimeoutEvent_.reset();
+    if (wire_ != WireFormat::SharedMemory) {
+        requestRing_.reset();
+        replyRing_.reset();
+    } else if (eventLoop_) {
+        ringEvent_ = eventLoop_->addIOEvent(
+            replyRing_->eventFd(), fcitx::IOEventFlag::In,
+            [this](fcitx::EventSourceIO *, int, fcitx::IOEventFlags) {
+                readReplies(false);
+                return true;
+            });
+    }
 
-    auto response = request(payload.str());
-    if (!response || response->find("\"type\":\"error\"") != std::string::npos) {
-        return std::nullopt;
+    auto queued = std::move(queued_);
+    queued_.clear();
+    for (auto id : queued) {
+        auto iterator = pending_.find(id);
+        if (iterator != pending_.end()) {
+            appendRequest(id, iterator->second);
+        }
     }
-    if (response->find("\"type\":\"predict\"") == std::string::npos) {
-        return std::nullopt;
+    if (!flush()) {
+        disconnect(true);
+        return;
     }
+    updateEvents();
+}
 
-    PredictionResult result;
-    result.ghostText = extractStringField(*response, "ghost_text").value_or("");
-    result.candidates = extractStringArray(*response, "candidates");
-    result.confidence = extractFloatField(*response, "confidence").value_or(0.0f);
-    result.source = extractStringField(*response, "source").value_or("");
-    result.elapsedMs = extractIntField(*response, "elapsed_ms").value_or(0);
-    return result;
+void DaemonClient::appendRequest(uint64_t id, Pending &pending) {
+    // Only predictions are timed, so the stage counts requests sent.
+    LatencySpan span(pending.request ? tracer_ : nullptr, LatencyStage::RequestEncode);
+    const auto session = pending.request ? sessionContext(pending) : std::nullopt;
+    const auto *sessionPtr = session ? &*session : nullptr;
+    if (wire_ != WireFormat::Json) {
+        if (pending.request) {
+            appendPredictFrame(outgoing_, id, *pending.request, sessionPtr);
+        } else {
+            appendPingFrame(outgoing_, id);
+        }
+        return;
+    }
+    outgoing_ += pending.request ? encodePredictRequest(id, *pending.request, sessionPtr)
+                                 : encodePingRequest(id);
+    outgoing_.push_back('\n');
 }
 
-std::optional<std::string> DaemonClient::request(const std::string &payload) const {
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
+// Called in the order requests go out, so the edits are always against what
+// the daemon received last for the session.
+std::optional<SessionContext> DaemonClient::sessionContext(Pending &pending) {
+    const auto &request = *pending.request;
+    if (request.session == 0 || !daemonSessions_) {
         return std::nullopt;
     }
+    SessionContext session{request.session, std::nullopt, request.prefix.size()};
+    auto context = request.prefix + request.suffix;
+    auto known = sessionContexts_.find(request.session);
+    if (known != sessionContexts_.end()) {
+        session.edits = diffContext(known->second, context);
+        known->second = std::move(context);
+    } else {
+        sessionContexts_.emplace(request.session, std::move(context));
+    }
+    pending.sentEdits = session.edits.has_value();
+    return session;
+}
 
-    sockaddr_un address{};
-    address.sun_family = AF_UNIX;
-    if (socketPath_.size() >= sizeof(address.sun_path)) {
-        close(fd);
-        return std::nullopt;
+// The daemon drops a session whose edits it cannot apply, and may evict one
+// it has not seen for a while. Sending the context again restarts it.
+bool DaemonClient::resendInFull(uint64_t id) {
+    auto iterator = pending_.find(id);
+    if (iterator == pending_.end() || !iterator->second.sentEdits) {
+        return false;
+    }
+    auto &pending = iterator->second;
+    sessionContexts_.erase(pending.request->session);
+    // As for a retry after reconnecting, only the final reply is wanted.
+    pending.request->stream = false;
+    appendRequest(id, pending);
+    if (!flush()) {
+        disconnect(true);
+        return true;
     }
-    std::strncpy(address.sun_path, socketPath_.c_str(), sizeof(address.sun_path) - 1);
+    updateEvents();
+    return true;
+}
 
-    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
-        close(fd);
-        return std::nullopt;
+void DaemonClient::updateEvents() {
+    if (!ioEvent_) {
+        return;
+    }
+    fcitx::IOEventFlags flags = fcitx::IOEventFlag::In;
+    if (!outgoing_.empty()) {
+        flags |= fcitx::IOEventFlag::Out;
     }
+    ioEvent_->setEvents(flags);
+}
 
-    std::string framedPayload = payload + "\n";
-    ssize_t written = send(fd, framedPayload.data(), framedPayload.size(), 0);
-    if (written < 0) {
-        close(fd);
-        return std::nullopt;
+void DaemonClient::onIO(fcitx::IOEventFlags flags) {
+    if (flags.test(fcitx::IOEventFlag::In)) {
+        readReplies();
+        if (fd_ < 0) {
+            return;
+        }
+    }
+    if (flags.testAny(fcitx::IOEventFlag::Err | fcitx::IOEventFlag::Hup)) {
+        disconnect(true);
+        return;
+    }
+    if (flags.test(fcitx::IOEventFlag::Out)) {
+        if (!flush()) {
+            disconnect(true);
+            return;
+        }
+        updateEvents();
     }
+}
 
-    std::string response;
-    std::array<char, 1024> buffer{};
-    while (true) {
-        ssize_t readBytes = recv(fd, buffer.data(), buffer.size(), 0);
-        if (readBytes <= 0) {
+bool DaemonClient::flush() {
+    // Once negotiated, the shared-memory transport leaves the socket idle. A
+    // full ring means the daemon has stopped reading.
+    if (wire_ == WireFormat::SharedMemory && !negotiating_) {
+        if (outgoing_.empty()) {
+            return true;
+        }
+        if (!requestRing_->write(outgoing_)) {
+            return false;
+        }
+        outgoing_.clear();
+        requestRing_->notify();
+        return true;
+    }
+    while (!outgoing_.empty()) {
+        ssize_t written = send(fd_, outgoing_.data(), outgoing_.size(), MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN;
+        }
+        outgoing_.erase(0, static_cast<size_t>(written));
+    }
+    return true;
+}
+
+// Ring wakeups skip the socket, which only carries the hello on that
+// transport and is watched for hangups separately.
+void DaemonClient::readReplies(bool fromSocket) {
+    bool closed = false;
+    std::array<char, 4096> buffer{};
+    while (fromSocket) {
+        ssize_t readBytes = recv(fd_, buffer.data(), buffer.size(), 0);
+        if (readBytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (readBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             break;
         }
-        response.append(buffer.data(), static_cast<size_t>(readBytes));
-        if (response.find('\n') != std::string::npos) {
+        if (readBytes <= 0) {
+            closed = true;
             break;
         }
+        incoming_.append(buffer.data(), static_cast<size_t>(readBytes));
+    }
+    if (wire_ == WireFormat::SharedMemory && !negotiating_ && !closed) {
+        replyRing_->clearEvents();
+        if (!replyRing_->read(incoming_)) {
+            disconnect(true);
+            return;
+        }
     }
 
-    close(fd);
+    // Callbacks may re-enter the client, so each reply is decoded and removed
+    // from incoming_ before it is dispatched. A reconnect from inside a
+    // callback bumps the generation and abandons the old buffer.
+    const auto generation = generation_;
+    while (generation == generation_ && !incoming_.empty()) {
+        DaemonReply reply;
+        size_t consumed = 0;
+        bool decoded = false;
+        const auto decodeStart = LatencyTracer::Clock::now();
+        if (!negotiating_ && wire_ != WireFormat::Json) {
+            const auto status = decodeFrame(incoming_, reply, consumed);
+            if (status == FrameStatus::Incomplete) {
+                break;
+            }
+            if (status == FrameStatus::Invalid) {
+                disconnect(true);
+                return;
+            }
+            decoded = true;
+        } else {
+            const auto newline = incoming_.find('\n', scanned_);
+            if (newline == std::string::npos) {
+                scanned_ = incoming_.size();
+                break;
+            }
+            consumed = newline + 1;
+            decoded = newline > 0 &&
+                      decodeReply(std::string_view(incoming_.data(), newline), reply) &&
+                      reply.hasId;
+        }
+        incoming_.erase(0, consumed);
+        scanned_ = 0;
+        if (decoded) {
+            if (tracer_) {
+                tracer_->recordSince(LatencyStage::ReplyDecode, decodeStart);
+            }
+            dispatch(reply);
+        }
+    }
+    if (closed && generation == generation_ && fd_ >= 0) {
+        disconnect(true);
+    }
+}
 
-    auto newline = response.find('\n');
-    if (newline != std::string::npos) {
-        response = response.substr(0, newline);
+void DaemonClient::dispatch(const DaemonReply &reply) {
+    if (negotiating_ && reply.id == helloId_) {
+        // Older daemons answer without a protocol (or reject the field) and
+        // keep speaking JSON.
+        auto wire = WireFormat::Json;
+        if (reply.type == ReplyType::Pong && reply.protocol == kProtocolShmRingV1 &&
+            requestRing_) {
+            wire = WireFormat::SharedMemory;
+        } else if (reply.type == ReplyType::Pong && reply.protocol == kProtocolBinaryV2) {
+            wire = WireFormat::Binary;
+        }
+        daemonSessions_ = reply.type == ReplyType::Pong && reply.sessions;
+        negotiated(wire);
+        return;
     }
-    if (response.empty()) {
-        return std::nullopt;
+    if (reply.type == ReplyType::GhostDelta) {
+        auto iterator = pending_.find(reply.id);
+        if (iterator != pending_.end() && iterator->second.onDelta) {
+            iterator->second.onDelta(reply.ghostDelta);
+        }
+        return;
     }
-    return response;
+    // Only invalid_request means the session is gone; a timeout or backend
+    // failure would just happen again, at twice the load.
+    if (reply.type == ReplyType::Error && reply.errorCode == "invalid_request" &&
+        resendInFull(reply.id)) {
+        return;
+    }
+    finish(reply.id, &reply);
 }
 
 } // namespace aetherime
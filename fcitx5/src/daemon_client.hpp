@@ -1,9 +1,20 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include <fcitx-utils/event.h>
+
+#include "context_delta.hpp"
+#include "latency_trace.hpp"
+#include "shm_ring.hpp"
+
 namespace aetherime {
 
 enum class Language {
@@ -23,6 +34,10 @@ struct PredictionRequest {
     PredictMode mode = PredictMode::Fim;
     int maxTokens = 12;
     int latencyBudgetMs = 90;
+    // Ask the daemon for ghost text deltas while the model generates.
+    bool stream = false;
+    // Context session from DaemonClient::openSession(), or 0 for none.
+    uint64_t session = 0;
 };
 
 struct PredictionResult {
@@ -33,17 +48,149 @@ struct PredictionResult {
     int elapsedMs = 0;
 };
 
+using PredictCallback = std::function<void(std::optional<PredictionResult>)>;
+using GhostDeltaCallback = std::function<void(const std::string &)>;
+
+class DaemonClient;
+struct DaemonReply;
+
+enum class WireFormat {
+    Json,
+    Binary,
+    SharedMemory,
+};
+
+// Handle for an in-flight asynchronous prediction. Destroying it cancels the
+// request on the daemon and guarantees the callback is never invoked.
+class PendingPrediction {
+public:
+    PendingPrediction(DaemonClient *client, uint64_t id) : client_(client), id_(id) {}
+    ~PendingPrediction();
+
+    PendingPrediction(const PendingPrediction &) = delete;
+    PendingPrediction &operator=(const PendingPrediction &) = delete;
+
+    uint64_t id() const { return id_; }
+
+private:
+    DaemonClient *client_;
+    uint64_t id_;
+};
+
+// Keeps one long-lived connection to the daemon and multiplexes requests over
+// it, matching replies by id. The connection is re-established on demand when
+// the daemon restarts. With a null event loop only the blocking calls work.
+// A tracer, if given, receives encode, decode and prediction round-trip times.
 class DaemonClient {
 public:
-    explicit DaemonClient(std::string socketPath);
+    DaemonClient(std::string socketPath, fcitx::EventLoop *eventLoop,
+                 LatencyTracer *tracer = nullptr);
+    ~DaemonClient();
+
+    DaemonClient(const DaemonClient &) = delete;
+    DaemonClient &operator=(const DaemonClient &) = delete;
+
+    bool ping();
+    std::optional<PredictionResult> predict(const PredictionRequest &request);
+
+    // Queues the request on the shared connection and invokes the callback
+    // from the event loop once the reply arrives or the budget expires.
+    // Returns nullptr if the daemon cannot be reached right away. For a
+    // streaming request, onDelta receives ghost text to append as it is
+    // generated; the final result still arrives through the callback.
+    std::unique_ptr<PendingPrediction> predictAsync(const PredictionRequest &request,
+                                                    PredictCallback callback,
+                                                    GhostDeltaCallback onDelta = {});
+
+    // Whether new connections offer the shared-memory transport. When the
+    // rings cannot be set up or the daemon declines, the connection falls
+    // back to binary frames on the socket.
+    void setSharedMemory(bool enabled) { sharedMemory_ = enabled; }
+
+    // A session names a sequence of requests for one input context. Once the
+    // daemon has a session's context, later requests carry only the edits
+    // since the previous one; the daemon rebuilds the prefix and suffix.
+    // Sessions need no setup on the daemon and end with the connection;
+    // closing one only forgets what was last sent for it.
+    uint64_t openSession() { return nextSession_++; }
+    void closeSession(uint64_t session) { sessionContexts_.erase(session); }
 
-    bool ping() const;
-    std::optional<PredictionResult> predict(const PredictionRequest &request) const;
+    bool connected() const { return fd_ >= 0; }
+    WireFormat wireFormat() const { return wire_; }
+    size_t inFlight() const { return pending_.size(); }
 
 private:
-    std::optional<std::string> request(const std::string &payload) const;
+    friend class PendingPrediction;
+
+    // Receives the decoded reply, or nullptr on timeout or connection loss.
+    using ReplyCallback = std::function<void(const DaemonReply *)>;
+
+    struct Pending {
+        // Unset for pings. Kept unencoded so a retry can use whichever wire
+        // format the new connection negotiates.
+        std::optional<PredictionRequest> request;
+        ReplyCallback callback;
+        GhostDeltaCallback onDelta;
+        std::unique_ptr<fcitx::EventSourceTime> timeoutEvent;
+        LatencyTracer::Clock::time_point submittedAt;
+        bool retried = false;
+        // Lost with its connection; the timeout event reports it next.
+        bool failed = false;
+        // Sent as session edits, so an error may only mean the daemon lost
+        // the session.
+        bool sentEdits = false;
+    };
+
+    bool submit(uint64_t id, std::optional<PredictionRequest> request, int timeoutMs,
+                ReplyCallback callback);
+    std::optional<DaemonReply> roundTrip(uint64_t id, std::optional<PredictionRequest> request,
+                                         int timeoutMs);
+    void cancel(uint64_t id);
+    void finish(uint64_t id, const DaemonReply *reply);
+
+    bool ensureConnected();
+    bool sendHello();
+    void disconnect(bool retry);
+    void negotiated(WireFormat wire);
+    void appendRequest(uint64_t id, Pending &pending);
+    std::optional<SessionContext> sessionContext(Pending &pending);
+    bool resendInFull(uint64_t id);
+    void updateEvents();
+    void onIO(fcitx::IOEventFlags flags);
+    bool flush();
+    void readReplies(bool fromSocket = true);
+    void dispatch(const DaemonReply &reply);
 
     std::string socketPath_;
+    fcitx::EventLoop *eventLoop_;
+    LatencyTracer *tracer_;
+    int fd_ = -1;
+    std::unique_ptr<fcitx::EventSourceIO> ioEvent_;
+    std::string outgoing_;
+    std::string incoming_;
+    size_t scanned_ = 0;
+    uint64_t generation_ = 0;
+    uint64_t nextId_ = 1;
+    std::unordered_map<uint64_t, Pending> pending_;
+
+    // Each connection opens with a ping offering binary framing, and the
+    // shared-memory rings when enabled; requests wait in queued_ until the
+    // daemon's answer fixes the wire format.
+    bool negotiating_ = false;
+    uint64_t helloId_ = 0;
+    WireFormat wire_ = WireFormat::Json;
+    bool sharedMemory_ = true;
+    std::unique_ptr<ShmRing> requestRing_;
+    std::unique_ptr<ShmRing> replyRing_;
+    std::unique_ptr<fcitx::EventSourceIO> ringEvent_;
+    std::vector<uint64_t> queued_;
+    std::unique_ptr<fcitx::EventSourceTime> helloTimeoutEvent_;
+
+    // Whether the daemon said in its pong that it keeps sessions, and the
+    // context last sent for each session on this connection.
+    bool daemonSessions_ = false;
+    uint64_t nextSession_ = 1;
+    std::unordered_map<uint64_t, std::string> sessionContexts_;
 };
 
 } // namespace aetherime
@@ -1,31 +1,388 @@
 #include "ghost_session.hpp"
 
+#include <algorithm>
+#include <string_view>
+
 namespace aetherime {
+namespace {
+
+constexpr size_t kDefaultCacheCapacity = 64;
+// Only the text nearest the cursor keys the cache; the far end of the window
+// shifts as the surrounding text scrolls without changing the prediction.
+constexpr size_t kCachePrefixTailBytes = 96;
+
+// Prediction length follows the typing pace between these intervals; a gap
+// of kPauseMs or more is a pause rather than part of the pace.
+constexpr int kMinTokens = 3;
+constexpr int kMaxTokens = 16;
+constexpr double kFastIntervalMs = 150;
+constexpr double kSlowIntervalMs = 600;
+constexpr double kPauseMs = 1000;
+constexpr double kSmoothing = 0.25;
+// Headroom over the expected time, and the bounds the budget stays in.
+constexpr double kBudgetHeadroom = 1.5;
+constexpr int kMinBudgetMs = 60;
+constexpr int kMaxBudgetMs = 5000;
+
+uint64_t fnv1a(uint64_t hash, std::string_view bytes) {
+    for (unsigned char byte : bytes) {
+        hash ^= byte;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t contextKey(const PredictionRequest &request) {
+    std::string_view prefix(request.prefix);
+    prefix.remove_prefix(prefix.size() - std::min(prefix.size(), kCachePrefixTailBytes));
+    const char tags[] = {
+        static_cast<char>(request.language),
+        static_cast<char>(request.mode),
+        static_cast<char>(prefix.size()),
+    };
+    auto hash = fnv1a(0xcbf29ce484222325ULL, std::string_view(tags, sizeof(tags)));
+    hash = fnv1a(hash, prefix);
+    return fnv1a(hash, request.suffix);
+}
+
+double smooth(double average, double sample) {
+    return average == 0 ? sample : average + kSmoothing * (sample - average);
+}
+
+} // namespace
+
+void PredictionBudget::onKeystroke(uint64_t nowUs) {
+    const double intervalMs = lastKeyUs_ == 0 ? kPauseMs : (nowUs - lastKeyUs_) / 1000.0;
+    lastKeyUs_ = nowUs;
+    paused_ = intervalMs >= kPauseMs;
+    if (!paused_) {
+        keyIntervalMs_ = smooth(keyIntervalMs_, intervalMs);
+    }
+}
+
+void PredictionBudget::onFinished(const BudgetDecision &decision, uint64_t sentUs,
+                                  std::optional<int> elapsedMs, uint64_t nowUs) {
+    const double tokens = std::max(decision.maxTokens, 1);
+    if (elapsedMs) {
+        ++replies_;
+        addSample(*elapsedMs / tokens);
+    } else if ((nowUs - sentUs) / 1000.0 >= decision.latencyBudgetMs) {
+        // All that is known is that it would have taken longer.
+        ++timeouts_;
+        addSample(decision.latencyBudgetMs * kBudgetHeadroom / tokens);
+    }
+}
+
+void PredictionBudget::addSample(double msPerToken) {
+    msPerToken_ = smooth(msPerToken_, std::max(msPerToken, 1.0));
+}
+
+BudgetDecision PredictionBudget::decide() const {
+    int tokens = kMaxTokens;
+    if (!paused_ && keyIntervalMs_ > 0) {
+        const double pace = std::clamp((keyIntervalMs_ - kFastIntervalMs) /
+                                           (kSlowIntervalMs - kFastIntervalMs),
+                                       0.0, 1.0);
+        tokens = kMinTokens + static_cast<int>(pace * (kMaxTokens - kMinTokens));
+    }
+    if (msPerToken_ == 0) {
+        return BudgetDecision{.maxTokens = std::min(tokens, BudgetDecision{}.maxTokens)};
+    }
+    if (!paused_ && keyIntervalMs_ > 0) {
+        // Aim for the prediction to land within about two keystrokes.
+        const auto affordable = static_cast<int>(keyIntervalMs_ * 2 / msPerToken_);
+        tokens = std::clamp(affordable, kMinTokens, tokens);
+    }
+    const auto budgetMs = static_cast<int>(tokens * msPerToken_ * kBudgetHeadroom);
+    return BudgetDecision{
+        .maxTokens = tokens,
+        .latencyBudgetMs = std::clamp(budgetMs, kMinBudgetMs, kMaxBudgetMs),
+    };
+}
 
-GhostSession::GhostSession(DaemonClient client) : client_(std::move(client)) {}
+BudgetStats PredictionBudget::stats() const {
+    return BudgetStats{
+        .decision = decide(),
+        .keyIntervalMs = keyIntervalMs_,
+        .msPerToken = msPerToken_,
+        .paused = paused_,
+        .replies = replies_,
+        .timeouts = timeouts_,
+    };
+}
+
+void PredictionCache::setCapacity(size_t capacity) {
+    capacity_ = capacity;
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+}
+
+const PredictionResult *PredictionCache::find(uint64_t key) {
+    auto iterator = index_.find(key);
+    if (iterator == index_.end()) {
+        return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, iterator->second);
+    return &iterator->second->second;
+}
+
+void PredictionCache::insert(uint64_t key, PredictionResult result) {
+    if (capacity_ == 0) {
+        return;
+    }
+    if (auto iterator = index_.find(key); iterator != index_.end()) {
+        iterator->second->second = std::move(result);
+        entries_.splice(entries_.begin(), entries_, iterator->second);
+        return;
+    }
+    if (entries_.size() == capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+    entries_.emplace_front(key, std::move(result));
+    index_.emplace(key, entries_.begin());
+}
+
+GhostSession::GhostSession(PredictionDispatcher &dispatcher, fcitx::EventLoop *eventLoop)
+    : dispatcher_(dispatcher), eventLoop_(eventLoop),
+      contextSession_(dispatcher.client().openSession()), cache_(kDefaultCacheCapacity) {}
+
+GhostSession::~GhostSession() { dispatcher_.client().closeSession(contextSession_); }
 
 void GhostSession::setLanguage(Language language) { language_ = language; }
 
 void GhostSession::setMode(PredictMode mode) { mode_ = mode; }
 
-std::string GhostSession::onTextChanged(const std::string &prefix, const std::string &suffix) {
-    PredictionRequest request{
+void GhostSession::setTriggerDelay(int delayMs) { triggerDelayMs_ = std::max(delayMs, 0); }
+
+void GhostSession::setCacheCapacity(size_t capacity) { cache_.setCapacity(capacity); }
+
+void GhostSession::setStreaming(bool streaming) { streaming_ = streaming; }
+
+PredictionRequest GhostSession::makeRequest(const std::string &prefix,
+                                            const std::string &suffix) const {
+    const auto budget = budget_.decide();
+    return PredictionRequest{
         .prefix = prefix,
         .suffix = suffix,
         .language = language_,
         .mode = mode_,
-        .maxTokens = 8,
-        .latencyBudgetMs = 5000,
+        .maxTokens = budget.maxTokens,
+        .latencyBudgetMs = budget.latencyBudgetMs,
+        .stream = streaming_,
+        .session = contextSession_,
     };
+}
+
+bool GhostSession::onTextChanged(const std::string &prefix, const std::string &suffix,
+                                 UpdateCallback onUpdated) {
+    dropPrediction();
+
+    auto request = makeRequest(prefix, suffix);
+    requestKey_ = contextKey(request);
+    if (const auto *cached = cache_.find(requestKey_)) {
+        if (prefetchKey_ == requestKey_) {
+            ++stats_.prefetchHits;
+        }
+        cancelPrefetch();
+        ++stats_.cacheHits;
+        showPrediction(*cached);
+        return true;
+    }
+    ++stats_.cacheMisses;
+    onUpdated_ = std::move(onUpdated);
+
+    if (prefetchPending_ && prefetchKey_ == requestKey_) {
+        // The prefetch is already on its way; its reply becomes this one.
+        ++stats_.prefetchHits;
+        pending_ = std::move(prefetchPending_);
+        pending_->setKind(PredictionKind::Ghost);
+        pendingBudget_ = prefetchBudget_;
+        pendingSentUs_ = prefetchSentUs_;
+        adoptedPrefetch_ = prefetchGeneration_;
+        prefetchKey_ = 0;
+        streamed_ = std::move(prefetchStreamed_);
+        prefetchStreamed_.clear();
+        ghostText_ = streamed_;
+        return !ghostText_.empty();
+    }
+    cancelPrefetch();
 
-    lastPrediction_ = client_.predict(request);
+    scheduled_ = std::move(request);
+    if (!eventLoop_ || triggerDelayMs_ == 0) {
+        startPrediction();
+        return false;
+    }
+    const auto delayUsec = static_cast<uint64_t>(triggerDelayMs_) * 1000;
+    if (debounceEvent_) {
+        debounceEvent_->setNextInterval(delayUsec);
+        debounceEvent_->setOneShot();
+        return false;
+    }
+    debounceEvent_ = eventLoop_->addTimeEvent(
+        CLOCK_MONOTONIC, fcitx::now(CLOCK_MONOTONIC) + delayUsec, 0,
+        [this](fcitx::EventSourceTime *, uint64_t) {
+            startPrediction();
+            return true;
+        });
+    return false;
+}
+
+void GhostSession::prefetch(const std::string &prefix, const std::string &suffix) {
+    auto request = makeRequest(prefix, suffix);
+    const auto key = contextKey(request);
+    if (key == prefetchKey_ && (prefetchScheduled_ || prefetchPending_)) {
+        return;
+    }
+    cancelPrefetch();
+    if (cache_.find(key)) {
+        return;
+    }
+    prefetchKey_ = key;
+    prefetchScheduled_ = std::move(request);
+
+    if (!eventLoop_ || triggerDelayMs_ == 0) {
+        startPrefetch();
+        return;
+    }
+    const auto delayUsec = static_cast<uint64_t>(triggerDelayMs_) * 1000;
+    if (prefetchEvent_) {
+        prefetchEvent_->setNextInterval(delayUsec);
+        prefetchEvent_->setOneShot();
+        return;
+    }
+    prefetchEvent_ = eventLoop_->addTimeEvent(
+        CLOCK_MONOTONIC, fcitx::now(CLOCK_MONOTONIC) + delayUsec, 0,
+        [this](fcitx::EventSourceTime *, uint64_t) {
+            startPrefetch();
+            return true;
+        });
+}
+
+void GhostSession::noteKeystroke() { budget_.onKeystroke(fcitx::now(CLOCK_MONOTONIC)); }
+
+bool GhostSession::consumeTyped(const std::string &text) {
+    if (text.empty() || text.size() >= ghostText_.size() ||
+        ghostText_.compare(0, text.size(), text) != 0) {
+        return false;
+    }
+    cancelPrefetch();
+    ghostText_.erase(0, text.size());
+    if (lastPrediction_) {
+        lastPrediction_->ghostText = ghostText_;
+    } else if (pending_) {
+        streamConsumed_ += text.size();
+    }
+    ++stats_.typeThroughs;
+    return true;
+}
+
+void GhostSession::startPrediction() {
+    if (!scheduled_) {
+        return;
+    }
+    auto request = std::move(*scheduled_);
+    scheduled_.reset();
+    pendingBudget_ = {request.maxTokens, request.latencyBudgetMs};
+    pendingSentUs_ = fcitx::now(CLOCK_MONOTONIC);
+    pending_ = dispatcher_.submit(
+        this, PredictionKind::Ghost, request,
+        [this](std::optional<PredictionResult> result) { onPrediction(std::move(result)); },
+        [this](const std::string &text) { onGhostDelta(text); });
+}
+
+void GhostSession::startPrefetch() {
+    if (!prefetchScheduled_) {
+        return;
+    }
+    auto request = std::move(*prefetchScheduled_);
+    prefetchScheduled_.reset();
+    ++stats_.prefetches;
+    const auto generation = ++prefetchGeneration_;
+    prefetchBudget_ = {request.maxTokens, request.latencyBudgetMs};
+    prefetchSentUs_ = fcitx::now(CLOCK_MONOTONIC);
+    prefetchPending_ = dispatcher_.submit(
+        this, PredictionKind::Prefetch, request,
+        [this, generation](std::optional<PredictionResult> result) {
+            onPrefetched(generation, std::move(result));
+        },
+        [this, generation](const std::string &text) { onPrefetchDelta(generation, text); });
+}
+
+void GhostSession::onPrediction(std::optional<PredictionResult> result) {
+    auto finished = std::move(pending_);
+    auto onUpdated = std::move(onUpdated_);
+    finishBudget(pendingBudget_, pendingSentUs_, result);
+    if (result) {
+        cache_.insert(requestKey_, *result);
+    }
+    // The final reply is authoritative; whatever was typed through while it
+    // streamed must still match its front, or the ghost no longer fits.
+    if (result && streamConsumed_ > 0) {
+        if (result->ghostText.compare(0, streamConsumed_, streamed_, 0, streamConsumed_) == 0) {
+            result->ghostText.erase(0, streamConsumed_);
+        } else {
+            result.reset();
+        }
+    }
+    streamed_.clear();
+    streamConsumed_ = 0;
+    showPrediction(std::move(result));
+    if (onUpdated) {
+        onUpdated();
+    }
+}
+
+void GhostSession::onGhostDelta(const std::string &text) {
+    streamed_ += text;
+    if (streamed_.size() <= streamConsumed_) {
+        return;
+    }
+    ghostText_.assign(streamed_, streamConsumed_);
+    if (onUpdated_) {
+        onUpdated_();
+    }
+}
+
+void GhostSession::onPrefetched(uint64_t generation, std::optional<PredictionResult> result) {
+    if (generation == adoptedPrefetch_) {
+        adoptedPrefetch_ = 0;
+        onPrediction(std::move(result));
+        return;
+    }
+    auto finished = std::move(prefetchPending_);
+    prefetchStreamed_.clear();
+    finishBudget(prefetchBudget_, prefetchSentUs_, result);
+    if (result) {
+        cache_.insert(prefetchKey_, *result);
+    }
+}
+
+void GhostSession::onPrefetchDelta(uint64_t generation, const std::string &text) {
+    if (generation == adoptedPrefetch_) {
+        onGhostDelta(text);
+    } else if (generation == prefetchGeneration_ && prefetchPending_) {
+        prefetchStreamed_ += text;
+    }
+}
+
+void GhostSession::finishBudget(const BudgetDecision &decision, uint64_t sentUs,
+                                const std::optional<PredictionResult> &result) {
+    budget_.onFinished(decision, sentUs,
+                       result ? std::optional<int>(result->elapsedMs) : std::nullopt,
+                       fcitx::now(CLOCK_MONOTONIC));
+}
+
+void GhostSession::showPrediction(std::optional<PredictionResult> result) {
+    lastPrediction_ = std::move(result);
     if (!lastPrediction_ || lastPrediction_->ghostText.empty()) {
         lastPrediction_.reset();
         ghostText_.clear();
-        return ghostText_;
+    } else {
+        ghostText_ = lastPrediction_->ghostText;
     }
-    ghostText_ = lastPrediction_->ghostText;
-    return ghostText_;
 }
 
 std::string GhostSession::acceptGhost() {
@@ -37,7 +394,40 @@ std::string GhostSession::acceptGhost() {
     return accepted;
 }
 
+GhostStats GhostSession::stats() const {
+    auto stats = stats_;
+    stats.cacheSize = cache_.size();
+    stats.cacheCapacity = cache_.capacity();
+    stats.budget = budget_.stats();
+    return stats;
+}
+
+void GhostSession::focus() { dispatcher_.setFocused(this); }
+
 void GhostSession::clearGhost() {
+    cancelPrefetch();
+    dropPrediction();
+}
+
+void GhostSession::cancelPrefetch() {
+    if (prefetchEvent_) {
+        prefetchEvent_->setEnabled(false);
+    }
+    prefetchScheduled_.reset();
+    prefetchPending_.reset();
+    prefetchStreamed_.clear();
+    prefetchKey_ = 0;
+}
+
+void GhostSession::dropPrediction() {
+    if (debounceEvent_) {
+        debounceEvent_->setEnabled(false);
+    }
+    scheduled_.reset();
+    pending_.reset();
+    streamed_.clear();
+    streamConsumed_ = 0;
+    adoptedPrefetch_ = 0;
     ghostText_.clear();
     lastPrediction_.reset();
 }
@@ -1,30 +1,204 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
+
+#include <fcitx-utils/event.h>
 
 #include "daemon_client.hpp"
+#include "prediction_dispatcher.hpp"
 
 namespace aetherime {
 
+// Bounded LRU of recent predictions keyed by a context hash.
+class PredictionCache {
+public:
+    explicit PredictionCache(size_t capacity) : capacity_(capacity) {}
+
+    void setCapacity(size_t capacity);
+    const PredictionResult *find(uint64_t key);
+    void insert(uint64_t key, PredictionResult result);
+
+    size_t size() const { return index_.size(); }
+    size_t capacity() const { return capacity_; }
+
+private:
+    using Entry = std::pair<uint64_t, PredictionResult>;
+
+    size_t capacity_;
+    std::list<Entry> entries_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+};
+
+struct BudgetDecision {
+    int maxTokens = 8;
+    int latencyBudgetMs = 5000;
+};
+
+struct BudgetStats {
+    BudgetDecision decision;
+    // Smoothed time between keystrokes while typing, and the backend's time per
+    // requested token; 0 until measured.
+    double keyIntervalMs = 0;
+    double msPerToken = 0;
+    bool paused = true;
+    uint64_t replies = 0;
+    uint64_t timeouts = 0;
+};
+
+// Picks max_tokens and the latency budget for each prediction of one input
+// context from its keystrokes and replies. While the user types fast,
+// predictions are kept short enough to arrive before the next key is likely;
+// after a pause they may be longer.
+// The budget covers the chosen tokens at the speed the backend has shown,
+// and a timeout counts as a reply that took longer than its budget. Until
+// the first reply the defaults apply.
+class PredictionBudget {
+public:
+    void onKeystroke(uint64_t nowUs);
+    // How a prediction sent at sentUs with decision ended: the daemon's
+    // elapsed time, or std::nullopt if it failed. Failures before the budget
+    // ran out say nothing about the backend and are ignored.
+    void onFinished(const BudgetDecision &decision, uint64_t sentUs,
+                    std::optional<int> elapsedMs, uint64_t nowUs);
+
+    BudgetDecision decide() const;
+    BudgetStats stats() const;
+
+private:
+    void addSample(double msPerToken);
+
+    uint64_t lastKeyUs_ = 0;
+    double keyIntervalMs_ = 0;
+    bool paused_ = true;
+    double msPerToken_ = 0;
+    uint64_t replies_ = 0;
+    uint64_t timeouts_ = 0;
+};
+
+struct GhostStats {
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t typeThroughs = 0;
+    uint64_t prefetches = 0;
+    uint64_t prefetchHits = 0;
+    size_t cacheSize = 0;
+    size_t cacheCapacity = 0;
+    BudgetStats budget;
+};
+
 class GhostSession {
 public:
-    explicit GhostSession(DaemonClient client);
+    using UpdateCallback = std::function<void()>;
+
+    GhostSession(PredictionDispatcher &dispatcher, fcitx::EventLoop *eventLoop);
+    ~GhostSession();
+
+    GhostSession(const GhostSession &) = delete;
+    GhostSession &operator=(const GhostSession &) = delete;
 
     void setLanguage(Language language);
     void setMode(PredictMode mode);
+    void setTriggerDelay(int delayMs);
+    void setCacheCapacity(size_t capacity);
+    // Asks the daemon for ghost text while it is generated, so the ghost
+    // grows from the first token instead of appearing when the model is done.
+    void setStreaming(bool streaming);
+
+    // Schedules an asynchronous prediction for the new context, superseding
+    // any request still scheduled or in flight. The request is sent once no
+    // further change arrives within the trigger delay, so a burst of edits
+    // costs one prediction. onUpdated runs from the event loop once the ghost
+    // text for this context is known. When streaming, it also runs each time
+    // the ghost grows, before the final reply.
+    //
+    // Returns true instead when ghost text for the same context is available
+    // right away: a cached prediction, or the part of an adopted prefetch
+    // streamed so far, in which case onUpdated still follows.
+    bool onTextChanged(const std::string &prefix, const std::string &suffix,
+                       UpdateCallback onUpdated);
+
+    // Requests the prediction for a context the user is likely to reach
+    // next, such as the one after committing the top candidate, without
+    // touching the current ghost. The request is debounced like edits and
+    // replaces any earlier prefetch; its result lands in the cache, and
+    // onTextChanged() for the same context takes over a reply still in
+    // flight. Any other context, or clearGhost(), discards it.
+    void prefetch(const std::string &prefix, const std::string &suffix);
+
+    // Records a keystroke in this session's input context; the pace of
+    // typing decides how long predictions may be.
+    void noteKeystroke();
+
+    // Trims committed text that the user typed through from the front of the
+    // current ghost. Returns false, leaving the session untouched, unless the
+    // text is a proper prefix of the ghost.
+    bool consumeTyped(const std::string &text);
 
-    std::string onTextChanged(const std::string &prefix, const std::string &suffix);
     std::string acceptGhost();
     void clearGhost();
 
+    // Marks this session's input context as the focused one, so that its
+    // requests go to the daemon ahead of other contexts'.
+    void focus();
+
+    bool pending() const { return scheduled_ || pending_; }
     const std::optional<PredictionResult> &lastPrediction() const { return lastPrediction_; }
     const std::string &ghost() const { return ghostText_; }
+    GhostStats stats() const;
 
 private:
-    DaemonClient client_;
+    PredictionRequest makeRequest(const std::string &prefix, const std::string &suffix) const;
+    void dropPrediction();
+    void cancelPrefetch();
+    void startPrediction();
+    void startPrefetch();
+    void onPrediction(std::optional<PredictionResult> result);
+    void onGhostDelta(const std::string &text);
+    void onPrefetched(uint64_t generation, std::optional<PredictionResult> result);
+    void onPrefetchDelta(uint64_t generation, const std::string &text);
+    void showPrediction(std::optional<PredictionResult> result);
+    void finishBudget(const BudgetDecision &decision, uint64_t sentUs,
+                      const std::optional<PredictionResult> &result);
+
+    PredictionDispatcher &dispatcher_;
+    fcitx::EventLoop *eventLoop_;
+    // Consecutive requests share most of their context, so they go out as
+    // edits against the previous one; see DaemonClient::openSession().
+    uint64_t contextSession_;
     Language language_ = Language::Zh;
     PredictMode mode_ = PredictMode::Fim;
+    int triggerDelayMs_ = 0;
+    bool streaming_ = false;
+    std::unique_ptr<fcitx::EventSourceTime> debounceEvent_;
+    std::optional<PredictionRequest> scheduled_;
+    uint64_t requestKey_ = 0;
+    UpdateCallback onUpdated_;
+    std::unique_ptr<DispatchedPrediction> pending_;
+    BudgetDecision pendingBudget_;
+    uint64_t pendingSentUs_ = 0;
+    // Ghost text streamed for pending_ so far, and how much of it the user
+    // has typed through since.
+    std::string streamed_;
+    size_t streamConsumed_ = 0;
+    std::unique_ptr<fcitx::EventSourceTime> prefetchEvent_;
+    std::optional<PredictionRequest> prefetchScheduled_;
+    uint64_t prefetchKey_ = 0;
+    std::unique_ptr<DispatchedPrediction> prefetchPending_;
+    BudgetDecision prefetchBudget_;
+    uint64_t prefetchSentUs_ = 0;
+    std::string prefetchStreamed_;
+    uint64_t prefetchGeneration_ = 0;
+    // The prefetch onTextChanged() took over as pending_, if any.
+    uint64_t adoptedPrefetch_ = 0;
+    PredictionCache cache_;
+    PredictionBudget budget_;
+    GhostStats stats_;
     std::optional<PredictionResult> lastPrediction_;
     std::string ghostText_;
 };
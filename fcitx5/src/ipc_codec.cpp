@@ -0,0 +1,678 @@
+#include "ipc_codec.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <iterator>
+
+#include "text_scan.hpp"
+
+namespace aetherime {
+namespace {
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+constexpr uint8_t kFramePredict = 0x01;
+constexpr uint8_t kFramePing = 0x02;
+constexpr uint8_t kFrameCancel = 0x03;
+constexpr uint8_t kFramePredictDelta = 0x04;
+constexpr uint8_t kFramePredictReply = 0x81;
+constexpr uint8_t kFramePong = 0x82;
+constexpr uint8_t kFrameGhostDelta = 0x83;
+constexpr uint8_t kFrameError = 0x8f;
+
+constexpr uint8_t kFlagStream = 0x01;
+constexpr uint8_t kFlagSession = 0x02;
+
+constexpr size_t kPredictFixedSize = 16;
+constexpr size_t kPredictDeltaFixedSize = 24;
+constexpr size_t kEditFixedSize = 12;
+constexpr size_t kPredictReplyFixedSize = 16;
+constexpr size_t kErrorFixedSize = 8;
+constexpr size_t kMaxFrameBody = 1 << 20;
+
+void appendLe(std::string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+uint64_t readLe(std::string_view input, size_t offset, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(input[offset + i])) << (8 * i);
+    }
+    return value;
+}
+
+void appendFrameHeader(std::string &out, uint8_t kind, uint64_t id, size_t bodySize,
+                       uint8_t flags = 0) {
+    appendLe(out, bodySize, 4);
+    out.push_back(static_cast<char>(kind));
+    out.push_back(static_cast<char>(flags));
+    appendLe(out, 0, 2);
+    appendLe(out, id, 8);
+}
+
+bool takeSlice(std::string_view body, size_t &offset, size_t size, std::string &out) {
+    if (size > body.size() - offset) {
+        return false;
+    }
+    out.assign(body.data() + offset, size);
+    offset += size;
+    return true;
+}
+
+void appendUtf8(std::string &out, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        out.push_back(static_cast<char>(codepoint));
+    } else if (codepoint < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+        out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    } else if (codepoint < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+}
+
+class JsonReader {
+public:
+    explicit JsonReader(std::string_view input) : input_(input) {}
+
+    bool consume(char expected) {
+        skipSpace();
+        if (pos_ < input_.size() && input_[pos_] == expected) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    char peek() {
+        skipSpace();
+        return pos_ < input_.size() ? input_[pos_] : '\0';
+    }
+
+    // Returns the raw bytes between the quotes. Keys we care about never
+    // contain escapes, so they can be compared without decoding.
+    bool readRawString(std::string_view &out) {
+        if (!consume('"')) {
+            return false;
+        }
+        const auto start = pos_;
+        while ((pos_ = findQuoteOrBackslash(input_, pos_)) < input_.size()) {
+            if (input_[pos_] == '"') {
+                out = input_.substr(start, pos_ - start);
+                ++pos_;
+                return true;
+            }
+            pos_ = std::min(pos_ + 2, input_.size());
+        }
+        return false;
+    }
+
+    // Decodes a string literal into out, or skips it when out is null. Plain
+    // runs between escapes are copied in bulk.
+    bool readString(std::string *out) {
+        if (!consume('"')) {
+            return false;
+        }
+        if (out) {
+            out->clear();
+        }
+        auto runStart = pos_;
+        while ((pos_ = findQuoteOrBackslash(input_, pos_)) < input_.size()) {
+            const char c = input_[pos_];
+            if (out) {
+                out->append(input_.data() + runStart, pos_ - runStart);
+            }
+            ++pos_;
+            if (c == '"') {
+                return true;
+            }
+            if (!readEscape(out)) {
+                return false;
+            }
+            runStart = pos_;
+        }
+        return false;
+    }
+
+    bool readBool(bool &value) {
+        if (peek() == 't') {
+            value = true;
+            return skipLiteral("true");
+        }
+        value = false;
+        return skipLiteral("false");
+    }
+
+    template <typename T>
+    bool readNumber(T &value) {
+        skipSpace();
+        const char *begin = input_.data() + pos_;
+        const char *end = input_.data() + input_.size();
+        auto [next, error] = std::from_chars(begin, end, value);
+        if (error != std::errc()) {
+            return skipNumber();
+        }
+        pos_ += static_cast<size_t>(next - begin);
+        return true;
+    }
+
+    bool skipValue() {
+        switch (peek()) {
+        case '"':
+            return readString(nullptr);
+        case '{':
+            return skipContainer('{', '}');
+        case '[':
+            return skipContainer('[', ']');
+        case 't':
+            return skipLiteral("true");
+        case 'f':
+            return skipLiteral("false");
+        case 'n':
+            return skipLiteral("null");
+        default:
+            return skipNumber();
+        }
+    }
+
+private:
+    void skipSpace() {
+        while (pos_ < input_.size() &&
+               (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' ||
+                input_[pos_] == '\r')) {
+            ++pos_;
+        }
+    }
+
+    bool readHex4(uint32_t &value) {
+        if (pos_ + 4 > input_.size()) {
+            return false;
+        }
+        value = 0;
+        for (size_t i = 0; i < 4; ++i) {
+            const char c = input_[pos_ + i];
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= static_cast<uint32_t>(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                value |= static_cast<uint32_t>(c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                value |= static_cast<uint32_t>(c - 'A' + 10);
+            } else {
+                return false;
+            }
+        }
+        pos_ += 4;
+        return true;
+    }
+
+    bool readEscape(std::string *out) {
+        if (pos_ >= input_.size()) {
+            return false;
+        }
+        const char c = input_[pos_++];
+        char decoded = 0;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            decoded = c;
+            break;
+        case 'b':
+            decoded = '\b';
+            break;
+        case 'f':
+            decoded = '\f';
+            break;
+        case 'n':
+            decoded = '\n';
+            break;
+        case 'r':
+            decoded = '\r';
+            break;
+        case 't':
+            decoded = '\t';
+            break;
+        case 'u':
+            return readUnicodeEscape(out);
+        default:
+            return false;
+        }
+        if (out) {
+            out->push_back(decoded);
+        }
+        return true;
+    }
+
+    bool readUnicodeEscape(std::string *out) {
+        uint32_t codepoint = 0;
+        if (!readHex4(codepoint)) {
+            return false;
+        }
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+            uint32_t low = 0;
+            if (input_.substr(pos_, 2) != "\\u") {
+                return false;
+            }
+            pos_ += 2;
+            if (!readHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+                return false;
+            }
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+        } else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+            return false;
+        }
+        if (out) {
+            appendUtf8(*out, codepoint);
+        }
+        return true;
+    }
+
+    bool skipNumber() {
+        skipSpace();
+        const auto start = pos_;
+        while (pos_ < input_.size()) {
+            const char c = input_[pos_];
+            if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' ||
+                c == 'E') {
+                ++pos_;
+                continue;
+            }
+            break;
+        }
+        return pos_ > start;
+    }
+
+    bool skipLiteral(std::string_view literal) {
+        if (input_.substr(pos_, literal.size()) != literal) {
+            return false;
+        }
+        pos_ += literal.size();
+        return true;
+    }
+
+    bool skipContainer(char open, char close) {
+        if (!consume(open)) {
+            return false;
+        }
+        if (consume(close)) {
+            return true;
+        }
+        while (true) {
+            if (open == '{') {
+                std::string_view key;
+                if (!readRawString(key) || !consume(':')) {
+                    return false;
+                }
+            }
+            if (!skipValue()) {
+                return false;
+            }
+            if (consume(close)) {
+                return true;
+            }
+            if (!consume(',')) {
+                return false;
+            }
+        }
+    }
+
+    std::string_view input_;
+    size_t pos_ = 0;
+};
+
+ReplyType replyTypeFromName(std::string_view name) {
+    if (name == "predict") {
+        return ReplyType::Predict;
+    }
+    if (name == "pong") {
+        return ReplyType::Pong;
+    }
+    if (name == "ghost_delta") {
+        return ReplyType::GhostDelta;
+    }
+    if (name == "error") {
+        return ReplyType::Error;
+    }
+    return ReplyType::Unknown;
+}
+
+bool readStringArray(JsonReader &reader, std::vector<std::string> &out) {
+    out.clear();
+    if (!reader.consume('[')) {
+        return false;
+    }
+    if (reader.consume(']')) {
+        return true;
+    }
+    while (true) {
+        out.emplace_back();
+        if (!reader.readString(&out.back())) {
+            return false;
+        }
+        if (reader.consume(']')) {
+            return true;
+        }
+        if (!reader.consume(',')) {
+            return false;
+        }
+    }
+}
+
+void appendPredictFields(std::string &out, const PredictionRequest &request,
+                         const SessionContext *session) {
+    if (session && session->edits) {
+        out += R"(,"session":)";
+        out += std::to_string(session->id);
+        out += R"(,"cursor":)";
+        out += std::to_string(session->cursor);
+        out += R"(,"edits":[)";
+        for (const auto &edit : *session->edits) {
+            if (&edit != &session->edits->front()) {
+                out.push_back(',');
+            }
+            out += R"({"at":)";
+            out += std::to_string(edit.at);
+            out += R"(,"delete":)";
+            out += std::to_string(edit.erase);
+            if (!edit.insert.empty()) {
+                out += R"(,"insert":)";
+                appendJsonString(out, edit.insert);
+            }
+            out.push_back('}');
+        }
+        out.push_back(']');
+    } else {
+        out += R"(,"prefix":)";
+        appendJsonString(out, request.prefix);
+        out += R"(,"suffix":)";
+        appendJsonString(out, request.suffix);
+        if (session) {
+            out += R"(,"session":)";
+            out += std::to_string(session->id);
+        }
+    }
+    out += request.language == Language::Zh ? R"(,"language":"zh")" : R"(,"language":"en")";
+    out += request.mode == PredictMode::Fim ? R"(,"mode":"fim")" : R"(,"mode":"next")";
+    out += R"(,"max_tokens":)";
+    out += std::to_string(request.maxTokens);
+    out += R"(,"latency_budget_ms":)";
+    out += std::to_string(request.latencyBudgetMs);
+    if (request.stream) {
+        out += R"(,"stream":true)";
+    }
+}
+
+// The block both predict frame layouts share.
+void appendPredictOptions(std::string &out, const PredictionRequest &request) {
+    appendLe(out, static_cast<uint64_t>(std::max(request.maxTokens, 0)), 2);
+    out.push_back(request.language == Language::Zh ? '\0' : '\1');
+    out.push_back(request.mode == PredictMode::Next ? '\0' : '\1');
+    appendLe(out, static_cast<uint64_t>(std::max(request.latencyBudgetMs, 0)), 4);
+}
+
+void appendPredictDeltaFrame(std::string &out, uint64_t id, const PredictionRequest &request,
+                             const SessionContext &session) {
+    size_t bodySize = kPredictDeltaFixedSize;
+    for (const auto &edit : *session.edits) {
+        bodySize += kEditFixedSize + edit.insert.size();
+    }
+    out.reserve(out.size() + kFrameHeaderSize + bodySize);
+    appendFrameHeader(out, kFramePredictDelta, id, bodySize, request.stream ? kFlagStream : 0);
+    appendLe(out, session.id, 8);
+    appendLe(out, session.cursor, 4);
+    appendPredictOptions(out, request);
+    appendLe(out, session.edits->size(), 4);
+    for (const auto &edit : *session.edits) {
+        appendLe(out, edit.at, 4);
+        appendLe(out, edit.erase, 4);
+        appendLe(out, edit.insert.size(), 4);
+        out += edit.insert;
+    }
+}
+
+} // namespace
+
+void appendJsonString(std::string &out, std::string_view value) {
+    out.push_back('"');
+    size_t runStart = 0;
+    for (size_t i = findJsonEscape(value); i < value.size(); i = findJsonEscape(value, i + 1)) {
+        const auto c = static_cast<unsigned char>(value[i]);
+        out.append(value.data() + runStart, i - runStart);
+        runStart = i + 1;
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            out += "\\u00";
+            out.push_back(kHexDigits[c >> 4]);
+            out.push_back(kHexDigits[c & 0xF]);
+            break;
+        }
+    }
+    out.append(value.data() + runStart, value.size() - runStart);
+    out.push_back('"');
+}
+
+std::string encodePingRequest(uint64_t id, bool offerBinary, bool offerShm) {
+    std::string out = R"({"id":")" + std::to_string(id) + R"(","type":"ping")";
+    if (offerBinary || offerShm) {
+        out += R"(,"protocols":[)";
+        if (offerShm) {
+            appendJsonString(out, kProtocolShmRingV1);
+        }
+        if (offerBinary) {
+            if (offerShm) {
+                out.push_back(',');
+            }
+            appendJsonString(out, kProtocolBinaryV2);
+        }
+        out.push_back(']');
+    }
+    out.push_back('}');
+    return out;
+}
+
+std::string encodePredictRequest(uint64_t id, const PredictionRequest &request,
+                                 const SessionContext *session) {
+    std::string out;
+    out.reserve(192 + request.prefix.size() + request.suffix.size());
+    out += R"({"id":")";
+    out += std::to_string(id);
+    out += R"(","type":"predict")";
+    appendPredictFields(out, request, session);
+    out.push_back('}');
+    return out;
+}
+
+std::string encodeCancelRequest(uint64_t id) {
+    return R"({"type":"cancel","ids":[")" + std::to_string(id) + R"("]})";
+}
+
+bool decodeReply(std::string_view line, DaemonReply &reply) {
+    JsonReader reader(line);
+    if (!reader.consume('{')) {
+        return false;
+    }
+    if (reader.consume('}')) {
+        return true;
+    }
+
+    auto &prediction = reply.prediction;
+    while (true) {
+        std::string_view key;
+        if (!reader.readRawString(key) || !reader.consume(':')) {
+            return false;
+        }
+
+        bool ok = true;
+        if (key == "id") {
+            std::string_view id;
+            ok = reader.readRawString(id);
+            auto [next, error] = std::from_chars(id.data(), id.data() + id.size(), reply.id);
+            reply.hasId = ok && error == std::errc() && next == id.data() + id.size();
+        } else if (key == "type") {
+            std::string_view type;
+            ok = reader.readRawString(type);
+            reply.type = replyTypeFromName(type);
+        } else if (key == "ghost_text") {
+            ok = reader.readString(&prediction.ghostText);
+        } else if (key == "candidates") {
+            ok = readStringArray(reader, prediction.candidates);
+        } else if (key == "confidence") {
+            ok = reader.readNumber(prediction.confidence);
+        } else if (key == "source") {
+            ok = reader.readString(&prediction.source);
+        } else if (key == "elapsed_ms") {
+            ok = reader.readNumber(prediction.elapsedMs);
+        } else if (key == "code") {
+            ok = reader.readString(&reply.errorCode);
+        } else if (key == "protocol") {
+            ok = reader.readString(&reply.protocol);
+        } else if (key == "sessions") {
+            ok = reader.readBool(reply.sessions);
+        } else if (key == "text") {
+            ok = reader.readString(&reply.ghostDelta);
+        } else {
+            ok = reader.skipValue();
+        }
+        if (!ok) {
+            return false;
+        }
+
+        if (reader.consume('}')) {
+            return true;
+        }
+        if (!reader.consume(',')) {
+            return false;
+        }
+    }
+}
+
+void appendPingFrame(std::string &out, uint64_t id) {
+    appendFrameHeader(out, kFramePing, id, 0);
+}
+
+void appendCancelFrame(std::string &out, uint64_t id) {
+    appendFrameHeader(out, kFrameCancel, 0, sizeof(id));
+    appendLe(out, id, sizeof(id));
+}
+
+void appendPredictFrame(std::string &out, uint64_t id, const PredictionRequest &request,
+                        const SessionContext *session) {
+    if (session && session->edits) {
+        appendPredictDeltaFrame(out, id, request, *session);
+        return;
+    }
+    const size_t fixedSize = kPredictFixedSize + (session ? sizeof(session->id) : 0);
+    const size_t bodySize = fixedSize + request.prefix.size() + request.suffix.size();
+    out.reserve(out.size() + kFrameHeaderSize + bodySize);
+    const uint8_t flags = (request.stream ? kFlagStream : 0) | (session ? kFlagSession : 0);
+    appendFrameHeader(out, kFramePredict, id, bodySize, flags);
+    appendLe(out, request.prefix.size(), 4);
+    appendLe(out, request.suffix.size(), 4);
+    appendPredictOptions(out, request);
+    if (session) {
+        appendLe(out, session->id, 8);
+    }
+    out += request.prefix;
+    out += request.suffix;
+}
+
+FrameStatus decodeFrame(std::string_view input, DaemonReply &reply, size_t &consumed) {
+    if (input.size() < kFrameHeaderSize) {
+        return FrameStatus::Incomplete;
+    }
+    const auto bodySize = static_cast<size_t>(readLe(input, 0, 4));
+    if (bodySize > kMaxFrameBody) {
+        return FrameStatus::Invalid;
+    }
+    if (input.size() - kFrameHeaderSize < bodySize) {
+        return FrameStatus::Incomplete;
+    }
+    const auto kind = static_cast<uint8_t>(input[4]);
+    const auto body = input.substr(kFrameHeaderSize, bodySize);
+    reply.id = readLe(input, 8, 8);
+    reply.hasId = true;
+    consumed = kFrameHeaderSize + bodySize;
+
+    switch (kind) {
+    case kFramePong:
+        reply.type = ReplyType::Pong;
+        return FrameStatus::Complete;
+    case kFrameGhostDelta:
+        reply.type = ReplyType::GhostDelta;
+        reply.ghostDelta.assign(body);
+        return FrameStatus::Complete;
+    case kFrameError: {
+        if (body.size() < kErrorFixedSize) {
+            return FrameStatus::Invalid;
+        }
+        static constexpr const char *kErrorCodes[] = {"invalid_request", "timeout", "internal"};
+        const auto code = static_cast<uint8_t>(body[0]);
+        reply.type = ReplyType::Error;
+        reply.errorCode = code < std::size(kErrorCodes) ? kErrorCodes[code] : "unknown";
+        return FrameStatus::Complete;
+    }
+    case kFramePredictReply: {
+        if (body.size() < kPredictReplyFixedSize) {
+            return FrameStatus::Invalid;
+        }
+        static constexpr const char *kSources[] = {"local_fim", "local_next", "cloud"};
+        auto &prediction = reply.prediction;
+        const auto confidenceBits = static_cast<uint32_t>(readLe(body, 0, 4));
+        std::memcpy(&prediction.confidence, &confidenceBits, sizeof(prediction.confidence));
+        prediction.elapsedMs = static_cast<int>(readLe(body, 4, 4));
+        const auto source = static_cast<uint8_t>(body[8]);
+        prediction.source = source < std::size(kSources) ? kSources[source] : "";
+        const auto candidateCount = static_cast<size_t>(readLe(body, 10, 2));
+        const auto ghostSize = static_cast<size_t>(readLe(body, 12, 4));
+
+        size_t offset = kPredictReplyFixedSize;
+        if (!takeSlice(body, offset, ghostSize, prediction.ghostText)) {
+            return FrameStatus::Invalid;
+        }
+        prediction.candidates.resize(candidateCount);
+        for (auto &candidate : prediction.candidates) {
+            if (body.size() - offset < 4) {
+                return FrameStatus::Invalid;
+            }
+            const auto size = static_cast<size_t>(readLe(body, offset, 4));
+            offset += 4;
+            if (!takeSlice(body, offset, size, candidate)) {
+                return FrameStatus::Invalid;
+            }
+        }
+        reply.type = ReplyType::Predict;
+        return FrameStatus::Complete;
+    }
+    default:
+        reply.type = ReplyType::Unknown;
+        return FrameStatus::Complete;
+    }
+}
+
+} // namespace aetherime
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "context_delta.hpp"
+#include "daemon_client.hpp"
+
+namespace aetherime {
+
+inline constexpr std::string_view kProtocolBinaryV2 = "binary-v2";
+inline constexpr std::string_view kProtocolShmRingV1 = "shm-ring-v1";
+inline constexpr size_t kFrameHeaderSize = 16;
+
+enum class FrameStatus {
+    Incomplete,
+    Complete,
+    Invalid,
+};
+
+enum class ReplyType {
+    Unknown,
+    Pong,
+    Predict,
+    GhostDelta,
+    Error,
+};
+
+struct DaemonReply {
+    uint64_t id = 0;
+    bool hasId = false;
+    ReplyType type = ReplyType::Unknown;
+    std::string errorCode;
+    std::string protocol;
+    // Set on a pong from a daemon that keeps context sessions.
+    bool sessions = false;
+    PredictionResult prediction;
+    // Text to append to the ghost, for GhostDelta replies.
+    std::string ghostDelta;
+};
+
+// Appends value as a quoted JSON string literal.
+void appendJsonString(std::string &out, std::string_view value);
+
+// JSON (v1) requests, without the trailing newline. A ping that offers
+// binary framing asks the daemon to switch the connection to v2.
+// A ping offering shm-ring-v1 must carry the ring descriptors; see
+// docs/IPC.md.
+std::string encodePingRequest(uint64_t id, bool offerBinary = false, bool offerShm = false);
+// With a session, a predict request carries either the session's edits or
+// the full context tagged with the session id.
+std::string encodePredictRequest(uint64_t id, const PredictionRequest &request,
+                                 const SessionContext *session = nullptr);
+std::string encodeCancelRequest(uint64_t id);
+
+// Decodes one newline-free reply in a single pass over the input. Only the
+// strings copied into reply allocate; unknown fields are skipped.
+bool decodeReply(std::string_view line, DaemonReply &reply);
+
+// Binary (v2) frames: a fixed 16-byte header followed by a fixed-layout body
+// and raw UTF-8 slices. See docs/IPC.md for the layout.
+void appendPingFrame(std::string &out, uint64_t id);
+void appendPredictFrame(std::string &out, uint64_t id, const PredictionRequest &request,
+                        const SessionContext *session = nullptr);
+void appendCancelFrame(std::string &out, uint64_t id);
+
+// Decodes the frame at the start of input. consumed is set when a complete
+// frame was read.
+FrameStatus decodeFrame(std::string_view input, DaemonReply &reply, size_t &consumed);
+
+} // namespace aetherime
@@ -0,0 +1,133 @@
+#include "latency_trace.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+
+#include <unistd.h>
+
+namespace aetherime {
+
+namespace {
+
+constexpr const char *kStageNames[] = {
+    "key_event",      "lexical_candidates", "pinyin_query",
+    "predict_context", "ghost_trigger",     "update_ui",
+    "request_encode", "daemon_round_trip",  "reply_decode",
+};
+static_assert(std::size(kStageNames) == static_cast<size_t>(LatencyStage::Count));
+
+double toMicros(uint64_t ns) { return static_cast<double>(ns) / 1000.0; }
+
+} // namespace
+
+const char *latencyStageName(LatencyStage stage) {
+    return kStageNames[static_cast<size_t>(stage)];
+}
+
+size_t LatencyHistogram::bucketFor(uint64_t ns) {
+    constexpr uint64_t kLinear = 1ULL << kSubBucketBits;
+    if (ns < kLinear) {
+        return static_cast<size_t>(ns);
+    }
+    const int exponent = std::min(63 - __builtin_clzll(ns), kMaxExponent);
+    const auto subBucket =
+        std::min<uint64_t>(ns >> (exponent - kSubBucketBits), 2 * kLinear - 1) - kLinear;
+    return (static_cast<size_t>(exponent - kSubBucketBits + 1) << kSubBucketBits) +
+           static_cast<size_t>(subBucket);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucket) {
+    constexpr size_t kLinear = size_t{1} << kSubBucketBits;
+    if (bucket < kLinear) {
+        return bucket;
+    }
+    const int exponent = static_cast<int>(bucket >> kSubBucketBits) + kSubBucketBits - 1;
+    const uint64_t subBucket = kLinear + (bucket & (kLinear - 1));
+    return ((subBucket + 1) << (exponent - kSubBucketBits)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    buckets_[bucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+    auto max = max_.load(std::memory_order_relaxed);
+    while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+LatencySummary LatencyHistogram::summary() const {
+    std::array<uint64_t, kBucketCount> counts;
+    LatencySummary summary;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        summary.count += counts[i];
+    }
+    if (summary.count == 0) {
+        return summary;
+    }
+    summary.maxNs = max_.load(std::memory_order_relaxed);
+
+    // Percentiles report the bucket's upper bound, never above the maximum.
+    const auto percentile = [&](uint64_t perMille) {
+        const uint64_t rank = std::max<uint64_t>(1, (summary.count * perMille + 999) / 1000);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucketUpperBound(i), summary.maxNs);
+            }
+        }
+        return summary.maxNs;
+    };
+    summary.p50Ns = percentile(500);
+    summary.p99Ns = percentile(990);
+    return summary;
+}
+
+std::string LatencyTracer::report() const {
+    std::string out = "# stage count p50_us p99_us max_us\n";
+    char line[128];
+    for (size_t i = 0; i < histograms_.size(); ++i) {
+        const auto summary = histograms_[i].summary();
+        if (summary.count == 0) {
+            continue;
+        }
+        std::snprintf(line, sizeof(line), "%s %llu %.1f %.1f %.1f\n", kStageNames[i],
+                      static_cast<unsigned long long>(summary.count), toMicros(summary.p50Ns),
+                      toMicros(summary.p99Ns), toMicros(summary.maxNs));
+        out += line;
+    }
+    return out;
+}
+
+bool LatencyTracer::writeReport(const std::string &path, const std::string &extra) const {
+    // mkstemp() creates a new file, mode 0600, so a link planted at a
+    // predictable name cannot redirect the write.
+    std::string temporary = path + ".XXXXXX";
+    const int fd = ::mkstemp(temporary.data());
+    if (fd < 0) {
+        return false;
+    }
+    const std::string content = report() + extra;
+    size_t written = 0;
+    while (written < content.size()) {
+        const auto result = ::write(fd, content.data() + written, content.size() - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    const bool complete = written == content.size();
+    if (::close(fd) != 0 || !complete ||
+        std::rename(temporary.c_str(), path.c_str()) != 0) {
+        ::unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace aetherime
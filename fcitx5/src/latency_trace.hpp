@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace aetherime {
+
+// Stages of a keystroke and of the prediction round trip it may start.
+enum class LatencyStage {
+    KeyEvent,
+    LexicalCandidates,
+    PinyinQuery,
+    PredictContext,
+    GhostTrigger,
+    UpdateUI,
+    RequestEncode,
+    DaemonRoundTrip,
+    ReplyDecode,
+    Count,
+};
+
+const char *latencyStageName(LatencyStage stage);
+
+struct LatencySummary {
+    uint64_t count = 0;
+    uint64_t p50Ns = 0;
+    uint64_t p99Ns = 0;
+    uint64_t maxNs = 0;
+};
+
+// Log-linear histogram of nanosecond durations: 16 linear sub-buckets per
+// power of two, so any recorded value is reported within 1/16 of itself.
+// Recording is a few relaxed atomic operations and never allocates.
+class LatencyHistogram {
+public:
+    void record(uint64_t ns);
+    LatencySummary summary() const;
+
+private:
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int kMaxExponent = 40; // about 18 minutes
+    static constexpr size_t kBucketCount =
+        (kMaxExponent - kSubBucketBits + 2) << kSubBucketBits;
+
+    static size_t bucketFor(uint64_t ns);
+    static uint64_t bucketUpperBound(size_t bucket);
+
+    std::array<std::atomic<uint64_t>, kBucketCount> buckets_{};
+    std::atomic<uint64_t> max_{0};
+};
+
+class LatencyTracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void record(LatencyStage stage, uint64_t ns) {
+        histograms_[static_cast<size_t>(stage)].record(ns);
+    }
+    void recordSince(LatencyStage stage, Clock::time_point start) {
+        const auto elapsed = Clock::now() - start;
+        record(stage, static_cast<uint64_t>(
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+    LatencySummary summary(LatencyStage stage) const {
+        return histograms_[static_cast<size_t>(stage)].summary();
+    }
+
+    // One line per stage that has samples: name, count, p50, p99 and max in
+    // microseconds.
+    std::string report() const;
+    // Replaces path with the report followed by extra, going through a new
+    // private temporary file next to it so that readers never see a partial
+    // one.
+    bool writeReport(const std::string &path, const std::string &extra = {}) const;
+
+private:
+    std::array<LatencyHistogram, static_cast<size_t>(LatencyStage::Count)> histograms_;
+};
+
+// Records the time from construction to destruction. A null tracer turns
+// the span into a no-op.
+class LatencySpan {
+public:
+    LatencySpan(LatencyTracer *tracer, LatencyStage stage)
+        : tracer_(tracer),
+          stage_(stage),
+          start_(tracer ? LatencyTracer::Clock::now() : LatencyTracer::Clock::time_point{}) {}
+    ~LatencySpan() {
+        if (tracer_) {
+            tracer_->recordSince(stage_, start_);
+        }
+    }
+
+    LatencySpan(const LatencySpan &) = delete;
+    LatencySpan &operator=(const LatencySpan &) = delete;
+
+private:
+    LatencyTracer *tracer_;
+    LatencyStage stage_;
+    LatencyTracer::Clock::time_point start_;
+};
+
+} // namespace aetherime
@@ -0,0 +1,391 @@
+#include "lexicon.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace aetherime {
+
+// All sections are arrays of fixed-size little-endian records at 4-byte
+// aligned offsets, so the mapping is used in place on little-endian hosts.
+struct MappedLexicon::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t topK;
+    uint32_t nodeCount;
+    uint32_t edgeCount;
+    uint32_t entryCount;
+    uint32_t rankCount;
+    uint32_t poolSize;
+    uint32_t nodesOffset;
+    uint32_t edgesOffset;
+    uint32_t entriesOffset;
+    uint32_t ranksOffset;
+    uint32_t poolOffset;
+    uint32_t reserved[2];
+};
+
+// Both rank ranges index the entry table, best first: the node's own entries
+// and the best entries of its whole subtree. Ranges are shared between nodes
+// whenever they are identical, which covers most single-child chains.
+struct MappedLexicon::Node {
+    uint32_t firstEdge;
+    uint32_t exactBegin;
+    uint32_t topBegin;
+    uint16_t edgeCount;
+    uint16_t exactCount;
+    uint16_t topCount;
+    uint16_t reserved;
+};
+
+namespace {
+
+constexpr char kMagic[8] = {'A', 'E', 'T', 'H', 'L', 'E', 'X', '\0'};
+constexpr uint32_t kVersion = 1;
+
+struct Edge {
+    uint8_t label;
+    uint8_t reserved[3];
+    uint32_t target;
+};
+
+struct Entry {
+    uint32_t textOffset;
+    uint32_t textLength;
+    uint32_t frequency;
+};
+
+template <typename T>
+const T *section(const void *data, uint32_t offset) {
+    return reinterpret_cast<const T *>(static_cast<const char *>(data) + offset);
+}
+
+bool sectionFits(size_t fileSize, uint32_t offset, uint64_t count, size_t recordSize) {
+    return offset % 4 == 0 && offset <= fileSize && count * recordSize <= fileSize - offset;
+}
+
+} // namespace
+
+std::unique_ptr<MappedLexicon> MappedLexicon::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info {};
+    if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+        close(fd);
+        return nullptr;
+    }
+    const auto size = static_cast<size_t>(info.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+
+    const auto *header = static_cast<const Header *>(data);
+    if (std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kVersion ||
+        !sectionFits(size, header->nodesOffset, header->nodeCount, sizeof(Node)) ||
+        !sectionFits(size, header->edgesOffset, header->edgeCount, sizeof(Edge)) ||
+        !sectionFits(size, header->entriesOffset, header->entryCount, sizeof(Entry)) ||
+        !sectionFits(size, header->ranksOffset, header->rankCount, sizeof(uint32_t)) ||
+        !sectionFits(size, header->poolOffset, header->poolSize, 1) || header->nodeCount == 0) {
+        munmap(data, size);
+        return nullptr;
+    }
+    return std::unique_ptr<MappedLexicon>(new MappedLexicon(data, size));
+}
+
+MappedLexicon::MappedLexicon(void *data, size_t size)
+    : data_(data), size_(size), header_(static_cast<const Header *>(data)) {}
+
+MappedLexicon::~MappedLexicon() { munmap(data_, size_); }
+
+size_t MappedLexicon::entryCount() const { return header_->entryCount; }
+
+size_t MappedLexicon::topK() const { return header_->topK; }
+
+const MappedLexicon::Node &MappedLexicon::node(LexiconCursor cursor) const {
+    return section<Node>(data_, header_->nodesOffset)[cursor.node];
+}
+
+bool MappedLexicon::advance(LexiconCursor &cursor, unsigned char label) const {
+    const auto &current = node(cursor);
+    if (static_cast<uint64_t>(current.firstEdge) + current.edgeCount > header_->edgeCount) {
+        return false;
+    }
+    const auto *begin = section<Edge>(data_, header_->edgesOffset) + current.firstEdge;
+    const auto *end = begin + current.edgeCount;
+    const auto *edge = std::lower_bound(
+        begin, end, label, [](const Edge &edge, unsigned char value) { return edge.label < value; });
+    if (edge == end || edge->label != label || edge->target >= header_->nodeCount) {
+        return false;
+    }
+    cursor.node = edge->target;
+    return true;
+}
+
+bool MappedLexicon::find(std::string_view key, LexiconCursor &cursor) const {
+    for (unsigned char label : key) {
+        if (!advance(cursor, label)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t MappedLexicon::collect(uint32_t rankBegin, uint32_t rankCount, LexiconCandidate *out,
+                              size_t limit) const {
+    if (static_cast<uint64_t>(rankBegin) + rankCount > header_->rankCount) {
+        return 0;
+    }
+    const auto *ranks = section<uint32_t>(data_, header_->ranksOffset) + rankBegin;
+    const auto *entries = section<Entry>(data_, header_->entriesOffset);
+    const auto *pool = section<char>(data_, header_->poolOffset);
+    size_t count = 0;
+    for (uint32_t i = 0; i < rankCount && count < limit; ++i) {
+        if (ranks[i] >= header_->entryCount) {
+            continue;
+        }
+        const auto &entry = entries[ranks[i]];
+        if (static_cast<uint64_t>(entry.textOffset) + entry.textLength > header_->poolSize) {
+            continue;
+        }
+        out[count++] = {std::string_view(pool + entry.textOffset, entry.textLength),
+                        entry.frequency};
+    }
+    return count;
+}
+
+size_t MappedLexicon::exact(std::string_view key, LexiconCandidate *out, size_t limit) const {
+    LexiconCursor cursor;
+    return find(key, cursor) ? exact(cursor, out, limit) : 0;
+}
+
+size_t MappedLexicon::complete(std::string_view prefix, LexiconCandidate *out,
+                               size_t limit) const {
+    LexiconCursor cursor;
+    return find(prefix, cursor) ? complete(cursor, out, limit) : 0;
+}
+
+size_t MappedLexicon::exact(LexiconCursor cursor, LexiconCandidate *out, size_t limit) const {
+    const auto &current = node(cursor);
+    return collect(current.exactBegin, current.exactCount, out, limit);
+}
+
+size_t MappedLexicon::complete(LexiconCursor cursor, LexiconCandidate *out, size_t limit) const {
+    const auto &current = node(cursor);
+    return collect(current.topBegin, current.topCount, out, limit);
+}
+
+PrefixCompleter::PrefixCompleter(const MappedLexicon *lexicon) : lexicon_(lexicon) {}
+
+LexiconMatches PrefixCompleter::complete(std::string_view prefix) {
+    if (!lexicon_ || prefix.empty()) {
+        return {};
+    }
+    if (steps_.empty()) {
+        auto &root = steps_.emplace_back();
+        root.count = lexicon_->complete(root.cursor, root.results.data(), kMaxResults);
+    }
+
+    size_t common = 0;
+    while (common < path_.size() && common < prefix.size() && path_[common] == prefix[common]) {
+        ++common;
+    }
+    path_.resize(common);
+    steps_.resize(common + 1);
+
+    while (path_.size() < prefix.size()) {
+        auto cursor = steps_.back().cursor;
+        const auto label = static_cast<unsigned char>(prefix[path_.size()]);
+        if (!lexicon_->advance(cursor, label)) {
+            return {};
+        }
+        path_.push_back(prefix[path_.size()]);
+        auto &step = steps_.emplace_back();
+        step.cursor = cursor;
+        step.count = lexicon_->complete(cursor, step.results.data(), kMaxResults);
+    }
+    const auto &step = steps_.back();
+    return {step.results.data(), step.count};
+}
+
+void PrefixCompleter::reset() {
+    path_.clear();
+    steps_.clear();
+}
+
+namespace {
+
+struct BuildNode {
+    std::map<unsigned char, uint32_t> children;
+    std::vector<uint32_t> exact;
+    std::vector<uint32_t> top;
+};
+
+template <typename T>
+void appendRecords(std::string &out, const std::vector<T> &records) {
+    out.append(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(T));
+}
+
+} // namespace
+
+bool writeLexicon(const std::string &path, std::vector<LexiconSourceEntry> entries,
+                  uint32_t topK) {
+    {
+        std::map<std::pair<std::string, std::string>, size_t> seen;
+        std::vector<LexiconSourceEntry> unique;
+        unique.reserve(entries.size());
+        for (auto &entry : entries) {
+            auto [iterator, inserted] = seen.emplace(std::make_pair(entry.key, entry.text), unique.size());
+            if (inserted) {
+                unique.push_back(std::move(entry));
+            } else {
+                auto &existing = unique[iterator->second].frequency;
+                existing = std::max(existing, entry.frequency);
+            }
+        }
+        entries = std::move(unique);
+    }
+
+    // Higher frequency first; ties keep source order so builds are stable.
+    auto better = [&entries](uint32_t lhs, uint32_t rhs) {
+        if (entries[lhs].frequency != entries[rhs].frequency) {
+            return entries[lhs].frequency > entries[rhs].frequency;
+        }
+        return lhs < rhs;
+    };
+
+    std::vector<BuildNode> trie(1);
+    for (uint32_t index = 0; index < entries.size(); ++index) {
+        uint32_t node = 0;
+        for (unsigned char label : entries[index].key) {
+            auto iterator = trie[node].children.find(label);
+            if (iterator == trie[node].children.end()) {
+                iterator = trie[node].children.emplace(label, trie.size()).first;
+                trie.emplace_back();
+            }
+            node = iterator->second;
+        }
+        trie[node].exact.push_back(index);
+    }
+
+    // Children are always created after their parent, so a reverse sweep
+    // sees every subtree before the node that owns it.
+    for (auto node = trie.size(); node-- > 0;) {
+        auto &current = trie[node];
+        std::sort(current.exact.begin(), current.exact.end(), better);
+        current.exact.resize(std::min<size_t>(current.exact.size(), UINT16_MAX));
+        current.top = current.exact;
+        for (const auto &[label, child] : current.children) {
+            const auto &childTop = trie[child].top;
+            current.top.insert(current.top.end(), childTop.begin(), childTop.end());
+        }
+        std::sort(current.top.begin(), current.top.end(), better);
+        current.top.resize(std::min<size_t>(current.top.size(), topK));
+    }
+
+    // Breadth-first numbering keeps each node's edges contiguous.
+    std::vector<uint32_t> order{0};
+    std::vector<uint32_t> renumbered(trie.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        renumbered[order[i]] = static_cast<uint32_t>(i);
+        for (const auto &[label, child] : trie[order[i]].children) {
+            order.push_back(child);
+        }
+    }
+
+    // Ranges are emitted children first, so a node whose best entries are
+    // exactly those of one child points at the child's range.
+    std::vector<uint32_t> ranks;
+    std::vector<uint32_t> topBegin(trie.size());
+    std::vector<uint32_t> exactBegin(trie.size());
+    for (auto position = order.size(); position-- > 0;) {
+        const auto &current = trie[order[position]];
+        const auto shared = std::find_if(
+            current.children.begin(), current.children.end(),
+            [&trie, &current](const auto &child) { return trie[child.second].top == current.top; });
+        if (shared != current.children.end()) {
+            topBegin[order[position]] = topBegin[shared->second];
+        } else {
+            topBegin[order[position]] = static_cast<uint32_t>(ranks.size());
+            ranks.insert(ranks.end(), current.top.begin(), current.top.end());
+        }
+        if (current.exact.size() <= current.top.size() &&
+            std::equal(current.exact.begin(), current.exact.end(), current.top.begin())) {
+            exactBegin[order[position]] = topBegin[order[position]];
+        } else {
+            exactBegin[order[position]] = static_cast<uint32_t>(ranks.size());
+            ranks.insert(ranks.end(), current.exact.begin(), current.exact.end());
+        }
+    }
+
+    std::vector<MappedLexicon::Node> nodes;
+    std::vector<Edge> edges;
+    nodes.reserve(order.size());
+    for (auto original : order) {
+        const auto &current = trie[original];
+        MappedLexicon::Node node{};
+        node.firstEdge = static_cast<uint32_t>(edges.size());
+        node.exactBegin = exactBegin[original];
+        node.topBegin = topBegin[original];
+        node.edgeCount = static_cast<uint16_t>(current.children.size());
+        node.exactCount = static_cast<uint16_t>(current.exact.size());
+        node.topCount = static_cast<uint16_t>(current.top.size());
+        for (const auto &[label, child] : current.children) {
+            edges.push_back({label, {}, renumbered[child]});
+        }
+        nodes.push_back(node);
+    }
+
+    std::string pool;
+    std::unordered_map<std::string_view, uint32_t> pooled;
+    std::vector<Entry> records;
+    records.reserve(entries.size());
+    for (const auto &entry : entries) {
+        auto iterator = pooled.find(entry.text);
+        if (iterator == pooled.end()) {
+            iterator = pooled.emplace(entry.text, static_cast<uint32_t>(pool.size())).first;
+            pool += entry.text;
+        }
+        records.push_back({iterator->second, static_cast<uint32_t>(entry.text.size()),
+                           entry.frequency});
+    }
+
+    MappedLexicon::Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.topK = topK;
+    header.nodeCount = static_cast<uint32_t>(nodes.size());
+    header.edgeCount = static_cast<uint32_t>(edges.size());
+    header.entryCount = static_cast<uint32_t>(records.size());
+    header.rankCount = static_cast<uint32_t>(ranks.size());
+    header.poolSize = static_cast<uint32_t>(pool.size());
+    header.nodesOffset = sizeof(header);
+    header.edgesOffset = header.nodesOffset + header.nodeCount * sizeof(MappedLexicon::Node);
+    header.entriesOffset = header.edgesOffset + header.edgeCount * sizeof(Edge);
+    header.ranksOffset = header.entriesOffset + header.entryCount * sizeof(Entry);
+    header.poolOffset = header.ranksOffset + header.rankCount * sizeof(uint32_t);
+
+    std::string image(reinterpret_cast<const char *>(&header), sizeof(header));
+    appendRecords(image, nodes);
+    appendRecords(image, edges);
+    appendRecords(image, records);
+    appendRecords(image, ranks);
+    image += pool;
+
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    output.write(image.data(), static_cast<std::streamsize>(image.size()));
+    return static_cast<bool>(output);
+}
+
+} // namespace aetherime
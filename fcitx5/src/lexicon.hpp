@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace aetherime {
+
+struct LexiconSourceEntry {
+    std::string key;
+    std::string text;
+    uint32_t frequency = 0;
+};
+
+// Builds the on-disk format from unordered entries. Duplicate (key, text)
+// pairs keep the highest frequency.
+bool writeLexicon(const std::string &path, std::vector<LexiconSourceEntry> entries,
+                  uint32_t topK);
+
+struct LexiconCandidate {
+    std::string_view text;
+    uint32_t frequency = 0;
+};
+
+// A position in the trie. Extending it one key byte at a time lets callers
+// that see a prefix grow keystroke by keystroke avoid re-walking it.
+struct LexiconCursor {
+    uint32_t node = 0;
+};
+
+// Read-only trie lexicon mapped from a file written by writeLexicon(). Each
+// node stores its exact entries and the top-k entries of its subtree, so
+// lookups walk the key once and copy views into the mapping without
+// allocating.
+class MappedLexicon {
+public:
+    static std::unique_ptr<MappedLexicon> open(const std::string &path);
+    ~MappedLexicon();
+
+    MappedLexicon(const MappedLexicon &) = delete;
+    MappedLexicon &operator=(const MappedLexicon &) = delete;
+
+    // Entries whose key equals key, most frequent first.
+    size_t exact(std::string_view key, LexiconCandidate *out, size_t limit) const;
+    // Most frequent entries whose key starts with prefix, including exact
+    // matches. At most topK() results are available per prefix.
+    size_t complete(std::string_view prefix, LexiconCandidate *out, size_t limit) const;
+
+    // Cursor variants of the lookups above. advance() returns false, leaving
+    // the cursor untouched, when no key continues with label.
+    bool advance(LexiconCursor &cursor, unsigned char label) const;
+    size_t exact(LexiconCursor cursor, LexiconCandidate *out, size_t limit) const;
+    size_t complete(LexiconCursor cursor, LexiconCandidate *out, size_t limit) const;
+
+    size_t entryCount() const;
+    size_t topK() const;
+
+private:
+    friend bool writeLexicon(const std::string &path, std::vector<LexiconSourceEntry> entries,
+                             uint32_t topK);
+
+    struct Header;
+    struct Node;
+
+    MappedLexicon(void *data, size_t size);
+    bool find(std::string_view key, LexiconCursor &cursor) const;
+    const Node &node(LexiconCursor cursor) const;
+    size_t collect(uint32_t rankBegin, uint32_t rankCount, LexiconCandidate *out,
+                   size_t limit) const;
+
+    void *data_;
+    size_t size_;
+    const Header *header_;
+};
+
+struct LexiconMatches {
+    const LexiconCandidate *first = nullptr;
+    size_t count = 0;
+
+    const LexiconCandidate *begin() const { return first; }
+    const LexiconCandidate *end() const { return first + count; }
+    bool empty() const { return count == 0; }
+};
+
+// Per-input-context prefix completion. The trie path and results of every
+// prefix length typed so far are kept, so each keystroke costs at most one
+// edge walk and backspace is answered from the cache.
+class PrefixCompleter {
+public:
+    static constexpr size_t kMaxResults = 8;
+
+    explicit PrefixCompleter(const MappedLexicon *lexicon);
+
+    // Most frequent completions of prefix, at most kMaxResults. The views
+    // stay valid until the next call.
+    LexiconMatches complete(std::string_view prefix);
+    void reset();
+
+private:
+    struct Step {
+        LexiconCursor cursor;
+        size_t count = 0;
+        std::array<LexiconCandidate, kMaxResults> results;
+    };
+
+    const MappedLexicon *lexicon_;
+    std::string path_;
+    std::vector<Step> steps_;
+};
+
+} // namespace aetherime
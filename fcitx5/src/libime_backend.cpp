@@ -1,13 +1,17 @@
 #include "libime_backend.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <exception>
 #include <filesystem>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include <fcitx-utils/log.h>
+
 #ifdef AETHERIME_HAS_LIBIME
 #include <libime/core/userlanguagemodel.h>
 #include <libime/pinyin/pinyincontext.h>
@@ -19,6 +23,8 @@ namespace aetherime {
 
 namespace {
 
+constexpr size_t kCandidateCacheCapacity = 512;
+
 #ifdef AETHERIME_HAS_LIBIME
 std::string envOrEmpty(const char *name) {
     const char *value = std::getenv(name);
@@ -59,16 +65,50 @@ bool isLikelyPinyinInput(const std::string &text) {
 }
 #endif
 
+// Cache keys and decoder input: LibIME reads pinyin in lower case, so "Nihao"
+// and "nihao" are the same query. Apostrophes stay, since they choose the
+// syllable split ("xi'an" is not "xian").
+std::string normalizedPinyin(const std::string &input) {
+    std::string pinyin(input);
+    std::transform(pinyin.begin(), pinyin.end(), pinyin.begin(), [](char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    });
+    return pinyin;
+}
+
 } // namespace
 
 #ifdef AETHERIME_HAS_LIBIME
 struct LibImeBackend::Impl {
     std::unique_ptr<libime::PinyinIME> ime;
 };
-#endif
 
-LibImeBackend::LibImeBackend() {
-#ifdef AETHERIME_HAS_LIBIME
+namespace {
+
+// Common syllables typed once after loading so the pages of the dictionary
+// and model that every session touches are faulted in off the main thread.
+constexpr const char *kWarmUpInputs[] = {
+    "de", "shi", "wo", "ni", "ta", "women", "nihao", "zhege", "shenme", "keyi", "meiyou", "jintian",
+};
+
+int64_t millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                 start)
+        .count();
+}
+
+} // namespace
+
+struct LibImeBackend::LoadResult {
+    std::unique_ptr<libime::PinyinIME> ime;
+    std::string status;
+    int64_t dictMs = 0;
+    int64_t modelMs = 0;
+    int64_t warmUpMs = 0;
+};
+
+LibImeBackend::LoadResult LibImeBackend::load() {
+    LoadResult result;
     try {
         auto dictPath = envOrEmpty("AETHERIME_LIBIME_DICT");
         if (dictPath.empty()) {
@@ -85,78 +125,277 @@ LibImeBackend::LibImeBackend() {
         }
 
         if (dictPath.empty()) {
-            status_ = "libime dict file not found (expect sc.dict)";
-            return;
+            result.status = "libime dict file not found (expect sc.dict)";
+            return result;
         }
         if (modelPath.empty()) {
-            status_ = "libime language model file not found (expect zh_CN.lm)";
-            return;
+            result.status = "libime language model file not found (expect zh_CN.lm)";
+            return result;
         }
 
+        auto start = std::chrono::steady_clock::now();
         auto dict = std::make_unique<libime::PinyinDictionary>();
         dict->load(libime::PinyinDictionary::SystemDict, dictPath.c_str(),
                    libime::PinyinDictFormat::Binary);
+        result.dictMs = millisecondsSince(start);
 
+        start = std::chrono::steady_clock::now();
         auto model = std::make_unique<libime::UserLanguageModel>(modelPath.c_str());
+        result.modelMs = millisecondsSince(start);
+
         auto ime = std::make_unique<libime::PinyinIME>(std::move(dict), std::move(model));
         ime->setBeamSize(20);
         ime->setNBest(2);
         ime->setScoreFilter(1.0F);
 
-        impl_ = std::make_unique<Impl>();
-        impl_->ime = std::move(ime);
-        available_ = true;
-        status_ = "libime ready";
+        start = std::chrono::steady_clock::now();
+        {
+            libime::PinyinContext context(ime.get());
+            for (const auto *input : kWarmUpInputs) {
+                context.type(input);
+                (void)context.candidates();
+                context.clear();
+            }
+        }
+        result.warmUpMs = millisecondsSince(start);
+
+        result.ime = std::move(ime);
+        result.status = "libime ready";
     } catch (const std::exception &error) {
-        status_ = std::string("libime init failed: ") + error.what();
-        available_ = false;
+        result.status = std::string("libime init failed: ") + error.what();
+    }
+    return result;
+}
+#endif
+
+LibImeBackend::LibImeBackend(fcitx::EventLoop *eventLoop)
+    : createdAt_(std::chrono::steady_clock::now()) {
+#ifdef AETHERIME_HAS_LIBIME
+    if (!eventLoop) {
+        install(load());
+        return;
     }
+
+    // Loading parses tens of megabytes, so it runs on a worker thread and the
+    // result is handed back to the event loop. Until then callers see
+    // available() == false and use the fallback lexicon.
+    loading_ = true;
+    status_ = "libime loading";
+    dispatcher_.attach(eventLoop);
+    loader_ = std::thread([this] {
+        auto result = std::make_shared<LoadResult>(load());
+        dispatcher_.schedule([this, result] { install(std::move(*result)); });
+    });
 #else
+    (void)eventLoop;
     status_ = "built without libime";
     available_ = false;
 #endif
 }
 
-LibImeBackend::~LibImeBackend() = default;
+LibImeBackend::~LibImeBackend() {
+#ifdef AETHERIME_HAS_LIBIME
+    if (loader_.joinable()) {
+        loader_.join();
+    }
+    dispatcher_.detach();
+#endif
+}
 
-std::vector<std::string> LibImeBackend::query(const std::string &pinyin, size_t limit) const {
-    if (!available_ || pinyin.empty() || limit == 0 || !isLikelyPinyinInput(pinyin)) {
-        return {};
+#ifdef AETHERIME_HAS_LIBIME
+void LibImeBackend::install(LoadResult result) {
+    loading_ = false;
+    status_ = std::move(result.status);
+    if (!result.ime) {
+        FCITX_WARN() << "AetherIME " << status_;
+        return;
+    }
+    impl_ = std::make_unique<Impl>();
+    impl_->ime = std::move(result.ime);
+    available_ = true;
+    invalidateCandidates();
+    FCITX_INFO() << "AetherIME libime ready " << millisecondsSince(createdAt_)
+                 << " ms after startup (dict " << result.dictMs << " ms, model " << result.modelMs
+                 << " ms, warm-up " << result.warmUpMs << " ms)";
+}
+#endif
+
+void LibImeBackend::noteCandidatesServed() {
+    if (firstCandidateLogged_) {
+        return;
     }
+    firstCandidateLogged_ = true;
+    FCITX_INFO() << "AetherIME first libime candidates "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - createdAt_)
+                        .count()
+                 << " ms after startup";
+}
+
+namespace {
 
 #ifdef AETHERIME_HAS_LIBIME
+std::vector<std::string> collectCandidates(const libime::PinyinContext &context, size_t limit) {
     std::set<std::string> dedup;
     std::vector<std::string> output;
     output.reserve(limit);
 
+    const auto &candidates = context.candidatesToCursor().empty() ? context.candidates()
+                                                                   : context.candidatesToCursor();
+    for (const auto &candidate : candidates) {
+        auto text = candidate.toString();
+        if (text.empty()) {
+            continue;
+        }
+        if (!dedup.insert(text).second) {
+            continue;
+        }
+        output.push_back(std::move(text));
+        if (output.size() >= limit) {
+            break;
+        }
+    }
+    return output;
+}
+#endif
+
+} // namespace
+
+std::vector<std::string> LibImeBackend::query(const std::string &input, size_t limit) {
+    if (!available_ || input.empty() || limit == 0 || !isLikelyPinyinInput(input)) {
+        return {};
+    }
+    const auto pinyin = normalizedPinyin(input);
+    if (const auto *cached = findCandidates(pinyin, limit)) {
+        return {cached->begin(), cached->begin() + std::min(limit, cached->size())};
+    }
+
+#ifdef AETHERIME_HAS_LIBIME
     try {
         libime::PinyinContext context(impl_->ime.get());
         context.type(pinyin);
+        auto candidates = collectCandidates(context, limit);
+        storeCandidates(pinyin, limit, candidates);
+        return candidates;
+    } catch (...) {
+        return {};
+    }
+#else
+    return {};
+#endif
+}
 
-        const auto &candidates = context.candidatesToCursor().empty() ? context.candidates()
-                                                                       : context.candidatesToCursor();
-        for (const auto &candidate : candidates) {
-            auto text = candidate.toString();
-            if (text.empty()) {
-                continue;
-            }
-            if (!dedup.insert(text).second) {
-                continue;
-            }
-            output.push_back(std::move(text));
-            if (output.size() >= limit) {
-                break;
+void LibImeBackend::invalidateCandidates() {
+    candidateIndex_.clear();
+    candidateCache_.clear();
+}
+
+CandidateCacheStats LibImeBackend::candidateCacheStats() const {
+    return {candidateHits_, candidateMisses_, candidateCache_.size(), kCandidateCacheCapacity};
+}
+
+// An entry decoded with a smaller limit cannot answer a larger request.
+const std::vector<std::string> *LibImeBackend::findCandidates(const std::string &pinyin,
+                                                              size_t limit) {
+    auto iterator = candidateIndex_.find(pinyin);
+    if (iterator == candidateIndex_.end() || iterator->second->limit < limit) {
+        ++candidateMisses_;
+        return nullptr;
+    }
+    ++candidateHits_;
+    candidateCache_.splice(candidateCache_.begin(), candidateCache_, iterator->second);
+    return &iterator->second->candidates;
+}
+
+void LibImeBackend::storeCandidates(const std::string &pinyin, size_t limit,
+                                    const std::vector<std::string> &candidates) {
+    if (auto iterator = candidateIndex_.find(pinyin); iterator != candidateIndex_.end()) {
+        candidateCache_.erase(iterator->second);
+        candidateIndex_.erase(iterator);
+    }
+    if (candidateCache_.size() == kCandidateCacheCapacity) {
+        candidateIndex_.erase(candidateCache_.back().pinyin);
+        candidateCache_.pop_back();
+    }
+    candidateCache_.push_front({pinyin, limit, candidates});
+    candidateIndex_.emplace(candidateCache_.front().pinyin, candidateCache_.begin());
+}
+
+#ifdef AETHERIME_HAS_LIBIME
+struct PinyinSession::Impl {
+    explicit Impl(libime::PinyinIME *ime) : context(ime) {}
+
+    libime::PinyinContext context;
+};
+#endif
+
+PinyinSession::PinyinSession(LibImeBackend &backend) : backend_(backend) {}
+
+PinyinSession::~PinyinSession() = default;
+
+std::vector<std::string> PinyinSession::query(const std::string &input, size_t limit) {
+    if (!backend_.available() || input.empty() || limit == 0 || !isLikelyPinyinInput(input)) {
+        reset();
+        return {};
+    }
+    const auto pinyin = normalizedPinyin(input);
+
+    // Backspace and retype cycles revisit the same inputs, so a cache hit is
+    // served without touching the decoder. The context simply lags behind
+    // until the next miss, which diffs against what it actually holds.
+    if (const auto *cached = backend_.findCandidates(pinyin, limit)) {
+        return {cached->begin(), cached->begin() + std::min(limit, cached->size())};
+    }
+
+#ifdef AETHERIME_HAS_LIBIME
+    try {
+        if (!impl_) {
+            impl_ = std::make_unique<Impl>(backend_.impl_->ime.get());
+        }
+        auto &context = impl_->context;
+
+        // The composing buffer only grows or shrinks at its end, so the old
+        // input is normally a prefix of the new one or the other way round.
+        size_t common = 0;
+        const auto shorter = std::min(typed_.size(), pinyin.size());
+        while (common < shorter && typed_[common] == pinyin[common]) {
+            ++common;
+        }
+        if (common == 0) {
+            context.clear();
+        } else {
+            for (auto remove = typed_.size() - common; remove > 0; --remove) {
+                context.backspace();
             }
         }
+        if (common < pinyin.size()) {
+            context.type(std::string_view(pinyin).substr(common));
+        }
+        typed_ = pinyin;
+        auto candidates = collectCandidates(context, limit);
+        backend_.storeCandidates(pinyin, limit, candidates);
+        if (!candidates.empty()) {
+            backend_.noteCandidatesServed();
+        }
+        return candidates;
     } catch (...) {
+        impl_.reset();
+        typed_.clear();
         return {};
     }
-    return output;
 #else
-    (void)pinyin;
     (void)limit;
     return {};
 #endif
 }
 
+void PinyinSession::reset() {
+    typed_.clear();
+#ifdef AETHERIME_HAS_LIBIME
+    if (impl_) {
+        impl_->context.clear();
+    }
+#endif
+}
+
 } // namespace aetherime
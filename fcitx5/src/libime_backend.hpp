@@ -1,24 +1,108 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <list>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include <fcitx-utils/event.h>
+
+#ifdef AETHERIME_HAS_LIBIME
+#include <thread>
+
+#include <fcitx-utils/eventdispatcher.h>
+#endif
+
 namespace aetherime {
 
+class PinyinSession;
+
+struct CandidateCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+};
+
+// Loads the LibIME dictionary and language model on a background thread when
+// given an event loop, or synchronously without one.
 class LibImeBackend {
 public:
-    LibImeBackend();
+    explicit LibImeBackend(fcitx::EventLoop *eventLoop);
     ~LibImeBackend();
 
+    LibImeBackend(const LibImeBackend &) = delete;
+    LibImeBackend &operator=(const LibImeBackend &) = delete;
+
     bool available() const { return available_; }
+    bool loading() const { return loading_; }
     const std::string &status() const { return status_; }
 
-    std::vector<std::string> query(const std::string &pinyin, size_t limit) const;
+    std::vector<std::string> query(const std::string &pinyin, size_t limit);
+
+    // Decoded candidates are memoized by pinyin for all input contexts. The
+    // cache must be dropped whenever the dictionary or user model changes.
+    void invalidateCandidates();
+    CandidateCacheStats candidateCacheStats() const;
 
 private:
+    friend class PinyinSession;
+
+    struct CachedCandidates {
+        std::string pinyin;
+        size_t limit;
+        std::vector<std::string> candidates;
+    };
+
+    const std::vector<std::string> *findCandidates(const std::string &pinyin, size_t limit);
+    void storeCandidates(const std::string &pinyin, size_t limit,
+                         const std::vector<std::string> &candidates);
+    void noteCandidatesServed();
+
     bool available_ = false;
+    bool loading_ = false;
     std::string status_ = "libime backend not initialized";
+    std::chrono::steady_clock::time_point createdAt_;
+    bool firstCandidateLogged_ = false;
+
+    std::list<CachedCandidates> candidateCache_;
+    std::unordered_map<std::string_view, std::list<CachedCandidates>::iterator> candidateIndex_;
+    uint64_t candidateHits_ = 0;
+    uint64_t candidateMisses_ = 0;
+
+#ifdef AETHERIME_HAS_LIBIME
+    struct Impl;
+    struct LoadResult;
+    static LoadResult load();
+    void install(LoadResult result);
+
+    std::unique_ptr<Impl> impl_;
+    fcitx::EventDispatcher dispatcher_;
+    std::thread loader_;
+#endif
+};
+
+// Keeps one pinyin context alive across keystrokes of the same composition.
+// Each query feeds only the difference from the previous input, so the
+// lattice built for earlier segments is reused.
+class PinyinSession {
+public:
+    explicit PinyinSession(LibImeBackend &backend);
+    ~PinyinSession();
+
+    PinyinSession(const PinyinSession &) = delete;
+    PinyinSession &operator=(const PinyinSession &) = delete;
+
+    std::vector<std::string> query(const std::string &pinyin, size_t limit);
+    void reset();
+
+private:
+    LibImeBackend &backend_;
+    std::string typed_;
 
 #ifdef AETHERIME_HAS_LIBIME
     struct Impl;
@@ -0,0 +1,222 @@
+#include "prediction_dispatcher.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace aetherime {
+namespace {
+
+constexpr int kRankBackground = 2;
+
+} // namespace
+
+DispatchedPrediction::~DispatchedPrediction() { dispatcher_->withdraw(ticket_); }
+
+void DispatchedPrediction::setKind(PredictionKind kind) { dispatcher_->setKind(ticket_, kind); }
+
+PredictionDispatcher::PredictionDispatcher(std::string socketPath, fcitx::EventLoop *eventLoop,
+                                           LatencyTracer *tracer, size_t maxInFlight)
+    : client_(std::move(socketPath), eventLoop, tracer), eventLoop_(eventLoop),
+      maxInFlight_(std::max<size_t>(maxInFlight, 1)) {}
+
+std::unique_ptr<DispatchedPrediction> PredictionDispatcher::submit(const void *owner,
+                                                                   PredictionKind kind,
+                                                                   const PredictionRequest &request,
+                                                                   PredictCallback callback,
+                                                                   GhostDeltaCallback onDelta) {
+    const auto ticket = nextTicket_++;
+    supersede(owner, kind, ticket);
+    ++stats_.submitted;
+    auto &job = jobs_
+                    .emplace(ticket, Job{owner, kind, request, std::move(callback),
+                                         std::move(onDelta), nullptr})
+                    .first->second;
+    if (inFlight() < maxInFlight_) {
+        if (!start(ticket, job)) {
+            jobs_.erase(ticket);
+            return nullptr;
+        }
+    } else {
+        pump();
+    }
+    return std::make_unique<DispatchedPrediction>(this, ticket);
+}
+
+void PredictionDispatcher::setFocused(const void *owner) {
+    if (owner == focused_) {
+        return;
+    }
+    focused_ = owner;
+    bool dropped = false;
+    for (auto &[ticket, job] : jobs_) {
+        if (job.owner != owner && !job.failed) {
+            drop(job);
+            dropped = true;
+        }
+    }
+    if (dropped) {
+        scheduleDeferred();
+    }
+    pump();
+}
+
+DispatcherStats PredictionDispatcher::stats() const {
+    auto stats = stats_;
+    stats.inFlight = inFlight();
+    stats.queued = 0;
+    for (const auto &[ticket, job] : jobs_) {
+        stats.queued += !job.pending && !job.failed;
+    }
+    return stats;
+}
+
+// The replaced request's callback never runs; its owner has moved on.
+void PredictionDispatcher::supersede(const void *owner, PredictionKind kind, uint64_t keep) {
+    for (auto iterator = jobs_.begin(); iterator != jobs_.end();) {
+        const auto &job = iterator->second;
+        if (iterator->first != keep && job.owner == owner && job.kind == kind && !job.failed) {
+            ++stats_.superseded;
+            iterator = jobs_.erase(iterator);
+        } else {
+            ++iterator;
+        }
+    }
+}
+
+void PredictionDispatcher::setKind(uint64_t ticket, PredictionKind kind) {
+    auto iterator = jobs_.find(ticket);
+    if (iterator == jobs_.end() || iterator->second.kind == kind) {
+        return;
+    }
+    iterator->second.kind = kind;
+    supersede(iterator->second.owner, kind, ticket);
+    pump();
+}
+
+int PredictionDispatcher::rank(const Job &job) const {
+    if (focused_ && job.owner != focused_) {
+        return kRankBackground;
+    }
+    return job.kind == PredictionKind::Ghost ? 0 : 1;
+}
+
+size_t PredictionDispatcher::inFlight() const {
+    return static_cast<size_t>(std::count_if(
+        jobs_.begin(), jobs_.end(), [](const auto &entry) { return entry.second.pending != nullptr; }));
+}
+
+bool PredictionDispatcher::start(uint64_t ticket, Job &job) {
+    job.pending = client_.predictAsync(
+        job.request,
+        [this, ticket](std::optional<PredictionResult> result) {
+            onFinished(ticket, std::move(result));
+        },
+        std::move(job.onDelta));
+    return job.pending != nullptr;
+}
+
+// Sends the best queued requests while there is room. A queued request from
+// the focused context may displace a background one in flight. Callbacks
+// never run from here: the client reports requests that fail while another
+// is being sent from the event loop, and failed jobs wait for runDeferred().
+void PredictionDispatcher::pump() {
+    while (true) {
+        Job *next = nullptr;
+        uint64_t nextTicket = 0;
+        Job *victim = nullptr;
+        for (auto &[ticket, job] : jobs_) {
+            if (job.failed) {
+                continue;
+            }
+            if (job.pending) {
+                if (rank(job) == kRankBackground && !victim) {
+                    victim = &job;
+                }
+            } else if (!next || rank(job) < rank(*next)) {
+                next = &job;
+                nextTicket = ticket;
+            }
+        }
+        if (!next) {
+            return;
+        }
+        if (inFlight() >= maxInFlight_) {
+            if (!victim || rank(*next) == kRankBackground) {
+                return;
+            }
+            drop(*victim);
+            scheduleDeferred();
+        }
+        if (!start(nextTicket, *next)) {
+            next->failed = true;
+            scheduleDeferred();
+        }
+    }
+}
+
+void PredictionDispatcher::drop(Job &job) {
+    ++stats_.dropped;
+    job.pending.reset();
+    job.failed = true;
+}
+
+void PredictionDispatcher::withdraw(uint64_t ticket) {
+    auto iterator = jobs_.find(ticket);
+    if (iterator == jobs_.end()) {
+        return;
+    }
+    const bool wasInFlight = iterator->second.pending != nullptr;
+    jobs_.erase(iterator);
+    if (wasInFlight) {
+        pump();
+    }
+}
+
+void PredictionDispatcher::onFinished(uint64_t ticket, std::optional<PredictionResult> result) {
+    auto iterator = jobs_.find(ticket);
+    if (iterator == jobs_.end()) {
+        return;
+    }
+    auto callback = std::move(iterator->second.callback);
+    jobs_.erase(iterator);
+    pump();
+    callback(std::move(result));
+}
+
+void PredictionDispatcher::scheduleDeferred() {
+    if (!eventLoop_) {
+        return;
+    }
+    if (deferEvent_) {
+        deferEvent_->setNextInterval(0);
+        deferEvent_->setOneShot();
+        return;
+    }
+    deferEvent_ = eventLoop_->addTimeEvent(CLOCK_MONOTONIC, fcitx::now(CLOCK_MONOTONIC), 0,
+                                           [this](fcitx::EventSourceTime *, uint64_t) {
+                                               runDeferred();
+                                               return true;
+                                           });
+}
+
+void PredictionDispatcher::runDeferred() {
+    std::vector<uint64_t> failed;
+    for (const auto &[ticket, job] : jobs_) {
+        if (job.failed) {
+            failed.push_back(ticket);
+        }
+    }
+    // Each callback may submit or withdraw other requests.
+    for (const auto ticket : failed) {
+        auto iterator = jobs_.find(ticket);
+        if (iterator == jobs_.end() || !iterator->second.failed) {
+            continue;
+        }
+        auto callback = std::move(iterator->second.callback);
+        jobs_.erase(iterator);
+        callback(std::nullopt);
+    }
+    pump();
+}
+
+} // namespace aetherime
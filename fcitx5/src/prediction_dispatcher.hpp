@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcitx-utils/event.h>
+
+#include "daemon_client.hpp"
+#include "latency_trace.hpp"
+
+namespace aetherime {
+
+class PredictionDispatcher;
+
+enum class PredictionKind {
+    Ghost,
+    Prefetch,
+};
+
+// Handle for a prediction handed to the dispatcher, queued or in flight.
+// Destroying it withdraws the request and guarantees the callback is never
+// invoked.
+class DispatchedPrediction {
+public:
+    DispatchedPrediction(PredictionDispatcher *dispatcher, uint64_t ticket)
+        : dispatcher_(dispatcher), ticket_(ticket) {}
+    ~DispatchedPrediction();
+
+    DispatchedPrediction(const DispatchedPrediction &) = delete;
+    DispatchedPrediction &operator=(const DispatchedPrediction &) = delete;
+
+    // Re-files the request under another kind, replacing the context's
+    // current request of that kind, e.g. when a prefetch becomes the ghost.
+    void setKind(PredictionKind kind);
+
+private:
+    PredictionDispatcher *dispatcher_;
+    uint64_t ticket_;
+};
+
+struct DispatcherStats {
+    uint64_t submitted = 0;
+    // Replaced by a newer request of the same kind from the same context.
+    uint64_t superseded = 0;
+    // Background requests dropped on a focus change or to make room for the
+    // focused context.
+    uint64_t dropped = 0;
+    size_t queued = 0;
+    size_t inFlight = 0;
+};
+
+// Owns the daemon connection for all input contexts and decides whose
+// prediction goes out next. Each context keeps at most one request of each
+// kind; a newer one replaces it. No more than maxInFlight requests are sent
+// at a time and the rest wait in a queue, the focused context's ghost first,
+// then its prefetch, then other contexts in submission order. Daemon load is
+// bounded by maxInFlight however many contexts exist.
+//
+// Requests that are dropped, or that cannot be sent once their turn comes,
+// complete with std::nullopt from the event loop.
+class PredictionDispatcher {
+public:
+    PredictionDispatcher(std::string socketPath, fcitx::EventLoop *eventLoop,
+                         LatencyTracer *tracer, size_t maxInFlight);
+
+    PredictionDispatcher(const PredictionDispatcher &) = delete;
+    PredictionDispatcher &operator=(const PredictionDispatcher &) = delete;
+
+    // owner identifies the input context. Returns nullptr if the request
+    // could be sent right away but the daemon cannot be reached.
+    std::unique_ptr<DispatchedPrediction> submit(const void *owner, PredictionKind kind,
+                                                 const PredictionRequest &request,
+                                                 PredictCallback callback,
+                                                 GhostDeltaCallback onDelta = {});
+
+    // Puts owner's requests first. Everything other contexts still have
+    // queued or in flight is stale by now and dropped.
+    void setFocused(const void *owner);
+
+    DaemonClient &client() { return client_; }
+    DispatcherStats stats() const;
+
+private:
+    friend class DispatchedPrediction;
+
+    struct Job {
+        const void *owner;
+        PredictionKind kind;
+        PredictionRequest request;
+        PredictCallback callback;
+        GhostDeltaCallback onDelta;
+        std::unique_ptr<PendingPrediction> pending;
+        // Waiting for the deferred pass to complete it with std::nullopt.
+        bool failed = false;
+    };
+    using Jobs = std::map<uint64_t, Job>;
+
+    void supersede(const void *owner, PredictionKind kind, uint64_t keep);
+    void setKind(uint64_t ticket, PredictionKind kind);
+    int rank(const Job &job) const;
+    size_t inFlight() const;
+    bool start(uint64_t ticket, Job &job);
+    void pump();
+    void drop(Job &job);
+    void withdraw(uint64_t ticket);
+    void onFinished(uint64_t ticket, std::optional<PredictionResult> result);
+    void scheduleDeferred();
+    void runDeferred();
+
+    DaemonClient client_;
+    fcitx::EventLoop *eventLoop_;
+    size_t maxInFlight_;
+    const void *focused_ = nullptr;
+    // Ordered by ticket, which is submission order.
+    Jobs jobs_;
+    uint64_t nextTicket_ = 1;
+    std::unique_ptr<fcitx::EventSourceTime> deferEvent_;
+    DispatcherStats stats_;
+};
+
+} // namespace aetherime
@@ -0,0 +1,137 @@
+#include "shm_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace aetherime {
+namespace {
+
+// The producer's write position and the consumer's read position, as byte
+// counts since the ring was created, each on its own cache line.
+constexpr size_t kHeadOffset = 0;
+constexpr size_t kTailOffset = 64;
+constexpr unsigned kRequiredSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring positions must be lock-free to be shared between processes");
+
+std::atomic<uint64_t> &position(unsigned char *memory, size_t offset) {
+    return *reinterpret_cast<std::atomic<uint64_t> *>(memory + offset);
+}
+
+bool validCapacity(size_t capacity) {
+    return capacity >= 4096 && capacity <= (64u << 20) && (capacity & (capacity - 1)) == 0;
+}
+
+} // namespace
+
+ShmRing::ShmRing(int memoryFd, int eventFd, unsigned char *memory, size_t capacity)
+    : memoryFd_(memoryFd), eventFd_(eventFd), memory_(memory), capacity_(capacity) {}
+
+std::unique_ptr<ShmRing> ShmRing::create(size_t capacity) {
+    if (!validCapacity(capacity)) {
+        return nullptr;
+    }
+    const size_t size = kShmRingHeaderSize + capacity;
+    const int memoryFd = memfd_create("aetherime-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memoryFd < 0) {
+        return nullptr;
+    }
+    if (ftruncate(memoryFd, static_cast<off_t>(size)) < 0 ||
+        fcntl(memoryFd, F_ADD_SEALS, kRequiredSeals | F_SEAL_SEAL) < 0) {
+        close(memoryFd);
+        return nullptr;
+    }
+    const int eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (eventFd < 0) {
+        close(memoryFd);
+        return nullptr;
+    }
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+    if (memory == MAP_FAILED) {
+        close(memoryFd);
+        close(eventFd);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmRing>(
+        new ShmRing(memoryFd, eventFd, static_cast<unsigned char *>(memory), capacity));
+}
+
+std::unique_ptr<ShmRing> ShmRing::attach(int memoryFd, int eventFd) {
+    struct stat info {};
+    const int seals = fcntl(memoryFd, F_GET_SEALS);
+    if (fstat(memoryFd, &info) < 0 || seals < 0 ||
+        (static_cast<unsigned>(seals) & kRequiredSeals) != kRequiredSeals ||
+        info.st_size < static_cast<off_t>(kShmRingHeaderSize) ||
+        !validCapacity(static_cast<size_t>(info.st_size) - kShmRingHeaderSize)) {
+        close(memoryFd);
+        close(eventFd);
+        return nullptr;
+    }
+    const auto size = static_cast<size_t>(info.st_size);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+    if (memory == MAP_FAILED) {
+        close(memoryFd);
+        close(eventFd);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmRing>(new ShmRing(memoryFd, eventFd,
+                                                static_cast<unsigned char *>(memory),
+                                                size - kShmRingHeaderSize));
+}
+
+ShmRing::~ShmRing() {
+    munmap(memory_, kShmRingHeaderSize + capacity_);
+    close(memoryFd_);
+    close(eventFd_);
+}
+
+bool ShmRing::write(std::string_view bytes) {
+    const auto head = position(memory_, kHeadOffset).load(std::memory_order_relaxed);
+    const auto tail = position(memory_, kTailOffset).load(std::memory_order_acquire);
+    if (head - tail > capacity_ || bytes.size() > capacity_ - (head - tail)) {
+        return false;
+    }
+    auto *data = memory_ + kShmRingHeaderSize;
+    const size_t offset = head & (capacity_ - 1);
+    const size_t first = std::min(bytes.size(), capacity_ - offset);
+    std::memcpy(data + offset, bytes.data(), first);
+    std::memcpy(data, bytes.data() + first, bytes.size() - first);
+    position(memory_, kHeadOffset).store(head + bytes.size(), std::memory_order_release);
+    return true;
+}
+
+void ShmRing::notify() {
+    const uint64_t one = 1;
+    (void)!::write(eventFd_, &one, sizeof(one));
+}
+
+bool ShmRing::read(std::string &out) {
+    const auto head = position(memory_, kHeadOffset).load(std::memory_order_acquire);
+    const auto tail = position(memory_, kTailOffset).load(std::memory_order_relaxed);
+    const auto available = head - tail;
+    if (available > capacity_) {
+        return false;
+    }
+    const auto *data = memory_ + kShmRingHeaderSize;
+    const size_t offset = tail & (capacity_ - 1);
+    const size_t first = std::min<size_t>(available, capacity_ - offset);
+    out.append(reinterpret_cast<const char *>(data + offset), first);
+    out.append(reinterpret_cast<const char *>(data), available - first);
+    position(memory_, kTailOffset).store(head, std::memory_order_release);
+    return true;
+}
+
+void ShmRing::clearEvents() {
+    uint64_t count = 0;
+    (void)!::read(eventFd_, &count, sizeof(count));
+}
+
+} // namespace aetherime
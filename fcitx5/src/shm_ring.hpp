@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace aetherime {
+
+inline constexpr size_t kShmRingHeaderSize = 128;
+inline constexpr size_t kShmRingCapacity = 256 * 1024;
+
+// One direction of the shared-memory transport: a byte ring in a sealed
+// memfd with one producer and one consumer, and an eventfd the producer
+// signals after writing. The layout is described in docs/IPC.md; frames on
+// it are the binary-v2 frames, wrapping at the end of the ring.
+class ShmRing {
+public:
+    // Creates a fresh ring. Returns nullptr if memfd, eventfd or mmap fail.
+    static std::unique_ptr<ShmRing> create(size_t capacity = kShmRingCapacity);
+    // Maps a ring the peer created, taking ownership of both descriptors.
+    // Returns nullptr, closing them, unless the memfd is sealed against
+    // resizing and its size is a valid ring.
+    static std::unique_ptr<ShmRing> attach(int memoryFd, int eventFd);
+    ~ShmRing();
+
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    int memoryFd() const { return memoryFd_; }
+    int eventFd() const { return eventFd_; }
+
+    // Producer side. Copies all of bytes or, if they do not fit, nothing.
+    bool write(std::string_view bytes);
+    // Wakes the consumer.
+    void notify();
+
+    // Consumer side. Appends everything written so far to out; false if the
+    // producer left the ring in an impossible state.
+    bool read(std::string &out);
+    // Resets the eventfd after a wakeup.
+    void clearEvents();
+
+private:
+    ShmRing(int memoryFd, int eventFd, unsigned char *memory, size_t capacity);
+
+    int memoryFd_;
+    int eventFd_;
+    unsigned char *memory_;
+    size_t capacity_;
+};
+
+} // namespace aetherime
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace aetherime {
+
+// Field parsing shared by the line-based tools: the lexicon builder, the
+// trace replay and the load generator.
+
+inline std::vector<std::string_view> splitTabs(std::string_view line) {
+    std::vector<std::string_view> fields;
+    while (true) {
+        const auto tab = line.find('\t');
+        fields.push_back(line.substr(0, tab));
+        if (tab == std::string_view::npos) {
+            return fields;
+        }
+        line.remove_prefix(tab + 1);
+    }
+}
+
+// Plain decimal digits only; at most 15 of them, so the value cannot
+// overflow.
+inline bool parseNumber(std::string_view field, uint64_t &value) {
+    if (field.empty() || field.size() > 15) {
+        return false;
+    }
+    value = 0;
+    for (char c : field) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + static_cast<uint64_t>(c - '0');
+    }
+    return true;
+}
+
+} // namespace aetherime
@@ -0,0 +1,503 @@
+#include "text_scan.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AETHERIME_TEXT_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace aetherime {
+
+namespace {
+
+bool isContinuation(uint8_t byte) { return (byte & 0xC0) == 0x80; }
+
+bool needsJsonEscape(uint8_t byte) { return byte < 0x20 || byte == '"' || byte == '\\'; }
+
+namespace scalar {
+
+bool validateUtf8(const char *data, size_t size) {
+    const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+    size_t pos = 0;
+    while (pos < size) {
+        if (pos + 8 <= size) {
+            uint64_t word;
+            std::memcpy(&word, bytes + pos, sizeof(word));
+            if ((word & 0x8080808080808080ULL) == 0) {
+                pos += 8;
+                continue;
+            }
+        }
+        const uint8_t lead = bytes[pos];
+        if (lead < 0x80) {
+            ++pos;
+            continue;
+        }
+        size_t length;
+        uint32_t min;
+        uint32_t codePoint;
+        if ((lead & 0xE0) == 0xC0) {
+            length = 2;
+            min = 0x80;
+            codePoint = lead & 0x1F;
+        } else if ((lead & 0xF0) == 0xE0) {
+            length = 3;
+            min = 0x800;
+            codePoint = lead & 0x0F;
+        } else if ((lead & 0xF8) == 0xF0) {
+            length = 4;
+            min = 0x10000;
+            codePoint = lead & 0x07;
+        } else {
+            return false;
+        }
+        if (size - pos < length) {
+            return false;
+        }
+        for (size_t i = 1; i < length; ++i) {
+            if (!isContinuation(bytes[pos + i])) {
+                return false;
+            }
+            codePoint = (codePoint << 6) | (bytes[pos + i] & 0x3F);
+        }
+        if (codePoint < min || codePoint > 0x10FFFF ||
+            (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+            return false;
+        }
+        pos += length;
+    }
+    return true;
+}
+
+size_t countCodePoints(const char *data, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += !isContinuation(static_cast<uint8_t>(data[i]));
+    }
+    return count;
+}
+
+size_t codePointOffset(const char *data, size_t size, size_t count) {
+    for (size_t i = 0; i < size; ++i) {
+        if (!isContinuation(static_cast<uint8_t>(data[i]))) {
+            if (count == 0) {
+                return i;
+            }
+            --count;
+        }
+    }
+    return size;
+}
+
+size_t findJsonEscape(const char *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (needsJsonEscape(static_cast<uint8_t>(data[i]))) {
+            return i;
+        }
+    }
+    return size;
+}
+
+size_t findQuoteOrBackslash(const char *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == '"' || data[i] == '\\') {
+            return i;
+        }
+    }
+    return size;
+}
+
+} // namespace scalar
+
+constexpr TextScanKernels kScalarKernels = {
+    "scalar",
+    scalar::validateUtf8,
+    scalar::countCodePoints,
+    scalar::codePointOffset,
+    scalar::findJsonEscape,
+    scalar::findQuoteOrBackslash,
+};
+
+#ifdef AETHERIME_TEXT_SCAN_X86
+
+// UTF-8 validation follows the lookup algorithm of Keiser and Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte" (2021): three
+// nibble lookups classify every byte pair, and a second pass checks that
+// three- and four-byte sequences carry the right number of continuations.
+constexpr uint8_t kTooShort = 1 << 0;
+constexpr uint8_t kTooLong = 1 << 1;
+constexpr uint8_t kOverlong3 = 1 << 2;
+constexpr uint8_t kTooLarge = 1 << 3;
+constexpr uint8_t kSurrogate = 1 << 4;
+constexpr uint8_t kOverlong2 = 1 << 5;
+constexpr uint8_t kTooLarge1000 = 1 << 6;
+constexpr uint8_t kOverlong4 = 1 << 6;
+constexpr uint8_t kTwoConts = 1 << 7;
+constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+// Indexed by the high nibble of the first byte of a pair.
+constexpr uint8_t kByte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2,
+    kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+};
+
+// Indexed by the low nibble of the first byte of a pair.
+constexpr uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+};
+
+// Indexed by the high nibble of the second byte of a pair.
+constexpr uint8_t kByte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort,
+};
+
+// A block ending in a lead byte whose sequence continues into the next block
+// leaves a non-zero byte after saturating subtraction of this pattern.
+constexpr uint8_t kIncompleteMax[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+
+namespace avx2 {
+
+#define AETHERIME_AVX2 __attribute__((target("avx2,popcnt")))
+
+AETHERIME_AVX2 __m256i broadcastTable(const uint8_t (&table)[16]) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table)));
+}
+
+template <int N>
+AETHERIME_AVX2 __m256i previous(__m256i input, __m256i prev) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - N);
+}
+
+AETHERIME_AVX2 __m256i blockErrors(__m256i input, __m256i prev, __m256i byte1High,
+                                   __m256i byte1Low, __m256i byte2High) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i prev1 = previous<1>(input, prev);
+    const __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+    const __m256i third = _mm256_subs_epu8(previous<2>(input, prev), _mm256_set1_epi8(0xE0 - 0x80));
+    const __m256i fourth =
+        _mm256_subs_epu8(previous<3>(input, prev), _mm256_set1_epi8(char(0xF0 - 0x80)));
+    const __m256i mustContinue =
+        _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(char(0x80)));
+    return _mm256_xor_si256(mustContinue, special);
+}
+
+AETHERIME_AVX2 bool validateUtf8(const char *data, size_t size) {
+    const __m256i byte1High = broadcastTable(kByte1High);
+    const __m256i byte1Low = broadcastTable(kByte1Low);
+    const __m256i byte2High = broadcastTable(kByte2High);
+    const __m256i incompleteMax =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(kIncompleteMax));
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+
+    auto process = [&](__m256i input) AETHERIME_AVX2 {
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prevIncomplete);
+        } else {
+            error = _mm256_or_si256(error, blockErrors(input, prev, byte1High, byte1Low, byte2High));
+            prevIncomplete = _mm256_subs_epu8(input, incompleteMax);
+        }
+        prev = input;
+    };
+
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        process(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos)));
+    }
+    // The zero padding ends any sequence left open by the tail.
+    alignas(32) char tail[32] = {};
+    std::memcpy(tail, data + pos, size - pos);
+    process(_mm256_load_si256(reinterpret_cast<const __m256i *>(tail)));
+    return _mm256_testz_si256(error, error);
+}
+
+AETHERIME_AVX2 uint32_t leadMask(const char *data) {
+    const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    // Continuation bytes are 0x80..0xBF, i.e. -128..-65 as signed bytes.
+    return static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpgt_epi8(input, _mm256_set1_epi8(-65))));
+}
+
+AETHERIME_AVX2 size_t countCodePoints(const char *data, size_t size) {
+    size_t count = 0;
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        count += static_cast<size_t>(__builtin_popcount(leadMask(data + pos)));
+    }
+    return count + scalar::countCodePoints(data + pos, size - pos);
+}
+
+AETHERIME_AVX2 size_t codePointOffset(const char *data, size_t size, size_t count) {
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        uint32_t mask = leadMask(data + pos);
+        const auto leads = static_cast<size_t>(__builtin_popcount(mask));
+        if (leads <= count) {
+            count -= leads;
+            continue;
+        }
+        for (; count > 0; --count) {
+            mask &= mask - 1;
+        }
+        return pos + static_cast<size_t>(__builtin_ctz(mask));
+    }
+    return pos + scalar::codePointOffset(data + pos, size - pos, count);
+}
+
+AETHERIME_AVX2 size_t findJsonEscape(const char *data, size_t size) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+        const __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(input, quote), _mm256_cmpeq_epi8(input, backslash)),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(input, control), input));
+        if (const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(special))) {
+            return pos + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return pos + scalar::findJsonEscape(data + pos, size - pos);
+}
+
+AETHERIME_AVX2 size_t findQuoteOrBackslash(const char *data, size_t size) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+        const __m256i special =
+            _mm256_or_si256(_mm256_cmpeq_epi8(input, quote), _mm256_cmpeq_epi8(input, backslash));
+        if (const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(special))) {
+            return pos + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return pos + scalar::findQuoteOrBackslash(data + pos, size - pos);
+}
+
+#undef AETHERIME_AVX2
+
+} // namespace avx2
+
+namespace sse42 {
+
+#define AETHERIME_SSE42 __attribute__((target("sse4.2,popcnt")))
+
+AETHERIME_SSE42 __m128i loadTable(const uint8_t (&table)[16]) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(table));
+}
+
+AETHERIME_SSE42 __m128i blockErrors(__m128i input, __m128i prev, __m128i byte1High,
+                                    __m128i byte1Low, __m128i byte2High) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+    const __m128i special = _mm_and_si128(
+        _mm_and_si128(_mm_shuffle_epi8(byte1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                      _mm_shuffle_epi8(byte1Low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte2High, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+    const __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, prev, 14), _mm_set1_epi8(0xE0 - 0x80));
+    const __m128i fourth =
+        _mm_subs_epu8(_mm_alignr_epi8(input, prev, 13), _mm_set1_epi8(char(0xF0 - 0x80)));
+    const __m128i mustContinue =
+        _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(char(0x80)));
+    return _mm_xor_si128(mustContinue, special);
+}
+
+AETHERIME_SSE42 bool validateUtf8(const char *data, size_t size) {
+    const __m128i byte1High = loadTable(kByte1High);
+    const __m128i byte1Low = loadTable(kByte1Low);
+    const __m128i byte2High = loadTable(kByte2High);
+    const __m128i incompleteMax =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(kIncompleteMax + 16));
+    __m128i error = _mm_setzero_si128();
+    __m128i prev = _mm_setzero_si128();
+    __m128i prevIncomplete = _mm_setzero_si128();
+
+    auto process = [&](__m128i input) AETHERIME_SSE42 {
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, prevIncomplete);
+        } else {
+            error = _mm_or_si128(error, blockErrors(input, prev, byte1High, byte1Low, byte2High));
+            prevIncomplete = _mm_subs_epu8(input, incompleteMax);
+        }
+        prev = input;
+    };
+
+    size_t pos = 0;
+    for (; pos + 16 <= size; pos += 16) {
+        process(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos)));
+    }
+    alignas(16) char tail[16] = {};
+    std::memcpy(tail, data + pos, size - pos);
+    process(_mm_load_si128(reinterpret_cast<const __m128i *>(tail)));
+    return _mm_testz_si128(error, error);
+}
+
+AETHERIME_SSE42 uint32_t leadMask(const char *data) {
+    const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(input, _mm_set1_epi8(-65))));
+}
+
+AETHERIME_SSE42 size_t countCodePoints(const char *data, size_t size) {
+    size_t count = 0;
+    size_t pos = 0;
+    for (; pos + 16 <= size; pos += 16) {
+        count += static_cast<size_t>(__builtin_popcount(leadMask(data + pos)));
+    }
+    return count + scalar::countCodePoints(data + pos, size - pos);
+}
+
+AETHERIME_SSE42 size_t codePointOffset(const char *data, size_t size, size_t count) {
+    size_t pos = 0;
+    for (; pos + 16 <= size; pos += 16) {
+        uint32_t mask = leadMask(data + pos);
+        const auto leads = static_cast<size_t>(__builtin_popcount(mask));
+        if (leads <= count) {
+            count -= leads;
+            continue;
+        }
+        for (; count > 0; --count) {
+            mask &= mask - 1;
+        }
+        return pos + static_cast<size_t>(__builtin_ctz(mask));
+    }
+    return pos + scalar::codePointOffset(data + pos, size - pos, count);
+}
+
+AETHERIME_SSE42 size_t findJsonEscape(const char *data, size_t size) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    size_t pos = 0;
+    for (; pos + 16 <= size; pos += 16) {
+        const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        const __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(input, quote), _mm_cmpeq_epi8(input, backslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(input, control), input));
+        if (const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(special))) {
+            return pos + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return pos + scalar::findJsonEscape(data + pos, size - pos);
+}
+
+AETHERIME_SSE42 size_t findQuoteOrBackslash(const char *data, size_t size) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t pos = 0;
+    for (; pos + 16 <= size; pos += 16) {
+        const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        const __m128i special =
+            _mm_or_si128(_mm_cmpeq_epi8(input, quote), _mm_cmpeq_epi8(input, backslash));
+        if (const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(special))) {
+            return pos + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return pos + scalar::findQuoteOrBackslash(data + pos, size - pos);
+}
+
+#undef AETHERIME_SSE42
+
+} // namespace sse42
+
+constexpr TextScanKernels kAvx2Kernels = {
+    "avx2",
+    avx2::validateUtf8,
+    avx2::countCodePoints,
+    avx2::codePointOffset,
+    avx2::findJsonEscape,
+    avx2::findQuoteOrBackslash,
+};
+
+constexpr TextScanKernels kSse42Kernels = {
+    "sse4.2",
+    sse42::validateUtf8,
+    sse42::countCodePoints,
+    sse42::codePointOffset,
+    sse42::findJsonEscape,
+    sse42::findQuoteOrBackslash,
+};
+
+bool supportsAvx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+bool supportsSse42() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+}
+
+#endif
+
+const TextScanKernels &selectKernels() {
+#ifdef AETHERIME_TEXT_SCAN_X86
+    if (supportsAvx2()) {
+        return kAvx2Kernels;
+    }
+    if (supportsSse42()) {
+        return kSse42Kernels;
+    }
+#endif
+    return kScalarKernels;
+}
+
+} // namespace
+
+const TextScanKernels &textScanKernels() {
+    static const TextScanKernels &kernels = selectKernels();
+    return kernels;
+}
+
+const TextScanKernels *textScanKernels(std::string_view name) {
+    if (name == kScalarKernels.name) {
+        return &kScalarKernels;
+    }
+#ifdef AETHERIME_TEXT_SCAN_X86
+    if (name == kAvx2Kernels.name && supportsAvx2()) {
+        return &kAvx2Kernels;
+    }
+    if (name == kSse42Kernels.name && supportsSse42()) {
+        return &kSse42Kernels;
+    }
+#endif
+    return nullptr;
+}
+
+} // namespace aetherime
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace aetherime {
+
+// Byte-scanning kernels for the prediction path. Each implementation is a
+// table of plain functions; the best one the CPU supports is chosen once at
+// first use (AVX2, then SSE4.2, then scalar).
+struct TextScanKernels {
+    const char *name;
+    bool (*validateUtf8)(const char *data, size_t size);
+    // Number of code points in valid UTF-8.
+    size_t (*countCodePoints)(const char *data, size_t size);
+    // Byte offset just past the first count code points of valid UTF-8, or
+    // size if the text is shorter.
+    size_t (*codePointOffset)(const char *data, size_t size, size_t count);
+    // Index of the first byte a JSON string literal must escape ('"', '\\'
+    // or a control character), or size if there is none.
+    size_t (*findJsonEscape)(const char *data, size_t size);
+    // Index of the first '"' or '\\', or size if there is none.
+    size_t (*findQuoteOrBackslash)(const char *data, size_t size);
+};
+
+const TextScanKernels &textScanKernels();
+
+// A specific implementation ("avx2", "sse4.2" or "scalar"), or null if the
+// CPU or the build does not support it. Used by benchmarks.
+const TextScanKernels *textScanKernels(std::string_view name);
+
+inline bool validateUtf8(std::string_view text) {
+    return textScanKernels().validateUtf8(text.data(), text.size());
+}
+
+inline size_t countCodePoints(std::string_view text) {
+    return textScanKernels().countCodePoints(text.data(), text.size());
+}
+
+inline size_t codePointOffset(std::string_view text, size_t count) {
+    return textScanKernels().codePointOffset(text.data(), text.size(), count);
+}
+
+inline size_t findJsonEscape(std::string_view text, size_t from = 0) {
+    return from + textScanKernels().findJsonEscape(text.data() + from, text.size() - from);
+}
+
+inline size_t findQuoteOrBackslash(std::string_view text, size_t from = 0) {
+    return from + textScanKernels().findQuoteOrBackslash(text.data() + from, text.size() - from);
+}
+
+} // namespace aetherime
@@ -0,0 +1,144 @@
+#include "text_window.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "text_scan.hpp"
+
+namespace aetherime {
+
+namespace {
+
+// Edits larger than this are treated as an unrelated text and rescanned.
+constexpr size_t kMaxIncrementalBytes = 4096;
+constexpr size_t kCompareBlock = 64;
+
+bool isContinuation(char c) { return (static_cast<unsigned char>(c) & 0xC0) == 0x80; }
+
+size_t advanceChars(std::string_view text, size_t byte, size_t count) {
+    return byte + codePointOffset(text.substr(byte), count);
+}
+
+size_t retreatChars(std::string_view text, size_t byte, size_t count) {
+    while (count > 0 && byte > 0) {
+        --byte;
+        while (byte > 0 && isContinuation(text[byte])) {
+            --byte;
+        }
+        --count;
+    }
+    return byte;
+}
+
+size_t commonPrefix(std::string_view lhs, std::string_view rhs) {
+    const size_t limit = std::min(lhs.size(), rhs.size());
+    size_t length = 0;
+    while (length + kCompareBlock <= limit &&
+           std::memcmp(lhs.data() + length, rhs.data() + length, kCompareBlock) == 0) {
+        length += kCompareBlock;
+    }
+    while (length < limit && lhs[length] == rhs[length]) {
+        ++length;
+    }
+    return length;
+}
+
+size_t commonSuffix(std::string_view lhs, std::string_view rhs, size_t limit) {
+    const char *lhsEnd = lhs.data() + lhs.size();
+    const char *rhsEnd = rhs.data() + rhs.size();
+    size_t length = 0;
+    while (length + kCompareBlock <= limit &&
+           std::memcmp(lhsEnd - length - kCompareBlock, rhsEnd - length - kCompareBlock,
+                       kCompareBlock) == 0) {
+        length += kCompareBlock;
+    }
+    while (length < limit && lhsEnd[-static_cast<ptrdiff_t>(length) - 1] ==
+                                 rhsEnd[-static_cast<ptrdiff_t>(length) - 1]) {
+        ++length;
+    }
+    return length;
+}
+
+} // namespace
+
+SurroundingWindow::SurroundingWindow(size_t beforeChars, size_t afterChars)
+    : beforeChars_(beforeChars), afterChars_(afterChars) {}
+
+bool SurroundingWindow::update(std::string_view text, size_t cursorChars) {
+    if (!valid_) {
+        return rescan(text, cursorChars);
+    }
+
+    const std::string_view old = text_;
+    size_t prefix = commonPrefix(old, text);
+    while (prefix > 0 && ((prefix < old.size() && isContinuation(old[prefix])) ||
+                          (prefix < text.size() && isContinuation(text[prefix])))) {
+        --prefix;
+    }
+    size_t suffix = commonSuffix(old, text, std::min(old.size(), text.size()) - prefix);
+    while (suffix > 0 && isContinuation(text[text.size() - suffix])) {
+        --suffix;
+    }
+    const auto oldMiddle = old.substr(prefix, old.size() - suffix - prefix);
+    const auto newMiddle = text.substr(prefix, text.size() - suffix - prefix);
+    if (std::max(oldMiddle.size(), newMiddle.size()) > kMaxIncrementalBytes) {
+        return rescan(text, cursorChars);
+    }
+    if (!validateUtf8(newMiddle)) {
+        reset();
+        return false;
+    }
+
+    // Character index of the first changed byte, counted from the old
+    // cursor, which is usually right next to the edit.
+    const size_t prefixChars =
+        prefix <= cursorByte_
+            ? cursorChars_ - countCodePoints(old.substr(prefix, cursorByte_ - prefix))
+            : cursorChars_ + countCodePoints(old.substr(cursorByte_, prefix - cursorByte_));
+    totalChars_ = totalChars_ - countCodePoints(oldMiddle) + countCodePoints(newMiddle);
+    text_.replace(prefix, oldMiddle.size(), newMiddle);
+
+    cursorChars_ = std::min(cursorChars, totalChars_);
+    cursorByte_ = cursorChars_ >= prefixChars
+                      ? advanceChars(text_, prefix, cursorChars_ - prefixChars)
+                      : retreatChars(text_, prefix, prefixChars - cursorChars_);
+    placeWindow(cursorChars_);
+    ++stats_.incrementalUpdates;
+    return true;
+}
+
+bool SurroundingWindow::rescan(std::string_view text, size_t cursorChars) {
+    if (!validateUtf8(text)) {
+        reset();
+        return false;
+    }
+    text_.assign(text.data(), text.size());
+    totalChars_ = countCodePoints(text_);
+    cursorChars_ = std::min(cursorChars, totalChars_);
+    cursorByte_ = advanceChars(text_, 0, cursorChars_);
+    placeWindow(cursorChars_);
+    valid_ = true;
+    ++stats_.rescans;
+    return true;
+}
+
+void SurroundingWindow::placeWindow(size_t cursorChars) {
+    startByte_ = retreatChars(text_, cursorByte_, std::min(beforeChars_, cursorChars));
+    endByte_ = advanceChars(text_, cursorByte_, afterChars_);
+}
+
+void SurroundingWindow::reset() {
+    valid_ = false;
+    text_.clear();
+    totalChars_ = cursorChars_ = cursorByte_ = startByte_ = endByte_ = 0;
+}
+
+std::string_view SurroundingWindow::before() const {
+    return std::string_view(text_).substr(startByte_, cursorByte_ - startByte_);
+}
+
+std::string_view SurroundingWindow::after() const {
+    return std::string_view(text_).substr(cursorByte_, endByte_ - cursorByte_);
+}
+
+} // namespace aetherime
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace aetherime {
+
+struct TextWindowStats {
+    uint64_t rescans = 0;
+    uint64_t incrementalUpdates = 0;
+};
+
+// Tracks the characters around the cursor in an application's surrounding
+// text. The previous text is kept so that an edit only costs a comparison
+// against it plus work proportional to the changed bytes and the window
+// size; an unrelated text is scanned from scratch.
+class SurroundingWindow {
+public:
+    SurroundingWindow(size_t beforeChars, size_t afterChars);
+
+    // Updates the window for text with the cursor at cursorChars code
+    // points. Returns false if text is not valid UTF-8. The views returned
+    // by before() and after() stay valid until the next update or reset.
+    bool update(std::string_view text, size_t cursorChars);
+    void reset();
+
+    std::string_view before() const;
+    std::string_view after() const;
+    const TextWindowStats &stats() const { return stats_; }
+
+private:
+    bool rescan(std::string_view text, size_t cursorChars);
+    void placeWindow(size_t cursorChars);
+
+    size_t beforeChars_;
+    size_t afterChars_;
+    bool valid_ = false;
+    std::string text_;
+    size_t totalChars_ = 0;
+    size_t cursorChars_ = 0;
+    size_t cursorByte_ = 0;
+    size_t startByte_ = 0;
+    size_t endByte_ = 0;
+    TextWindowStats stats_;
+};
+
+} // namespace aetherime
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+
+#include <fcitx-utils/event.h>
+
+#include "mock_daemon.hpp"
+#include "prediction_dispatcher.hpp"
+
+namespace aetherime {
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                                           \
+    do {                                                                                           \
+        if (!(condition)) {                                                                        \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);    \
+            ++failures;                                                                            \
+        }                                                                                          \
+    } while (0)
+
+PredictionRequest request() {
+    PredictionRequest request;
+    request.prefix = "我们下午三点";
+    request.latencyBudgetMs = 5000;
+    return request;
+}
+
+void runFor(fcitx::EventLoop &loop, uint64_t usec) {
+    auto stop = loop.addTimeEvent(CLOCK_MONOTONIC, fcitx::now(CLOCK_MONOTONIC) + usec, 0,
+                                  [&loop](fcitx::EventSourceTime *, uint64_t) {
+                                      loop.exit();
+                                      return true;
+                                  });
+    loop.exec();
+}
+
+// A request sent while the daemon has gone away takes the connection down
+// with it, failing the requests already in flight. Their callbacks must not
+// run inside submit(), where the dispatcher is still starting the new job.
+void failureWhileSubmitting() {
+    fcitx::EventLoop loop;
+    auto daemon = std::make_unique<bench::MockDaemon>(bench::MockDaemonOptions{});
+    CHECK(!daemon->socketPath().empty());
+    PredictionDispatcher dispatcher(daemon->socketPath(), &loop, nullptr, 2);
+    dispatcher.client().setSharedMemory(false);
+    CHECK(dispatcher.client().ping());
+
+    const int first = 0;
+    const int second = 0;
+    bool submitting = false;
+    int firstCalls = 0;
+    bool firstCalledWhileSubmitting = false;
+    std::unique_ptr<DispatchedPrediction> resubmitted;
+    auto firstPending = dispatcher.submit(
+        &first, PredictionKind::Ghost, request(), [&](std::optional<PredictionResult> result) {
+            ++firstCalls;
+            firstCalledWhileSubmitting = submitting;
+            CHECK(!result);
+            // Owners typically ask again right away.
+            resubmitted = dispatcher.submit(&first, PredictionKind::Ghost, request(),
+                                            [](std::optional<PredictionResult>) {});
+        });
+    CHECK(firstPending != nullptr);
+
+    // Its reply stays unread in the socket; the daemon is gone before the
+    // event loop runs.
+    daemon.reset();
+    submitting = true;
+    auto secondPending = dispatcher.submit(&second, PredictionKind::Ghost, request(),
+                                           [](std::optional<PredictionResult>) {});
+    submitting = false;
+    CHECK(secondPending == nullptr);
+    CHECK(firstCalls == 0);
+
+    runFor(loop, 100000);
+    CHECK(firstCalls == 1);
+    CHECK(!firstCalledWhileSubmitting);
+    CHECK(resubmitted == nullptr);
+    CHECK(dispatcher.stats().inFlight == 0);
+}
+
+} // namespace
+} // namespace aetherime
+
+int main() {
+    aetherime::failureWhileSubmitting();
+    if (aetherime::failures != 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", aetherime::failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lexicon.hpp"
+#include "text_fields.hpp"
+
+namespace {
+
+constexpr uint32_t kDefaultTopK = 16;
+
+void usage(const char *program) {
+    std::fprintf(stderr, "usage: %s [--top-k N] input.tsv output.lex\n", program);
+}
+
+bool parseFrequency(std::string_view field, uint32_t &frequency) {
+    uint64_t value = 0;
+    if (!aetherime::parseNumber(field, value) || value > UINT32_MAX) {
+        return false;
+    }
+    frequency = static_cast<uint32_t>(value);
+    return true;
+}
+
+} // namespace
+
+// Converts a word-frequency list into the mmap lexicon format. Each line is
+// either "key<TAB>text<TAB>frequency" or "word<TAB>frequency", where the word
+// is its own key. Empty lines and lines starting with '#' are ignored.
+int main(int argc, char **argv) {
+    uint32_t topK = kDefaultTopK;
+    int arg = 1;
+    if (arg < argc && std::string_view(argv[arg]) == "--top-k") {
+        if (arg + 1 >= argc || !parseFrequency(argv[arg + 1], topK) || topK == 0 ||
+            topK > UINT16_MAX) {
+            usage(argv[0]);
+            return 2;
+        }
+        arg += 2;
+    }
+    if (argc - arg != 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::ifstream input(argv[arg]);
+    if (!input) {
+        std::fprintf(stderr, "cannot open %s\n", argv[arg]);
+        return 1;
+    }
+
+    std::vector<aetherime::LexiconSourceEntry> entries;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(input, line)) {
+        ++lineNumber;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+        const auto fields = aetherime::splitTabs(line);
+        aetherime::LexiconSourceEntry entry;
+        if ((fields.size() != 2 && fields.size() != 3) || fields.front().empty() ||
+            !parseFrequency(fields.back(), entry.frequency)) {
+            std::fprintf(stderr, "%s:%zu: expected key, text and frequency\n", argv[arg],
+                         lineNumber);
+            return 1;
+        }
+        entry.key = fields[0];
+        entry.text = fields.size() == 3 ? fields[1] : fields[0];
+        entries.push_back(std::move(entry));
+    }
+
+    const auto count = entries.size();
+    if (!aetherime::writeLexicon(argv[arg + 1], std::move(entries), topK)) {
+        std::fprintf(stderr, "cannot write %s\n", argv[arg + 1]);
+        return 1;
+    }
+    std::printf("wrote %zu entries to %s\n", count, argv[arg + 1]);
+    return 0;
+}